@@ -0,0 +1,230 @@
+// atlas.h - packs the facade textures into a single texture
+//
+// Rectangles are placed with a skyline bottom-left packer. Every image gets a
+// gutter of repeated edge texels around it so the mip levels don't pull in
+// the neighbours (a gutter of g texels is safe down to mip level log2(g)).
+//
+// Used by the atlaspack tool to write atlas.bmp + atlas.txt at build time, and by
+// setup_textures() to pack in memory when those files haven't been made.
+
+#ifndef ATLAS_H
+#define ATLAS_H
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <algorithm>
+
+#include <string.h>
+
+#include "bitmap.h"
+
+typedef struct AtlasRect_struct {
+	std::string name;
+	int x, y, w, h; // texels, without the gutter
+	float u0, v0, u1, v1;
+} AtlasRect_t;
+
+class TextureAtlas {
+	private:
+		typedef struct SkylineNode_struct {
+			int x, y, w;
+		} SkylineNode_t;
+
+		std::vector<SkylineNode_t> m_skyline;
+
+		// lowest y a w-by-h rectangle can sit at when its left edge is on skyline node i, -1 if it doesn't fit
+		int fit(int i, int w, int h) {
+			int x = m_skyline[i].x;
+			if (x + w > width) return -1;
+
+			int y = 0;
+			int remaining = w;
+			while (remaining > 0) {
+				if (i == (int) m_skyline.size()) return -1;
+				y = std::max(y, m_skyline[i].y);
+				if (y + h > height) return -1;
+				remaining -= m_skyline[i].w;
+				i++;
+			}
+			return y;
+		}
+
+		void add_level(int i, int x, int y, int w) {
+			SkylineNode_t node = { x, y, w };
+			m_skyline.insert(m_skyline.begin() + i, node);
+
+			// eat up whatever the new node shadows
+			for (size_t j = i + 1; j < m_skyline.size(); j++) {
+				int shadow = m_skyline[j - 1].x + m_skyline[j - 1].w - m_skyline[j].x;
+				if (shadow <= 0) break;
+
+				m_skyline[j].x += shadow;
+				m_skyline[j].w -= shadow;
+				if (m_skyline[j].w > 0) break;
+
+				m_skyline.erase(m_skyline.begin() + j);
+				j--;
+			}
+
+			// merge neighbours at the same height
+			for (size_t j = 0; j + 1 < m_skyline.size(); j++) {
+				if (m_skyline[j].y == m_skyline[j + 1].y) {
+					m_skyline[j].w += m_skyline[j + 1].w;
+					m_skyline.erase(m_skyline.begin() + j + 1);
+					j--;
+				}
+			}
+		}
+
+		// bottom-left placement, returns false when the atlas is full
+		bool place(int w, int h, int &out_x, int &out_y) {
+			int best = -1, best_y = height, best_x = width;
+			for (size_t i = 0; i < m_skyline.size(); i++) {
+				int y = fit(i, w, h);
+				if (y < 0) continue;
+				if (y < best_y || (y == best_y && m_skyline[i].x < best_x)) {
+					best = i;
+					best_y = y;
+					best_x = m_skyline[i].x;
+				}
+			}
+			if (best < 0) return false;
+
+			add_level(best, best_x, best_y + h, w);
+			out_x = best_x;
+			out_y = best_y;
+			return true;
+		}
+
+		bool pack(std::vector<AtlasRect_t> &rects, int w, int h) {
+			width = w;
+			height = h;
+			m_skyline.clear();
+			SkylineNode_t root = { 0, 0, width };
+			m_skyline.push_back(root);
+
+			// tallest first packs noticeably tighter on a skyline
+			std::vector<int> order(rects.size());
+			for (size_t i = 0; i < order.size(); i++) order[i] = i;
+			for (size_t i = 1; i < order.size(); i++) {
+				for (size_t j = i; j > 0 && rects[order[j]].h > rects[order[j - 1]].h; j--) {
+					std::swap(order[j], order[j - 1]);
+				}
+			}
+
+			for (size_t i = 0; i < order.size(); i++) {
+				AtlasRect_t &r = rects[order[i]];
+				int x, y;
+				if (!place(r.w + 2 * gutter, r.h + 2 * gutter, x, y)) return false;
+				r.x = x + gutter;
+				r.y = y + gutter;
+			}
+			return true;
+		}
+
+		void update_uvs() {
+			for (size_t i = 0; i < rects.size(); i++) {
+				AtlasRect_t &r = rects[i];
+				r.u0 = (float) r.x / width;
+				r.v0 = (float) r.y / height;
+				r.u1 = (float) (r.x + r.w) / width;
+				r.v1 = (float) (r.y + r.h) / height;
+			}
+		}
+
+	public:
+		int width, height;
+		int gutter;
+		std::vector<AtlasRect_t> rects; // same order the images were handed in
+
+		TextureAtlas() : width(0), height(0), gutter(8) {}
+
+		// packs the images and fills out with the atlas texels (RGBA, bitmap row order)
+		bool build(std::vector<CBitmap*> &images, std::vector<std::string> &names, std::vector<RGBA> &out) {
+			rects.clear();
+			int area = 0;
+			for (size_t i = 0; i < images.size(); i++) {
+				AtlasRect_t r;
+				r.name = names[i];
+				r.x = r.y = 0;
+				r.w = images[i]->GetWidth();
+				r.h = images[i]->GetHeight();
+				if (r.w == 0 || r.h == 0) return false;
+				rects.push_back(r);
+				area += (r.w + 2 * gutter) * (r.h + 2 * gutter);
+			}
+
+			// smallest power of two square that could hold it, growing until it does
+			int side = 1;
+			while (side * side < area) side *= 2;
+			while (!pack(rects, side, side)) {
+				side *= 2;
+				if (side > 16384) return false;
+			}
+
+			// trim the unused top off (still a power of two)
+			int used = 0;
+			for (size_t i = 0; i < rects.size(); i++) {
+				used = std::max(used, rects[i].y + rects[i].h + gutter);
+			}
+			height = 1;
+			while (height < used) height *= 2;
+
+			out.assign(width * height, RGBA());
+			for (size_t i = 0; i < rects.size(); i++) {
+				AtlasRect_t &r = rects[i];
+				RGBA *src = (RGBA*) images[i]->GetBits();
+
+				// copy with the edge texels smeared out into the gutter
+				for (int y = -gutter; y < r.h + gutter; y++) {
+					int sy = std::min(std::max(y, 0), r.h - 1);
+					RGBA *dst = &out[(r.y + y) * width + r.x];
+					for (int x = -gutter; x < 0; x++) dst[x] = src[sy * r.w];
+					memcpy(dst, &src[sy * r.w], r.w * sizeof(RGBA));
+					for (int x = r.w; x < r.w + gutter; x++) dst[x] = src[sy * r.w + r.w - 1];
+				}
+			}
+
+			update_uvs();
+			return true;
+		}
+
+		// atlas.txt: "size <w> <h>" followed by one "<name> <x> <y> <w> <h>" line per image
+		bool save(const char *filename) {
+			std::ofstream file(filename);
+			if (!file.is_open()) return false;
+
+			file << "size " << width << " " << height << std::endl;
+			for (size_t i = 0; i < rects.size(); i++) {
+				file << rects[i].name << " " << rects[i].x << " " << rects[i].y << " " << rects[i].w << " " << rects[i].h << std::endl;
+			}
+			return file.good();
+		}
+
+		bool load(const char *filename) {
+			std::ifstream file(filename);
+			if (!file.is_open()) return false;
+
+			std::string tag;
+			if (!(file >> tag >> width >> height) || tag != "size") return false;
+
+			rects.clear();
+			AtlasRect_t r;
+			while (file >> r.name >> r.x >> r.y >> r.w >> r.h) {
+				rects.push_back(r);
+			}
+
+			update_uvs();
+			return !rects.empty();
+		}
+
+		int find(const std::string &name) {
+			for (size_t i = 0; i < rects.size(); i++) {
+				if (rects[i].name == name) return i;
+			}
+			return -1;
+		}
+};
+
+#endif
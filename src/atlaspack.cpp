@@ -0,0 +1,61 @@
+// atlaspack.cpp - build time texture atlas packer
+// Packs BMPs into one atlas bitmap plus a text table of where each one went (see atlas.h).
+//
+// usage: atlaspack [-gutter N] atlas.bmp atlas.txt input.bmp...
+
+#include <string>
+#include <vector>
+#include <iostream>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "bitmap.h"
+#include "atlas.h"
+
+using namespace std;
+
+int main(int argc, char **argv) {
+	TextureAtlas atlas;
+	vector<const char*> files;
+
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-gutter") == 0 && i + 1 < argc) atlas.gutter = atoi(argv[++i]);
+		else files.push_back(argv[i]);
+	}
+
+	if (files.size() < 3) {
+		cout << "usage: atlaspack [-gutter N] atlas.bmp atlas.txt input.bmp..." << endl;
+		return 1;
+	}
+
+	vector<CBitmap*> images;
+	vector<string> names;
+	for (size_t i = 2; i < files.size(); i++) {
+		CBitmap *image = new CBitmap();
+		if (!image->Load(files[i])) {
+			cout << "Could not load " << files[i] << endl;
+			return 1;
+		}
+		images.push_back(image);
+		names.push_back(files[i]);
+	}
+
+	vector<RGBA> texels;
+	if (!atlas.build(images, names, texels)) {
+		cout << "Could not pack the atlas." << endl;
+		return 1;
+	}
+
+	CBitmap output;
+	output.SetBits(&texels[0], atlas.width, atlas.height, 0x000000ff, 0x0000ff00, 0x00ff0000, 0xff000000);
+	if (!output.Save(files[0]) || !atlas.save(files[1])) {
+		cout << "Could not write the atlas." << endl;
+		return 1;
+	}
+
+	cout << names.size() << " images -> " << files[0] << " (" << atlas.width << "x" << atlas.height << ")" << endl;
+
+	for (size_t i = 0; i < images.size(); i++) delete images[i];
+	return 0;
+}
@@ -4,7 +4,7 @@
  *
  * Supported Formats: 1, 4, 8, 16, 24, 32 Bit Images
  * Alpha Bitmaps are also supported.
- * Supported compression types: RLE 8, BITFIELDS
+ * Supported compression types: RLE 8, RLE 4, BITFIELDS
  *
  * Created by: Benjamin Kalytta, 2006 - 2012
  * Thanks for bug fixes goes to: Chris Campbell
@@ -24,9 +24,18 @@
 #include <iostream>
 #include <fstream>
 #include <string>
+#include <vector>
+#include <algorithm>
 
 #include <string.h>
 
+#ifdef __SSE2__
+	#include <emmintrin.h>
+#endif
+#ifdef __SSSE3__
+	#include <tmmintrin.h>
+#endif
+
 #ifndef __LITTLE_ENDIAN__
 	#ifndef __BIG_ENDIAN__
 		#define __LITTLE_ENDIAN__
@@ -128,6 +137,9 @@ public:
 		}
 
 		static inline unsigned int ComponentByMask(unsigned int Color, unsigned int Mask) {
+			if (Mask == 0) {
+				return 0;
+			}
 			unsigned int Component = Color & Mask;
 			return Component >> BitPositionByMask(Mask);
 		}
@@ -149,6 +161,375 @@ public:
 		}
 	};
 
+	/* Decodes one uncompressed (BI_RGB) or BITFIELDS file line into RGBA. Shared by Load and CBitmapReader. */
+
+	static void DecodeLine(const uint8_t *Line, RGBA *Output, unsigned int Width, const BITMAP_HEADER &Header, const BGRA *ColorTable) {
+		const uint8_t *LinePtr = Line;
+
+		if (Header.Compression == 3) {
+			/* We assumes that mask of each color component can be in any order */
+
+			uint32_t BitCountRed = CColor::BitCountByMask(Header.RedMask);
+			uint32_t BitCountGreen = CColor::BitCountByMask(Header.GreenMask);
+			uint32_t BitCountBlue = CColor::BitCountByMask(Header.BlueMask);
+			uint32_t BitCountAlpha = CColor::BitCountByMask(Header.AlphaMask);
+
+			for (unsigned int j = 0; j < Width; j++) {
+				uint32_t Color = 0;
+
+				if (Header.BitCount == 16) {
+					Color = *((uint16_t*) LinePtr);
+					LinePtr += 2;
+				} else if (Header.BitCount == 32) {
+					Color = *((uint32_t*) LinePtr);
+					LinePtr += 4;
+				} else {
+					// Other formats are not valid
+				}
+				Output[j].Red = CColor::Convert(CColor::ComponentByMask(Color, Header.RedMask), BitCountRed, 8);
+				Output[j].Green = CColor::Convert(CColor::ComponentByMask(Color, Header.GreenMask), BitCountGreen, 8);
+				Output[j].Blue = CColor::Convert(CColor::ComponentByMask(Color, Header.BlueMask), BitCountBlue, 8);
+				Output[j].Alpha = CColor::Convert(CColor::ComponentByMask(Color, Header.AlphaMask), BitCountAlpha, 8);
+			}
+			return;
+		}
+
+		for (unsigned int j = 0; j < Width; j++) {
+			if (Header.BitCount == 1) {
+				uint32_t Color = *((uint8_t*) LinePtr);
+				for (unsigned int k = 0; k < 8 && j < Width; k++) {
+					const BGRA &Entry = ColorTable[Color & 0x80 ? 1 : 0];
+					Output[j].Red = Entry.Red;
+					Output[j].Green = Entry.Green;
+					Output[j].Blue = Entry.Blue;
+					Output[j].Alpha = Entry.Alpha;
+					Color <<= 1;
+					j++;
+				}
+				LinePtr++;
+				j--;
+			} else if (Header.BitCount == 4) {
+				uint32_t Color = *((uint8_t*) LinePtr);
+				const BGRA &High = ColorTable[(Color >> 4) & 0x0f];
+				Output[j].Red = High.Red;
+				Output[j].Green = High.Green;
+				Output[j].Blue = High.Blue;
+				Output[j].Alpha = High.Alpha;
+				if (j + 1 < Width) {
+					const BGRA &Low = ColorTable[Color & 0x0f];
+					j++;
+					Output[j].Red = Low.Red;
+					Output[j].Green = Low.Green;
+					Output[j].Blue = Low.Blue;
+					Output[j].Alpha = Low.Alpha;
+				}
+				LinePtr++;
+			} else if (Header.BitCount == 8) {
+				const BGRA &Entry = ColorTable[*LinePtr];
+				Output[j].Red = Entry.Red;
+				Output[j].Green = Entry.Green;
+				Output[j].Blue = Entry.Blue;
+				Output[j].Alpha = Entry.Alpha;
+				LinePtr++;
+			} else if (Header.BitCount == 16) {
+				uint32_t Color = *((uint16_t*) LinePtr);
+				Output[j].Red = ((Color >> 10) & 0x1f) << 3;
+				Output[j].Green = ((Color >> 5) & 0x1f) << 3;
+				Output[j].Blue = (Color & 0x1f) << 3;
+				Output[j].Alpha = 255;
+				LinePtr += 2;
+			} else if (Header.BitCount == 24) {
+				/* byte wise, a 32 bit read would run past the end of the last line */
+				Output[j].Blue = LinePtr[0];
+				Output[j].Green = LinePtr[1];
+				Output[j].Red = LinePtr[2];
+				Output[j].Alpha = 255;
+				LinePtr += 3;
+			} else if (Header.BitCount == 32) {
+				uint32_t Color = *((uint32_t*) LinePtr);
+				Output[j].Blue = Color & 0xff;
+				Output[j].Green = (Color >> 8) & 0xff;
+				Output[j].Red = (Color >> 16) & 0xff;
+				Output[j].Alpha = Color >> 24;
+				LinePtr += 4;
+			}
+		}
+	}
+
+	/* Color table converted once, so RLE runs are a plain 32 bit fill */
+
+	static void MakePalette(const BGRA *ColorTable, RGBA *Palette, unsigned int Count) {
+		for (unsigned int i = 0; i < Count; i++) {
+			Palette[i].Red = ColorTable[i].Red;
+			Palette[i].Green = ColorTable[i].Green;
+			Palette[i].Blue = ColorTable[i].Blue;
+			Palette[i].Alpha = ColorTable[i].Alpha;
+		}
+	}
+
+	enum { RLE_END_OF_LINE, RLE_DELTA, RLE_END_OF_BITMAP, RLE_NEED_MORE };
+
+	/* Decodes RLE 8 / RLE 4 opcodes from [Src, End) into one row, starting at column x, until the row is done.
+	 *
+	 * Returns what ended it. Src and x are only advanced past complete opcodes, so after RLE_NEED_MORE the
+	 * caller can supply more data and call again. For RLE_DELTA, x is the column to continue at and dy the
+	 * number of rows skipped. Runs are clipped to the row width.
+	 */
+
+	static int DecodeRLERow(const uint8_t *&Src, const uint8_t *End, bool Rle4, const RGBA *Palette, RGBA *Row, unsigned int Width, unsigned int &x, unsigned int &dy) {
+		while (true) {
+			if (End - Src < 2) {
+				return RLE_NEED_MORE;
+			}
+
+			unsigned int Count = Src[0];
+			unsigned int Value = Src[1];
+
+			if (Count > 0) {
+				/* encoded run */
+				unsigned int n = x < Width ? std::min(Count, Width - x) : 0;
+				if (n == 0) {
+					// entirely clipped
+				} else if (Rle4 == false || (Value >> 4) == (Value & 0x0f)) {
+					uint32_t Color;
+					memcpy(&Color, &Palette[Rle4 ? Value & 0x0f : Value], sizeof(Color));
+					std::fill_n((uint32_t*) (Row + x), n, Color);
+				} else {
+					const RGBA Pair[2] = { Palette[Value >> 4], Palette[Value & 0x0f] };
+					for (unsigned int k = 0; k < n; k++) {
+						Row[x + k] = Pair[k & 1];
+					}
+				}
+				x += Count;
+				Src += 2;
+			} else if (Value == 0) {
+				Src += 2;
+				return RLE_END_OF_LINE;
+			} else if (Value == 1) {
+				Src += 2;
+				return RLE_END_OF_BITMAP;
+			} else if (Value == 2) {
+				if (End - Src < 4) {
+					return RLE_NEED_MORE;
+				}
+				x += Src[2];
+				dy = Src[3];
+				Src += 4;
+				if (dy > 0) {
+					return RLE_DELTA;
+				}
+			} else {
+				/* absolute run, padded to 16 bit */
+				unsigned int Bytes = Rle4 ? (Value + 1) / 2 : Value;
+				unsigned int Padded = (Bytes + 1) & ~1;
+				if ((unsigned int) (End - Src) < 2 + Padded) {
+					return RLE_NEED_MORE;
+				}
+				const uint8_t *Indices = Src + 2;
+				unsigned int n = x < Width ? std::min(Value, Width - x) : 0;
+				RGBA *Dst = n ? Row + x : Row;
+				if (Rle4) {
+					unsigned int k = 0;
+					for (; k + 1 < n; k += 2) {
+						Dst[k] = Palette[Indices[k / 2] >> 4];
+						Dst[k + 1] = Palette[Indices[k / 2] & 0x0f];
+					}
+					if (k < n) {
+						Dst[k] = Palette[Indices[k / 2] >> 4];
+					}
+				} else {
+					for (unsigned int k = 0; k < n; k++) {
+						Dst[k] = Palette[Indices[k]];
+					}
+				}
+				x += Value;
+				Src += 2 + Padded;
+			}
+		}
+	}
+
+	/* Channel layout of a masked pixel format (red, green, blue, alpha), worked out once per
+	 * GetBits / SetBits call rather than per pixel.
+	 *
+	 * Simple formats (every mask contiguous and at most 8 bits, i.e. 32 bit BGRA/RGBA, 24 bit, 565,
+	 * 555, ...) convert with plain shifts and get SIMD kernels. Anything else goes through lookup
+	 * tables built from CColor::Convert.
+	 */
+
+	struct ChannelLayout {
+		uint32_t Mask[4];
+		uint32_t Position[4];
+		uint32_t BitCount[4];
+		bool Simple;
+	};
+
+	static ChannelLayout GetChannelLayout(uint32_t RedMask, uint32_t GreenMask, uint32_t BlueMask, uint32_t AlphaMask) {
+		ChannelLayout Layout;
+		uint32_t Masks[4] = { RedMask, GreenMask, BlueMask, AlphaMask };
+		Layout.Simple = true;
+		for (int c = 0; c < 4; c++) {
+			Layout.Mask[c] = Masks[c];
+			Layout.BitCount[c] = CColor::BitCountByMask(Masks[c]);
+			Layout.Position[c] = Masks[c] ? CColor::BitPositionByMask(Masks[c]) : 32;
+			if (Layout.BitCount[c] > 8 || (Masks[c] && (Masks[c] >> Layout.Position[c]) != CColor::BitCountToMask(Layout.BitCount[c]))) {
+				Layout.Simple = false;
+			}
+		}
+		return Layout;
+	}
+
+	static inline void StorePixel(uint8_t *Dst, uint32_t Color, unsigned int Bytes) {
+		/* little endian: the low bytes are the pixel */
+		memcpy(Dst, &Color, Bytes);
+	}
+
+	static inline uint32_t LoadPixel(const uint8_t *Src, unsigned int Bytes) {
+		uint32_t Color = 0;
+		memcpy(&Color, Src, Bytes);
+		return Color;
+	}
+
+	/* RGBA -> masked format, Bytes (1 to 4) per output pixel */
+
+	static void PackRow(const RGBA *Src, uint8_t *Dst, unsigned int Count, unsigned int Bytes, const ChannelLayout &Layout, const uint32_t (*Lut)[256]) {
+		unsigned int i = 0;
+
+		if (Layout.Simple == false) {
+			for (; i < Count; i++, Dst += Bytes) {
+				StorePixel(Dst, Lut[0][Src[i].Red] | Lut[1][Src[i].Green] | Lut[2][Src[i].Blue] | Lut[3][Src[i].Alpha], Bytes);
+			}
+			return;
+		}
+
+#ifdef __SSE2__
+		const __m128i ByteMask = _mm_set1_epi32(0xff);
+		__m128i Down[4], Up[4];
+		for (int c = 0; c < 4; c++) {
+			Down[c] = _mm_cvtsi32_si128(8 - Layout.BitCount[c]);
+			Up[c] = _mm_cvtsi32_si128(Layout.Position[c]); // 32 for a missing channel shifts everything out
+		}
+
+		for (; i + 4 <= Count; i += 4, Dst += 4 * Bytes) {
+			__m128i Pixels = _mm_loadu_si128((const __m128i*) (Src + i));
+			__m128i Out = _mm_sll_epi32(_mm_srl_epi32(_mm_and_si128(Pixels, ByteMask), Down[0]), Up[0]);
+			Out = _mm_or_si128(Out, _mm_sll_epi32(_mm_srl_epi32(_mm_and_si128(_mm_srli_epi32(Pixels, 8), ByteMask), Down[1]), Up[1]));
+			Out = _mm_or_si128(Out, _mm_sll_epi32(_mm_srl_epi32(_mm_and_si128(_mm_srli_epi32(Pixels, 16), ByteMask), Down[2]), Up[2]));
+			Out = _mm_or_si128(Out, _mm_sll_epi32(_mm_srl_epi32(_mm_srli_epi32(Pixels, 24), Down[3]), Up[3]));
+
+			if (Bytes == 4) {
+				_mm_storeu_si128((__m128i*) Dst, Out);
+			} else if (Bytes == 2) {
+				/* sign extend the low halves so the saturating pack keeps them as they are */
+				Out = _mm_srai_epi32(_mm_slli_epi32(Out, 16), 16);
+				_mm_storel_epi64((__m128i*) Dst, _mm_packs_epi32(Out, Out));
+			} else {
+#ifdef __SSSE3__
+				if (Bytes == 3) {
+					Out = _mm_shuffle_epi8(Out, _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1));
+					_mm_storel_epi64((__m128i*) Dst, Out);
+					uint32_t Tail = _mm_cvtsi128_si32(_mm_srli_si128(Out, 8));
+					memcpy(Dst + 8, &Tail, 4);
+					continue;
+				}
+#endif
+				uint32_t Colors[4];
+				_mm_storeu_si128((__m128i*) Colors, Out);
+				for (int k = 0; k < 4; k++) {
+					StorePixel(Dst + k * Bytes, Colors[k], Bytes);
+				}
+			}
+		}
+#endif
+
+		for (; i < Count; i++, Dst += Bytes) {
+			const uint8_t Channels[4] = { Src[i].Red, Src[i].Green, Src[i].Blue, Src[i].Alpha };
+			uint32_t Color = 0;
+			for (int c = 0; c < 4; c++) {
+				if (Layout.BitCount[c]) {
+					Color |= (uint32_t) (Channels[c] >> (8 - Layout.BitCount[c])) << Layout.Position[c];
+				}
+			}
+			StorePixel(Dst, Color, Bytes);
+		}
+	}
+
+	/* masked format -> RGBA, Bytes (1 to 4) per input pixel. Same rounding as CColor::Convert. */
+
+	static void UnpackRow(const uint8_t *Src, RGBA *Dst, unsigned int Count, unsigned int Bytes, const ChannelLayout &Layout) {
+		unsigned int i = 0;
+
+		if (Layout.Simple == false) {
+			for (; i < Count; i++, Src += Bytes) {
+				uint32_t Color = LoadPixel(Src, Bytes);
+				uint8_t Channels[4];
+				for (int c = 0; c < 4; c++) {
+					uint32_t Component = Layout.Mask[c] ? (Color & Layout.Mask[c]) >> Layout.Position[c] : 0;
+					Channels[c] = CColor::Convert(Component, Layout.BitCount[c], 8);
+				}
+				Dst[i].Red = Channels[0];
+				Dst[i].Green = Channels[1];
+				Dst[i].Blue = Channels[2];
+				Dst[i].Alpha = Channels[3];
+			}
+			return;
+		}
+
+#ifdef __SSE2__
+		const __m128i Zero = _mm_setzero_si128();
+		__m128i Down[4], Up[4], Width[4], Fill[4];
+		for (int c = 0; c < 4; c++) {
+			Down[c] = _mm_cvtsi32_si128(Layout.Position[c]);
+			Up[c] = _mm_cvtsi32_si128(8 - Layout.BitCount[c]);
+			Width[c] = _mm_set1_epi32(CColor::BitCountToMask(Layout.BitCount[c]));
+			Fill[c] = _mm_set1_epi32(CColor::BitCountToMask(8 - Layout.BitCount[c]));
+		}
+
+		/* 3 byte pixels load 16 bytes for 4 pixels, so stop while there's still slack behind them */
+		unsigned int Safe = (Bytes == 3) ? (Count > 6 ? Count - 2 : 0) : Count;
+
+		for (; i + 4 <= Safe; i += 4, Src += 4 * Bytes) {
+			__m128i Pixels;
+			if (Bytes == 4) {
+				Pixels = _mm_loadu_si128((const __m128i*) Src);
+			} else if (Bytes == 2) {
+				Pixels = _mm_unpacklo_epi16(_mm_loadl_epi64((const __m128i*) Src), Zero);
+			} else {
+#ifdef __SSSE3__
+				if (Bytes == 3) {
+					Pixels = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) Src), _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1));
+				} else
+#endif
+				{
+					Pixels = _mm_setr_epi32(LoadPixel(Src, Bytes), LoadPixel(Src + Bytes, Bytes), LoadPixel(Src + 2 * Bytes, Bytes), LoadPixel(Src + 3 * Bytes, Bytes));
+				}
+			}
+
+			__m128i Out = Zero;
+			for (int c = 0; c < 4; c++) {
+				__m128i Component = _mm_and_si128(_mm_srl_epi32(Pixels, Down[c]), Width[c]);
+				__m128i Channel = _mm_sll_epi32(Component, Up[c]);
+				/* CColor::Convert fills the new low bits with ones for anything but zero */
+				Channel = _mm_or_si128(Channel, _mm_andnot_si128(_mm_cmpeq_epi32(Component, Zero), Fill[c]));
+				Out = _mm_or_si128(Out, _mm_sll_epi32(Channel, _mm_cvtsi32_si128(8 * c)));
+			}
+			_mm_storeu_si128((__m128i*) (Dst + i), Out);
+		}
+#endif
+
+		for (; i < Count; i++, Src += Bytes) {
+			uint32_t Color = LoadPixel(Src, Bytes);
+			uint8_t Channels[4];
+			for (int c = 0; c < 4; c++) {
+				uint32_t Component = Layout.Mask[c] ? (Color >> Layout.Position[c]) & CColor::BitCountToMask(Layout.BitCount[c]) : 0;
+				Channels[c] = CColor::Convert(Component, Layout.BitCount[c], 8);
+			}
+			Dst[i].Red = Channels[0];
+			Dst[i].Green = Channels[1];
+			Dst[i].Blue = Channels[2];
+			Dst[i].Alpha = Channels[3];
+		}
+	}
+
 public:
 	
 	CBitmap() : m_BitmapData(0), m_BitmapSize(0)  {
@@ -193,6 +574,7 @@ public:
 		}
 
 		file.read((char*) &m_BitmapHeader, sizeof(BITMAP_HEADER));
+		file.clear(); // short (v3) headers hit eof here on tiny files
 		
 		/* Load Color Table */
 		
@@ -211,176 +593,64 @@ public:
 		// Always allocate full sized color table
 
 		BGRA* ColorTable = new BGRA[ColorTableSize]; // std::bad_alloc exception should be thrown if memory is not available
+		memset(ColorTable, 0, sizeof(BGRA) * ColorTableSize);
 		
-		file.read((char*) ColorTable, sizeof(BGRA) * m_BitmapHeader.ClrUsed);
+		/* ClrUsed == 0 means a full table */
+		unsigned int ColorsUsed = m_BitmapHeader.ClrUsed ? m_BitmapHeader.ClrUsed : ColorTableSize;
+		file.read((char*) ColorTable, sizeof(BGRA) * std::min(ColorsUsed, ColorTableSize));
 
 		/* ... Color Table for 16 bits images are not supported yet */	
 		
 		m_BitmapSize = GetWidth() * GetHeight();
 		m_BitmapData = new RGBA[m_BitmapSize];
 		
-		unsigned int LineWidth = ((GetWidth() * GetBitCount() / 8) + 3) & ~3;
+		unsigned int LineWidth = ((GetWidth() * GetBitCount() + 31) / 32) * 4;
 		uint8_t *Line = new uint8_t[LineWidth];
 		
 		file.seekg(m_BitmapFileHeader.BitsOffset, std::ios::beg);
 
-		int Index = 0;
 		bool Result = true;
 
-		if (m_BitmapHeader.Compression == 0) {
+		if (m_BitmapHeader.Compression == 0 || m_BitmapHeader.Compression == 3) { // RGB, BITFIELDS
 			for (unsigned int i = 0; i < GetHeight(); i++) {
 				file.read((char*) Line, LineWidth);
-
-				uint8_t *LinePtr = Line;
-				
-				for (unsigned int j = 0; j < GetWidth(); j++) {
-					if (m_BitmapHeader.BitCount == 1) {
-						uint32_t Color = *((uint8_t*) LinePtr);
-						for (int k = 0; k < 8; k++) {
-							m_BitmapData[Index].Red = ColorTable[Color & 0x80 ? 1 : 0].Red;
-							m_BitmapData[Index].Green = ColorTable[Color & 0x80 ? 1 : 0].Green;
-							m_BitmapData[Index].Blue = ColorTable[Color & 0x80 ? 1 : 0].Blue;
-							m_BitmapData[Index].Alpha = ColorTable[Color & 0x80 ? 1 : 0].Alpha;
-							Index++;
-							Color <<= 1;
-						}
-						LinePtr++;
-						j += 7;
-					} else if (m_BitmapHeader.BitCount == 4) {
-						uint32_t Color = *((uint8_t*) LinePtr);
-						m_BitmapData[Index].Red = ColorTable[(Color >> 4) & 0x0f].Red;
-						m_BitmapData[Index].Green = ColorTable[(Color >> 4) & 0x0f].Green;
-						m_BitmapData[Index].Blue = ColorTable[(Color >> 4) & 0x0f].Blue;
-						m_BitmapData[Index].Alpha = ColorTable[(Color >> 4) & 0x0f].Alpha;
-						Index++;
-						m_BitmapData[Index].Red = ColorTable[Color & 0x0f].Red;
-						m_BitmapData[Index].Green = ColorTable[Color & 0x0f].Green;
-						m_BitmapData[Index].Blue = ColorTable[Color & 0x0f].Blue;
-						m_BitmapData[Index].Alpha = ColorTable[Color & 0x0f].Alpha;
-						Index++;
-						LinePtr++;
-						j++;
-					} else if (m_BitmapHeader.BitCount == 8) {
-						uint32_t Color = *((uint8_t*) LinePtr);
-						m_BitmapData[Index].Red = ColorTable[Color].Red;
-						m_BitmapData[Index].Green = ColorTable[Color].Green;
-						m_BitmapData[Index].Blue = ColorTable[Color].Blue;
-						m_BitmapData[Index].Alpha = ColorTable[Color].Alpha;
-						Index++;
-						LinePtr++;
-					} else if (m_BitmapHeader.BitCount == 16) {
-						uint32_t Color = *((uint16_t*) LinePtr);
-						m_BitmapData[Index].Red = ((Color >> 10) & 0x1f) << 3;
-						m_BitmapData[Index].Green = ((Color >> 5) & 0x1f) << 3;
-						m_BitmapData[Index].Blue = (Color & 0x1f) << 3;
-						m_BitmapData[Index].Alpha = 255;
-						Index++;
-						LinePtr += 2;
-					} else if (m_BitmapHeader.BitCount == 24) {
-						uint32_t Color = *((uint32_t*) LinePtr);
-						m_BitmapData[Index].Blue = Color & 0xff;
-						m_BitmapData[Index].Green = (Color >> 8) & 0xff;
-						m_BitmapData[Index].Red = (Color >> 16) & 0xff;
-						m_BitmapData[Index].Alpha = 255;
-						Index++;
-						LinePtr += 3;
-					} else if (m_BitmapHeader.BitCount == 32) {
-						uint32_t Color = *((uint32_t*) LinePtr);
-						m_BitmapData[Index].Blue = Color & 0xff;
-						m_BitmapData[Index].Green = (Color >> 8) & 0xff;
-						m_BitmapData[Index].Red = (Color >> 16) & 0xff;
-						m_BitmapData[Index].Alpha = Color >> 24;
-						Index++;
-						LinePtr += 4;
-					}
-				}
-			}
-		} else if (m_BitmapHeader.Compression == 1) { // RLE 8
-			uint8_t Count = 0;
-			uint8_t ColorIndex = 0;
-			int x = 0, y = 0;
-
-			while (file.eof() == false) {
-				file.read((char*) &Count, sizeof(uint8_t));
-				file.read((char*) &ColorIndex, sizeof(uint8_t));
-
-				if (Count > 0) {
-					Index = x + y * GetWidth();
-					for (int k = 0; k < Count; k++) {
-						m_BitmapData[Index + k].Red = ColorTable[ColorIndex].Red;
-						m_BitmapData[Index + k].Green = ColorTable[ColorIndex].Green;
-						m_BitmapData[Index + k].Blue = ColorTable[ColorIndex].Blue;
-						m_BitmapData[Index + k].Alpha = ColorTable[ColorIndex].Alpha;
-					}
-					x += Count;
-				} else if (Count == 0) {
-					int Flag = ColorIndex;
-					if (Flag == 0) {
-						x = 0;
-						y++;
-					} else if (Flag == 1) {
-						break;
-					} else if (Flag == 2) {
-						char rx = 0;
-						char ry = 0;
-						file.read((char*) &rx, sizeof(char));
-						file.read((char*) &ry, sizeof(char));
-						x += rx;
-						y += ry;
-					} else {
-						Count = Flag;
-						Index = x + y * GetWidth();
-						for (int k = 0; k < Count; k++) {
-							file.read((char*) &ColorIndex, sizeof(uint8_t));
-							m_BitmapData[Index + k].Red = ColorTable[ColorIndex].Red;
-							m_BitmapData[Index + k].Green = ColorTable[ColorIndex].Green;
-							m_BitmapData[Index + k].Blue = ColorTable[ColorIndex].Blue;
-							m_BitmapData[Index + k].Alpha = ColorTable[ColorIndex].Alpha;
-						}
-						x += Count;
-						// Attention: Current Microsoft STL implementation seems to be buggy, tellg() always returns 0.
-						if (file.tellg() & 1) {
-							file.seekg(1, std::ios::cur);
-						}
-					}
-				}
+				DecodeLine(Line, &m_BitmapData[i * GetWidth()], GetWidth(), m_BitmapHeader, ColorTable);
 			}
-		} else if (m_BitmapHeader.Compression == 2) { // RLE 4
-			/* RLE 4 is not supported */
-			Result = false;
-		} else if (m_BitmapHeader.Compression == 3) { // BITFIELDS
-			
-			/* We assumes that mask of each color component can be in any order */
+		} else if (m_BitmapHeader.Compression == 1 || m_BitmapHeader.Compression == 2) { // RLE 8, RLE 4
+			/* Decode from memory: the whole stream in one read, runs are block fills */
 
-			uint32_t BitCountRed = CColor::BitCountByMask(m_BitmapHeader.RedMask);
-			uint32_t BitCountGreen = CColor::BitCountByMask(m_BitmapHeader.GreenMask);
-			uint32_t BitCountBlue = CColor::BitCountByMask(m_BitmapHeader.BlueMask);
-			uint32_t BitCountAlpha = CColor::BitCountByMask(m_BitmapHeader.AlphaMask);
+			std::streampos Start = file.tellg();
+			file.seekg(0, std::ios::end);
+			std::streamoff StreamSize = file.tellg() - Start;
+			file.seekg(Start);
 
-			for (unsigned int i = 0; i < GetHeight(); i++) {
-				file.read((char*) Line, LineWidth);
-				
-				uint8_t *LinePtr = Line;
-				
-				for (unsigned int j = 0; j < GetWidth(); j++) {
-					
-					uint32_t Color = 0;
-
-					if (m_BitmapHeader.BitCount == 16) {
-						Color = *((uint16_t*) LinePtr);
-						LinePtr += 2;
-					} else if (m_BitmapHeader.BitCount == 32) {
-						Color = *((uint32_t*) LinePtr);
-						LinePtr += 4;
-					} else {
-						// Other formats are not valid
-					}
-					m_BitmapData[Index].Red = CColor::Convert(CColor::ComponentByMask(Color, m_BitmapHeader.RedMask), BitCountRed, 8);
-					m_BitmapData[Index].Green = CColor::Convert(CColor::ComponentByMask(Color, m_BitmapHeader.GreenMask), BitCountGreen, 8);
-					m_BitmapData[Index].Blue = CColor::Convert(CColor::ComponentByMask(Color, m_BitmapHeader.BlueMask), BitCountBlue, 8);
-					m_BitmapData[Index].Alpha = CColor::Convert(CColor::ComponentByMask(Color, m_BitmapHeader.AlphaMask), BitCountAlpha, 8);
+			std::vector<uint8_t> Stream(StreamSize > 0 ? StreamSize : 0);
+			if (Stream.empty() == false) {
+				file.read((char*) &Stream[0], Stream.size());
+			}
 
-					Index++;
+			RGBA Palette[256];
+			memset(Palette, 0, sizeof(Palette));
+			MakePalette(ColorTable, Palette, ColorTableSize);
+
+			/* pixels the stream skips over stay 0 */
+			memset(m_BitmapData, 0, m_BitmapSize * sizeof(RGBA));
+
+			const uint8_t *Src = Stream.empty() ? 0 : &Stream[0];
+			const uint8_t *End = Src + Stream.size();
+			bool Rle4 = m_BitmapHeader.Compression == 2;
+			unsigned int x = 0, y = 0;
+
+			while (y < GetHeight()) {
+				unsigned int dy = 0;
+				int Status = DecodeRLERow(Src, End, Rle4, Palette, &m_BitmapData[y * GetWidth()], GetWidth(), x, dy);
+				if (Status == RLE_END_OF_LINE) {
+					x = 0;
+					y++;
+				} else if (Status == RLE_DELTA) {
+					y += dy;
+				} else {
+					break; // end of bitmap, or truncated
 				}
 			}
 		}
@@ -408,7 +678,6 @@ public:
 
 		bfh.Signature = BITMAP_SIGNATURE;
 		bfh.BitsOffset = BITMAP_FILEHEADER_SIZE + sizeof(BITMAP_HEADER);
-		bfh.Size = (GetWidth() * GetHeight() * BitCount) / 8 + bfh.BitsOffset;
 	
 		bh.HeaderSize = sizeof(BITMAP_HEADER);
 		bh.BitCount = BitCount;
@@ -429,12 +698,14 @@ public:
 			bh.Compression = 0; // RGB
 		}
 		
-		unsigned int LineWidth = (GetWidth() + 3) & ~3;
+		/* lines are padded to 4 bytes */
+		unsigned int LineWidth = ((GetWidth() * BitCount + 31) / 32) * 4;
 
 		bh.Planes = 1;
 		bh.Height = GetHeight();
 		bh.Width = GetWidth();
-		bh.SizeImage = (LineWidth * BitCount * GetHeight()) / 8;
+		bh.SizeImage = LineWidth * GetHeight();
+		bfh.Size = bh.SizeImage + bfh.BitsOffset;
 		bh.PelsPerMeterX = 3780;
 		bh.PelsPerMeterY = 3780;
 		
@@ -450,6 +721,7 @@ public:
 
 			if (GetBitsWithPalette(Bitmap, bh.SizeImage, BitCount, Palette, PaletteSize)) {
 				bfh.BitsOffset += PaletteSize * sizeof(BGRA);
+				bfh.Size += PaletteSize * sizeof(BGRA);
 
 				file.write((char*) &bfh, BITMAP_FILEHEADER_SIZE);
 				file.write((char*) &bh, sizeof(BITMAP_HEADER));
@@ -560,64 +832,49 @@ public:
 	 */
 
 	bool GetBits(void* Buffer, unsigned int &Size, unsigned int RedMask, unsigned int GreenMask, unsigned int BlueMask, unsigned int AlphaMask, bool IncludePadding = true) {
-		bool Result = false;
-
-		uint32_t BitCountRed = CColor::BitCountByMask(RedMask);
-		uint32_t BitCountGreen = CColor::BitCountByMask(GreenMask);
-		uint32_t BitCountBlue = CColor::BitCountByMask(BlueMask);
-		uint32_t BitCountAlpha = CColor::BitCountByMask(AlphaMask);
+		ChannelLayout Layout = GetChannelLayout(RedMask, GreenMask, BlueMask, AlphaMask);
 		
-		unsigned int BitCount = (BitCountRed + BitCountGreen + BitCountBlue + BitCountAlpha + 7) & ~7;
+		unsigned int BitCount = (Layout.BitCount[0] + Layout.BitCount[1] + Layout.BitCount[2] + Layout.BitCount[3] + 7) & ~7;
 
-		if (BitCount > 32) {
+		if (BitCount > 32 || BitCount == 0) {
 			return false;
 		}
 		
 		unsigned int w = GetWidth();
-		//unsigned int LineWidth = (w + 3) & ~3;
 		unsigned int dataBytesPerLine = (w * BitCount + 7) / 8;
-		unsigned int LineWidth = (dataBytesPerLine + 3) & ~3;
+		unsigned int LineWidth = IncludePadding ? (dataBytesPerLine + 3) & ~3 : dataBytesPerLine;
 
 		if (Size == 0 || Buffer == 0) {
-			//Size = (LineWidth * GetHeight() * BitCount) / 8 + sizeof(unsigned int);
-			Size = (GetWidth() * GetHeight() * BitCount) / 8 + sizeof(unsigned int);
+			Size = LineWidth * GetHeight();
 			return true;
 		}
 
-		uint8_t* BufferPtr = (uint8_t*) Buffer;
-		
-		Result = true;
+		if (Size < LineWidth * GetHeight()) {
+			return false;
+		}
 
-		uint32_t BitPosRed = CColor::BitPositionByMask(RedMask);
-		uint32_t BitPosGreen = CColor::BitPositionByMask(GreenMask);
-		uint32_t BitPosBlue = CColor::BitPositionByMask(BlueMask);
-		uint32_t BitPosAlpha = CColor::BitPositionByMask(AlphaMask);
-		
-		unsigned int j = 0;
+		/* Only formats that aren't plain shifts need the tables */
 
-		for (unsigned int i = 0; i < m_BitmapSize; i++) {
-			*(uint32_t*) BufferPtr =
-			(CColor::Convert(m_BitmapData[i].Blue, 8, BitCountBlue) << BitPosBlue) |
-			(CColor::Convert(m_BitmapData[i].Green, 8, BitCountGreen) << BitPosGreen) | 
-			(CColor::Convert(m_BitmapData[i].Red, 8, BitCountRed) << BitPosRed) | 
-			(CColor::Convert(m_BitmapData[i].Alpha, 8, BitCountAlpha) << BitPosAlpha);
-			
-			if (IncludePadding) {
-				j++;
-				if (j >= w) {
-					for (unsigned int k = 0; k < LineWidth - dataBytesPerLine; k++) {
-						BufferPtr += (BitCount >> 3);
-					}
-					j = 0;
+		uint32_t Lut[4][256];
+		if (Layout.Simple == false) {
+			for (int c = 0; c < 4; c++) {
+				for (unsigned int v = 0; v < 256; v++) {
+					Lut[c][v] = Layout.BitCount[c] ? CColor::Convert(v, 8, Layout.BitCount[c]) << Layout.Position[c] : 0;
 				}
 			}
+		}
+
+		uint8_t* BufferPtr = (uint8_t*) Buffer;
 
-			BufferPtr += (BitCount >> 3);
+		for (unsigned int y = 0; y < GetHeight(); y++) {
+			PackRow(m_BitmapData + y * w, BufferPtr, w, BitCount >> 3, Layout, Lut);
+			memset(BufferPtr + dataBytesPerLine, 0, LineWidth - dataBytesPerLine);
+			BufferPtr += LineWidth;
 		}
 		
-		Size -= sizeof(unsigned int);
+		Size = LineWidth * GetHeight();
 
-		return Result;
+		return true;
 	}
 	
 	/* See GetBits(). 
@@ -720,7 +977,11 @@ public:
 	/* Set Bitmap Bits. Will be converted to RGBA internally */
 
 	bool SetBits(void* Buffer, unsigned int Width, unsigned int Height, unsigned int RedMask, unsigned int GreenMask, unsigned int BlueMask, unsigned int AlphaMask = 0) {
-		if (Buffer == 0) {
+		/* Find bit count by masks (rounded to next 8 bit boundary) */
+		
+		unsigned int BitCount = (CColor::BitCountByMask(RedMask | GreenMask | BlueMask | AlphaMask) + 7) & ~7;
+
+		if (Buffer == 0 || BitCount == 0 || BitCount > 32) {
 			return false;
 		}
 
@@ -736,39 +997,214 @@ public:
 		m_BitmapSize = GetWidth() * GetHeight();
 		m_BitmapData = new RGBA[m_BitmapSize];
 		
-		/* Find bit count by masks (rounded to next 8 bit boundary) */
-		
-		unsigned int BitCount = (CColor::BitCountByMask(RedMask | GreenMask | BlueMask | AlphaMask) + 7) & ~7;
-		
-		uint32_t BitCountRed = CColor::BitCountByMask(RedMask);
-		uint32_t BitCountGreen = CColor::BitCountByMask(GreenMask);
-		uint32_t BitCountBlue = CColor::BitCountByMask(BlueMask);
-		uint32_t BitCountAlpha = CColor::BitCountByMask(AlphaMask);
+		UnpackRow(BufferPtr, m_BitmapData, m_BitmapSize, BitCount >> 3, GetChannelLayout(RedMask, GreenMask, BlueMask, AlphaMask));
 
-		for (unsigned int i = 0; i < m_BitmapSize; i++) {
-			unsigned int Color = 0;
-			if (BitCount <= 8) {
-				Color = *((uint8_t*) BufferPtr);
-				BufferPtr += 1;
-			} else if (BitCount <= 16) {
-				Color = *((uint16_t*) BufferPtr);
-				BufferPtr += 2;
-			} else if (BitCount <= 24) {
-				Color = *((uint32_t*) BufferPtr);
-				BufferPtr += 3;
-			} else if (BitCount <= 32) {
-				Color = *((uint32_t*) BufferPtr);
-				BufferPtr += 4;
+		return true;
+	}
+};
+
+/* Streaming bitmap decoder.
+ *
+ * Decodes a bitmap a block of scanlines at a time into buffers supplied by the caller, in file
+ * order (bottom up unless IsTopDown()). Only one file line (or a small read window for RLE) is
+ * held in memory, so this works on bitmaps that are far too big to be loaded as a whole.
+ *
+ * Pixels an RLE stream never writes (deltas, early end of line/bitmap) are returned as 0.
+ */
+
+class CBitmapReader {
+private:
+	std::ifstream m_File;
+	BITMAP_FILEHEADER m_BitmapFileHeader;
+	BITMAP_HEADER m_BitmapHeader;
+	BGRA m_ColorTable[256];
+	RGBA m_Palette[256];
+	uint8_t *m_Line;
+	unsigned int m_LineWidth;
+	unsigned int m_Row;
+
+	/* RLE state: read window into the compressed stream and the decoder position */
+
+	enum { WINDOW_SIZE = 64 * 1024 };
+	uint8_t *m_Window;
+	unsigned int m_WindowPos;
+	unsigned int m_WindowEnd;
+	unsigned int m_RleX;
+	unsigned int m_RleY;
+	bool m_RleDone;
+
+	/* Moves the unread tail of the window to the front and fills up the rest, false if nothing new came in */
+
+	bool Refill() {
+		memmove(m_Window, m_Window + m_WindowPos, m_WindowEnd - m_WindowPos);
+		m_WindowEnd -= m_WindowPos;
+		m_WindowPos = 0;
+		m_File.read((char*) m_Window + m_WindowEnd, WINDOW_SIZE - m_WindowEnd);
+		m_WindowEnd += m_File.gcount();
+		return m_File.gcount() > 0;
+	}
+
+	/* Decodes RLE opcodes until the current row is finished */
+
+	void DecodeRLERow(RGBA *Row) {
+		memset(Row, 0, GetWidth() * sizeof(RGBA));
+
+		if (m_RleDone || m_RleY > m_Row) {
+			return; // skipped by a delta or past the end of bitmap marker
+		}
+
+		unsigned int x = m_RleX;
+
+		while (true) {
+			const uint8_t *Src = m_Window + m_WindowPos;
+			unsigned int dy = 0;
+			int Status = CBitmap::DecodeRLERow(Src, m_Window + m_WindowEnd, m_BitmapHeader.Compression == 2, m_Palette, Row, GetWidth(), x, dy);
+			m_WindowPos = Src - m_Window;
+
+			if (Status == CBitmap::RLE_END_OF_LINE) {
+				m_RleX = 0;
+				m_RleY++;
+				return;
+			} else if (Status == CBitmap::RLE_DELTA) {
+				m_RleX = x;
+				m_RleY += dy;
+				return;
+			} else if (Status == CBitmap::RLE_END_OF_BITMAP || Refill() == false) {
+				m_RleDone = true;
+				return;
+			}
+		}
+	}
+
+public:
+	typedef bool (*RowCallback)(RGBA *Rows, unsigned int FirstRow, unsigned int RowCount, void *User);
+
+	CBitmapReader() : m_Line(0), m_Window(0) {
+		Close();
+	}
+
+	~CBitmapReader() {
+		Close();
+	}
+
+	void Close() {
+		if (m_File.is_open()) {
+			m_File.close();
+		}
+		delete [] m_Line;
+		delete [] m_Window;
+		m_Line = 0;
+		m_Window = 0;
+		m_Row = 0;
+		memset(&m_BitmapFileHeader, 0, sizeof(m_BitmapFileHeader));
+		memset(&m_BitmapHeader, 0, sizeof(m_BitmapHeader));
+		memset(m_ColorTable, 0, sizeof(m_ColorTable));
+		memset(m_Palette, 0, sizeof(m_Palette));
+	}
+
+	/* Reads headers and color table and positions the stream at the first scanline */
+
+	bool Open(const char *Filename) {
+		Close();
+
+		m_File.open(Filename, std::ios::binary | std::ios::in);
+		if (m_File.is_open() == false) {
+			return false;
+		}
+
+		m_File.read((char*) &m_BitmapFileHeader, BITMAP_FILEHEADER_SIZE);
+		if (!m_File || m_BitmapFileHeader.Signature != BITMAP_SIGNATURE) {
+			Close();
+			return false;
+		}
+
+		m_File.read((char*) &m_BitmapHeader, sizeof(BITMAP_HEADER));
+		m_File.clear(); // short (v3) headers hit eof here on tiny files
+
+		if (m_BitmapHeader.Compression > 3 || GetWidth() == 0 || GetBitCount() == 0 || GetBitCount() > 32) {
+			Close();
+			return false;
+		}
+
+		m_File.seekg(BITMAP_FILEHEADER_SIZE + m_BitmapHeader.HeaderSize, std::ios::beg);
+		if (GetBitCount() <= 8) {
+			unsigned int Colors = m_BitmapHeader.ClrUsed ? m_BitmapHeader.ClrUsed : (1 << GetBitCount());
+			m_File.read((char*) m_ColorTable, sizeof(BGRA) * (Colors > 256 ? 256 : Colors));
+			CBitmap::MakePalette(m_ColorTable, m_Palette, 256);
+		}
+
+		m_File.seekg(m_BitmapFileHeader.BitsOffset, std::ios::beg);
+
+		if (m_BitmapHeader.Compression == 1 || m_BitmapHeader.Compression == 2) {
+			m_Window = new uint8_t[WINDOW_SIZE];
+			m_WindowPos = m_WindowEnd = 0;
+			m_RleX = m_RleY = 0;
+			m_RleDone = false;
+		} else {
+			m_LineWidth = ((GetWidth() * GetBitCount() + 31) / 32) * 4;
+			m_Line = new uint8_t[m_LineWidth];
+		}
+		return true;
+	}
+
+	unsigned int GetWidth() {
+		return m_BitmapHeader.Width < 0 ? -m_BitmapHeader.Width : m_BitmapHeader.Width;
+	}
+
+	unsigned int GetHeight() {
+		return m_BitmapHeader.Height < 0 ? -m_BitmapHeader.Height : m_BitmapHeader.Height;
+	}
+
+	unsigned int GetBitCount() {
+		return m_BitmapHeader.BitCount;
+	}
+
+	/* File row 0 is the top of the image instead of the bottom */
+
+	bool IsTopDown() {
+		return m_BitmapHeader.Height < 0;
+	}
+
+	/* Number of rows decoded so far */
+
+	unsigned int GetRow() {
+		return m_Row;
+	}
+
+	/* Decodes up to RowCount rows into Buffer (GetWidth() * RowCount RGBA). Returns the number of rows decoded. */
+
+	unsigned int ReadRows(RGBA *Buffer, unsigned int RowCount) {
+		unsigned int Rows = 0;
+
+		while (Rows < RowCount && m_Row < GetHeight()) {
+			RGBA *Row = Buffer + Rows * GetWidth();
+
+			if (m_Window) {
+				DecodeRLERow(Row);
 			} else {
-				/* unsupported */
-				BufferPtr += 1;
+				if (!m_File.read((char*) m_Line, m_LineWidth)) {
+					break;
+				}
+				CBitmap::DecodeLine(m_Line, Row, GetWidth(), m_BitmapHeader, m_ColorTable);
 			}
-			m_BitmapData[i].Alpha = CColor::Convert(CColor::ComponentByMask(Color, AlphaMask), BitCountAlpha, 8);
-			m_BitmapData[i].Red = CColor::Convert(CColor::ComponentByMask(Color, RedMask), BitCountRed, 8);
-			m_BitmapData[i].Green = CColor::Convert(CColor::ComponentByMask(Color, GreenMask), BitCountGreen, 8);
-			m_BitmapData[i].Blue = CColor::Convert(CColor::ComponentByMask(Color, BlueMask), BitCountBlue, 8);
+
+			m_Row++;
+			Rows++;
 		}
+		return Rows;
+	}
 
+	/* Decodes the remaining rows in blocks of RowsPerBlock (Buffer holds that many rows), handing every
+	 * block to Callback. Stops early and returns false if Callback does, or if the file is truncated. */
+
+	bool Decode(RGBA *Buffer, unsigned int RowsPerBlock, RowCallback Callback, void *User) {
+		while (m_Row < GetHeight()) {
+			unsigned int FirstRow = m_Row;
+			unsigned int Rows = ReadRows(Buffer, RowsPerBlock);
+			if (Rows == 0 || Callback(Buffer, FirstRow, Rows, User) == false) {
+				return false;
+			}
+		}
 		return true;
 	}
 };
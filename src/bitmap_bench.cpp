@@ -0,0 +1,156 @@
+// bitmap_bench.cpp - times CBitmap::GetBits / SetBits against the old per pixel loop
+//
+// usage: bitmap_bench [width height] [iterations]
+//
+// The reference functions below are the conversion loops GetBits / SetBits used
+// before they went row by row through PackRow / UnpackRow. Both sides are checked
+// against each other before timing so a fast but wrong kernel doesn't look good.
+
+#include <vector>
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "bitmap.h"
+
+using namespace std;
+
+typedef CBitmap::CColor CColor;
+
+typedef struct Format_struct {
+	const char *name;
+	unsigned int red, green, blue, alpha;
+} Format_t;
+
+static const Format_t formats[] = {
+	{ "rgba8888", 0x000000FF, 0x0000FF00, 0x00FF0000, 0xFF000000 },
+	{ "bgra8888", 0x00FF0000, 0x0000FF00, 0x000000FF, 0xFF000000 },
+	{ "bgr888", 0x00FF0000, 0x0000FF00, 0x000000FF, 0 },
+	{ "rgb565", 0xF800, 0x07E0, 0x001F, 0 },
+	{ "argb1555", 0x7C00, 0x03E0, 0x001F, 0x8000 },
+	{ "a2rgb10", 0x3FF00000, 0x000FFC00, 0x000003FF, 0xC0000000 },
+};
+
+/* old GetBits inner loop, one pixel at a time through CColor */
+static void reference_pack(const RGBA *src, uint8_t *dst, unsigned int width, unsigned int height, const Format_t &f) {
+	unsigned int bits = (CColor::BitCountByMask(f.red | f.green | f.blue | f.alpha) + 7) & ~7;
+	unsigned int line = ((width * bits + 31) / 32) * 4;
+	unsigned int masks[4] = { f.red, f.green, f.blue, f.alpha };
+
+	for (unsigned int y = 0; y < height; y++) {
+		uint8_t *out = dst + y * line;
+		for (unsigned int x = 0; x < width; x++, out += bits / 8) {
+			const RGBA &p = src[y * width + x];
+			unsigned int channels[4] = { p.Red, p.Green, p.Blue, p.Alpha };
+			uint32_t color = 0;
+			for (int c = 0; c < 4; c++) {
+				unsigned int count = CColor::BitCountByMask(masks[c]);
+				if (count) {
+					color |= CColor::Convert(channels[c], 8, count) << CColor::BitPositionByMask(masks[c]);
+				}
+			}
+			memcpy(out, &color, bits / 8);
+		}
+		memset(out, 0, line - width * bits / 8);
+	}
+}
+
+/* old SetBits inner loop */
+static void reference_unpack(const uint8_t *src, RGBA *dst, unsigned int width, unsigned int height, const Format_t &f) {
+	unsigned int bits = (CColor::BitCountByMask(f.red | f.green | f.blue | f.alpha) + 7) & ~7;
+	unsigned int counts[4] = { CColor::BitCountByMask(f.red), CColor::BitCountByMask(f.green), CColor::BitCountByMask(f.blue), CColor::BitCountByMask(f.alpha) };
+
+	for (unsigned int i = 0; i < width * height; i++, src += bits / 8) {
+		uint32_t color = 0;
+		memcpy(&color, src, bits / 8);
+		dst[i].Red = CColor::Convert(CColor::ComponentByMask(color, f.red), counts[0], 8);
+		dst[i].Green = CColor::Convert(CColor::ComponentByMask(color, f.green), counts[1], 8);
+		dst[i].Blue = CColor::Convert(CColor::ComponentByMask(color, f.blue), counts[2], 8);
+		dst[i].Alpha = CColor::Convert(CColor::ComponentByMask(color, f.alpha), counts[3], 8);
+	}
+}
+
+template <typename F>
+static double time_ms(int iterations, F run) {
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	for (int i = 0; i < iterations; i++) run();
+	return chrono::duration<double, milli>(chrono::steady_clock::now() - start).count() / iterations;
+}
+
+int main(int argc, char **argv) {
+	unsigned int width = 1920, height = 1080;
+	int iterations = 20;
+	if (argc >= 3) {
+		width = atoi(argv[1]);
+		height = atoi(argv[2]);
+	}
+	if (argc >= 4) iterations = atoi(argv[3]);
+	if (width == 0 || height == 0 || iterations <= 0) {
+		cout << "usage: bitmap_bench [width height] [iterations]" << endl;
+		return 1;
+	}
+
+	vector<uint32_t> pixels(width * height);
+	srand(1);
+	for (size_t i = 0; i < pixels.size(); i++) pixels[i] = (rand() << 16) ^ rand();
+
+	CBitmap image;
+	image.SetBits(&pixels[0], width, height, 0x000000FF, 0x0000FF00, 0x00FF0000, 0xFF000000);
+	const RGBA *rgba = (const RGBA*) image.GetBits();
+
+#ifdef __SSSE3__
+	const char *simd = "ssse3";
+#elif defined(__SSE2__)
+	const char *simd = "sse2";
+#else
+	const char *simd = "scalar";
+#endif
+	cout << width << "x" << height << ", " << iterations << " iterations, " << simd << endl;
+	cout << left << setw(10) << "format" << right << setw(12) << "get old" << setw(12) << "get new" << setw(12) << "set old" << setw(12) << "set new" << "   ms/frame" << endl;
+
+	bool ok = true;
+	for (size_t n = 0; n < sizeof(formats) / sizeof(formats[0]); n++) {
+		const Format_t &f = formats[n];
+
+		unsigned int size = 0;
+		image.GetBits(NULL, size, f.red, f.green, f.blue, f.alpha, true);
+		vector<uint8_t> packed(size), expected(size);
+
+		reference_pack(rgba, &expected[0], width, height, f);
+		image.GetBits(&packed[0], size, f.red, f.green, f.blue, f.alpha, true);
+		if (packed != expected) {
+			cout << f.name << ": GetBits doesn't match the reference" << endl;
+			ok = false;
+		}
+
+		/* SetBits takes unpadded rows */
+		unsigned int bytes = ((CColor::BitCountByMask(f.red | f.green | f.blue | f.alpha) + 7) & ~7) / 8;
+		vector<uint8_t> tight(width * height * bytes);
+		for (unsigned int y = 0; y < height; y++) {
+			memcpy(&tight[y * width * bytes], &packed[y * (size / height)], width * bytes);
+		}
+
+		CBitmap unpacked;
+		vector<RGBA> reference(width * height);
+		reference_unpack(&tight[0], &reference[0], width, height, f);
+		unpacked.SetBits(&tight[0], width, height, f.red, f.green, f.blue, f.alpha);
+		if (memcmp(unpacked.GetBits(), &reference[0], width * height * sizeof(RGBA)) != 0) {
+			cout << f.name << ": SetBits doesn't match the reference" << endl;
+			ok = false;
+		}
+
+		double get_old = time_ms(iterations, [&]() { reference_pack(rgba, &expected[0], width, height, f); });
+		double get_new = time_ms(iterations, [&]() { unsigned int s = size; image.GetBits(&packed[0], s, f.red, f.green, f.blue, f.alpha, true); });
+		double set_old = time_ms(iterations, [&]() { reference_unpack(&tight[0], &reference[0], width, height, f); });
+		double set_new = time_ms(iterations, [&]() { unpacked.SetBits(&tight[0], width, height, f.red, f.green, f.blue, f.alpha); });
+
+		cout << fixed << setprecision(2) << left << setw(10) << f.name << right
+			<< setw(12) << get_old << setw(12) << get_new << setw(12) << set_old << setw(12) << set_new
+			<< "   " << setprecision(1) << get_old / get_new << "x / " << set_old / set_new << "x" << endl;
+	}
+
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,170 @@
+// camera.h - where the view comes from
+//
+// CameraController has four modes: the free camera the keys fly around, the spin
+// around the city, a chase camera behind any one car, and a camera path (-path).
+// Whatever the mode, state() is a CameraState_t: the eye, an orthonormal basis and
+// the view matrix built from that basis, which the renderer uses as is.
+//
+// The free camera keeps its basis and matrix between frames. Turning redoes one sine
+// and cosine each of yaw and pitch, moving only flags the matrix, and a frame
+// where nothing happened costs nothing. The chase camera eases towards a spot behind
+// its car each frame, so turns swing the camera round instead of snapping it, and it
+// gets the car's direction from a table rather than trig. No GL in here.
+
+#ifndef CAMERA_H
+#define CAMERA_H
+
+#include <math.h>
+
+#include "mat.h"
+#include "sim.h"
+
+#define CAMERA_MOVE_STEP 2.0 // per key press
+#define CAMERA_RISE_STEP 4.0
+#define CAMERA_TURN_STEP 5.0 // degrees
+#define CAMERA_MAX_PITCH 85.0
+
+#define CHASE_BEHIND 15.0 // units behind the car
+#define CHASE_HEIGHT 9.0
+#define CHASE_AHEAD 10.0 // the point looked at, in front of the car
+#define CHASE_LOOK_HEIGHT 2.0
+#define CHASE_EASE 0.15 // how much of the way to the chase spot the camera goes each frame
+
+enum { CAMERA_FREE, CAMERA_SPIN, CAMERA_CHASE, CAMERA_PATH };
+
+// world x and z a car drives along for each heading, STOP keeps the last one
+static const float chase_headings[5][2] = { { 1, 0 }, { -1, 0 }, { 0, -1 }, { 0, 1 }, { 0, 0 } };
+
+typedef struct CameraState_struct {
+	Vec3_t eye;
+	Vec3_t right, up, forward; // unit length
+	Mat4_t view;
+} CameraState_t;
+
+class CameraController {
+	private:
+		int m_mode;
+		CameraState_t m_free; // kept while the other modes drive, so toggling back returns to it
+		CameraState_t m_moving; // spin, chase and path, rebuilt every frame
+		double m_yaw, m_pitch; // free camera, degrees. yaw 0 looks down -z
+		bool m_free_dirty; // m_free.view is out of date
+		size_t m_car;
+		Vec3_t m_chase_dir, m_chase_target;
+		bool m_chase_snap; // jump straight behind the car on the first frame
+
+		// the free camera's basis, the only trig it does
+		void turned() {
+			double yaw = m_yaw * M_PI / 180.0, pitch = m_pitch * M_PI / 180.0;
+			double cy = cos(yaw), sy = sin(yaw), cp = cos(pitch), sp = sin(pitch);
+			m_free.forward = Vec3_t(sy * cp, sp, -cy * cp);
+			m_free.right = Vec3_t(cy, 0, sy);
+			m_free.up = vec3_cross(m_free.right, m_free.forward);
+			m_free_dirty = true;
+		}
+
+		void aim(const Vec3_t &eye, const Vec3_t &target) {
+			m_moving.eye = eye;
+			m_moving.forward = vec3_normalize(target - eye);
+			m_moving.right = vec3_normalize(vec3_cross(m_moving.forward, Vec3_t(0, 1, 0)));
+			m_moving.up = vec3_cross(m_moving.right, m_moving.forward);
+			m_moving.view = mat4_view(m_moving.eye, m_moving.right, m_moving.up, m_moving.forward);
+		}
+
+	public:
+		CameraController() : m_mode(CAMERA_FREE), m_yaw(0), m_pitch(0), m_free_dirty(true), m_car(0), m_chase_dir(1, 0, 0), m_chase_snap(true) {
+			turned();
+		}
+
+		void place(const Vec3_t &eye, double yaw, double pitch) {
+			m_free.eye = eye;
+			m_yaw = yaw;
+			m_pitch = pitch;
+			turned();
+		}
+
+		// 0 up, 1 down, 2 left, 3 right, 4 forwards, 5 backwards
+		void move(int dir) {
+			switch (dir) {
+				case 0: m_free.eye.y += CAMERA_RISE_STEP; break;
+				case 1: m_free.eye.y -= CAMERA_RISE_STEP; break;
+				case 2: m_free.eye = m_free.eye - m_free.right * CAMERA_MOVE_STEP; break;
+				case 3: m_free.eye = m_free.eye + m_free.right * CAMERA_MOVE_STEP; break;
+				case 4: m_free.eye = m_free.eye + m_free.forward * CAMERA_MOVE_STEP; break;
+				case 5: m_free.eye = m_free.eye - m_free.forward * CAMERA_MOVE_STEP; break;
+				default: return;
+			}
+			m_free_dirty = true;
+		}
+
+		// 0 up, 1 down, 2 left, 3 right
+		void look(int dir) {
+			switch (dir) {
+				case 0: m_pitch = fmin(m_pitch + CAMERA_TURN_STEP, CAMERA_MAX_PITCH); break;
+				case 1: m_pitch = fmax(m_pitch - CAMERA_TURN_STEP, -CAMERA_MAX_PITCH); break;
+				case 2: m_yaw -= CAMERA_TURN_STEP; break;
+				case 3: m_yaw += CAMERA_TURN_STEP; break;
+				default: return;
+			}
+			turned();
+		}
+
+		// into a mode, or back to the free camera if already in it
+		void toggle(int mode) {
+			m_mode = (m_mode == mode) ? CAMERA_FREE : mode;
+			if (m_mode == CAMERA_CHASE) m_chase_snap = true;
+		}
+
+		int mode() {
+			return m_mode;
+		}
+
+		// the chase camera's car, step cars on from the current one
+		void select_car(int step, size_t count) {
+			if (count == 0) return;
+			m_car = (m_car + count + step % (int) count) % count;
+		}
+
+		size_t car() {
+			return m_car;
+		}
+
+		// once a frame in CAMERA_SPIN, around the middle of the city
+		void spin(unsigned int frame) {
+			double angle = frame / 150.0;
+			aim(Vec3_t(300 * cos(angle) + 150, 150, 300 * sin(angle) - 150), Vec3_t(150, 0, -150));
+		}
+
+		// once a frame in CAMERA_CHASE
+		void chase(Car &car) {
+			int heading = car.get_heading();
+			if (heading != STOP) m_chase_dir = Vec3_t(chase_headings[heading][0], 0, chase_headings[heading][1]);
+
+			Vec3_t position(car.m_x_pos, 0, -car.m_y_pos);
+			Vec3_t eye = position - m_chase_dir * CHASE_BEHIND + Vec3_t(0, CHASE_HEIGHT, 0);
+			Vec3_t target = position + m_chase_dir * CHASE_AHEAD + Vec3_t(0, CHASE_LOOK_HEIGHT, 0);
+			if (m_chase_snap) {
+				m_chase_snap = false;
+				aim(eye, target);
+				m_chase_target = target;
+				return;
+			}
+			m_chase_target = m_chase_target + (target - m_chase_target) * CHASE_EASE;
+			aim(m_moving.eye + (eye - m_moving.eye) * CHASE_EASE, m_chase_target);
+		}
+
+		// once a frame in CAMERA_PATH
+		void look_at(const Vec3_t &eye, const Vec3_t &target) {
+			aim(eye, target);
+		}
+
+		const CameraState_t &state() {
+			if (m_mode != CAMERA_FREE) return m_moving;
+			if (m_free_dirty) {
+				m_free.view = mat4_view(m_free.eye, m_free.right, m_free.up, m_free.forward);
+				m_free_dirty = false;
+			}
+			return m_free;
+		}
+};
+
+#endif
@@ -0,0 +1,102 @@
+// camera_path.h - scripted camera flights for benchmarks
+//
+// A path file is a list of keyframes, one per line, blank lines and # comments skipped:
+//
+//   # seconds  eye x y z         target x y z
+//   0          150 120 100       150 0 -150
+//   4          20 4 -15          20 4 -200
+//
+// Keyframe times have to go up. sample() runs a Catmull-Rom spline through the eyes
+// and another through the targets (tangents from the neighbouring keys, scaled by
+// their spacing in time so uneven keys don't overshoot), and wraps around past the
+// last key. No GL in here.
+
+#ifndef CAMERA_PATH_H
+#define CAMERA_PATH_H
+
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <string>
+
+#include <math.h>
+
+#include "mat.h"
+
+typedef struct CameraKey_struct {
+	float time; // seconds
+	Vec3_t eye, target;
+} CameraKey_t;
+
+class CameraPath {
+	private:
+		std::vector<CameraKey_t> m_keys;
+
+		// finite difference tangent of key i, per second
+		Vec3_t tangent(size_t i, bool eye) {
+			size_t prev = i > 0 ? i - 1 : i;
+			size_t next = i + 1 < m_keys.size() ? i + 1 : i;
+			float dt = m_keys[next].time - m_keys[prev].time;
+			if (dt <= 0) return Vec3_t();
+			Vec3_t a = eye ? m_keys[prev].eye : m_keys[prev].target;
+			Vec3_t b = eye ? m_keys[next].eye : m_keys[next].target;
+			return (b - a) * (1.0f / dt);
+		}
+
+		Vec3_t hermite(size_t i, float s, float dt, bool eye) {
+			float s2 = s * s, s3 = s2 * s;
+			Vec3_t p0 = eye ? m_keys[i].eye : m_keys[i].target;
+			Vec3_t p1 = eye ? m_keys[i + 1].eye : m_keys[i + 1].target;
+			return p0 * (2 * s3 - 3 * s2 + 1) + tangent(i, eye) * ((s3 - 2 * s2 + s) * dt)
+				+ p1 * (-2 * s3 + 3 * s2) + tangent(i + 1, eye) * ((s3 - s2) * dt);
+		}
+
+	public:
+		// false if the file can't be read, has a bad line or has no keys
+		bool load(const char *filename) {
+			std::ifstream file(filename);
+			if (!file) return false;
+			m_keys.clear();
+			std::string line;
+			while (std::getline(file, line)) {
+				size_t comment = line.find('#');
+				if (comment != std::string::npos) line.erase(comment);
+				if (line.find_first_not_of(" \t\r") == std::string::npos) continue;
+
+				std::istringstream fields(line);
+				CameraKey_t key;
+				if (!(fields >> key.time >> key.eye.x >> key.eye.y >> key.eye.z >> key.target.x >> key.target.y >> key.target.z)) return false;
+				if (!m_keys.empty() && key.time <= m_keys.back().time) return false;
+				m_keys.push_back(key);
+			}
+			return !m_keys.empty();
+		}
+
+		// seconds from the first key to the last
+		float duration() {
+			return m_keys.empty() ? 0 : m_keys.back().time - m_keys[0].time;
+		}
+
+		void sample(float time, Vec3_t &eye, Vec3_t &target) {
+			if (m_keys.size() == 1 || duration() <= 0) {
+				eye = m_keys[0].eye;
+				target = m_keys[0].target;
+				return;
+			}
+			float t = m_keys[0].time + fmodf(time, duration());
+
+			// keys are few, a linear search is fine
+			size_t i = 0;
+			while (i + 2 < m_keys.size() && t >= m_keys[i + 1].time) i++;
+			float dt = m_keys[i + 1].time - m_keys[i].time;
+			float s = (t - m_keys[i].time) / dt;
+			eye = hermite(i, s, dt, true);
+			target = hermite(i, s, dt, false);
+		}
+
+		bool empty() {
+			return m_keys.empty();
+		}
+};
+
+#endif
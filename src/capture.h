@@ -0,0 +1,303 @@
+// capture.h - records the window to disk without stalling the frame
+//
+// grab() queues a glReadPixels of the back buffer into one of a ring of pixel
+// pack buffers and returns straight away. The buffer is mapped CAPTURE_LAG frames
+// later, when the GPU is long done with it, and the mapped pointer goes to a writer
+// thread. That thread converts the pixels out of the mapping, lets the main thread
+// unmap it, then does the slow part (CBitmap::Save or a Y4M frame) on its own time.
+//
+// BMP mode writes <prefix>00000.bmp, <prefix>00001.bmp, ...
+// Y4M mode writes one raw 4:4:4 stream, "-" for stdout, e.g.
+//   ./a.out -y4m - | ffmpeg -i - flythrough.mp4
+
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#ifdef __APPLE__
+#include <OpenGL/gl3.h>
+#else
+#include <GL/glew.h>
+#include <GL/gl.h>
+#endif
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <chrono>
+#include <iostream>
+#include <condition_variable>
+
+#include <stdio.h>
+#include <string.h>
+
+#include "bitmap.h"
+
+#define CAPTURE_RING 4 // pack buffers in flight
+#define CAPTURE_LAG 2  // frames between reading a buffer and mapping it
+
+enum { CAPTURE_BMP, CAPTURE_Y4M };
+
+class FrameCapture {
+	private:
+		enum { SLOT_IDLE, SLOT_READING, SLOT_MAPPED };
+
+		typedef struct Slot_struct {
+			GLuint pbo;
+			int width, height; // what the buffer is sized for
+			int state;
+			unsigned int frame;
+			const uint8_t *pixels; // while mapped
+			bool released; // writer is done reading the mapping
+		} Slot_t;
+
+		Slot_t m_slots[CAPTURE_RING];
+		unsigned int m_head; // slot the next grab reads into
+		unsigned int m_frames;
+
+		int m_mode;
+		std::string m_target;
+		FILE *m_y4m;
+		int m_y4m_width, m_y4m_height;
+		int m_fps;
+
+		// writer thread, jobs are slot indices
+		std::thread m_writer;
+		std::mutex m_lock;
+		std::condition_variable m_wake, m_released;
+		std::deque<int> m_jobs;
+		bool m_quit;
+
+		double m_main_ms; // main thread time spent in grab(), for the report
+
+		// BGRA is what the driver keeps the back buffer in, anything else swizzles on the cpu
+		void read(Slot_t &slot, int width, int height) {
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.pbo);
+			if (slot.width != width || slot.height != height) {
+				glBufferData(GL_PIXEL_PACK_BUFFER, width * height * 4, NULL, GL_STREAM_READ);
+				slot.width = width;
+				slot.height = height;
+			}
+			glReadPixels(0, 0, width, height, GL_BGRA, GL_UNSIGNED_BYTE, 0);
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+			slot.state = SLOT_READING;
+			slot.frame = m_frames++;
+		}
+
+		void map(int index) {
+			Slot_t &slot = m_slots[index];
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.pbo);
+			slot.pixels = (const uint8_t*) glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+			if (slot.pixels == NULL) {
+				slot.state = SLOT_IDLE; // lost the frame, nothing to unmap
+				return;
+			}
+
+			std::lock_guard<std::mutex> guard(m_lock);
+			slot.state = SLOT_MAPPED;
+			slot.released = false;
+			m_jobs.push_back(index);
+			m_wake.notify_one();
+		}
+
+		// unmaps a slot the writer is through with, waiting for it if asked to
+		void reclaim(Slot_t &slot, bool wait) {
+			if (slot.state != SLOT_MAPPED) return;
+			{
+				std::unique_lock<std::mutex> guard(m_lock);
+				if (wait) {
+					while (!slot.released) m_released.wait(guard);
+				} else if (!slot.released) {
+					return;
+				}
+			}
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.pbo);
+			glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+			slot.pixels = NULL;
+			slot.state = SLOT_IDLE;
+		}
+
+		void release(Slot_t &slot) {
+			std::lock_guard<std::mutex> guard(m_lock);
+			slot.released = true;
+			m_released.notify_all();
+		}
+
+		// lets the writer run out of jobs and closes the stream, no GL in here
+		void finish() {
+			if (!active()) return;
+			{
+				std::lock_guard<std::mutex> guard(m_lock);
+				m_quit = true;
+				m_wake.notify_one();
+			}
+			m_writer.join();
+
+			if (m_y4m != NULL) {
+				if (m_y4m != stdout) fclose(m_y4m);
+				else fflush(m_y4m);
+				m_y4m = NULL;
+			}
+		}
+
+		void write_loop() {
+			CBitmap image;
+			std::vector<uint8_t> planes;
+
+			for (;;) {
+				int index;
+				{
+					std::unique_lock<std::mutex> guard(m_lock);
+					while (m_jobs.empty() && !m_quit) m_wake.wait(guard);
+					if (m_jobs.empty()) return;
+					index = m_jobs.front();
+					m_jobs.pop_front();
+				}
+
+				Slot_t &slot = m_slots[index];
+				if (m_mode == CAPTURE_BMP) {
+					// copy out of the mapping first so the buffer goes back into the ring before the disk write
+					char name[32];
+					snprintf(name, sizeof(name), "%05u.bmp", slot.frame);
+					image.SetBits((void*) slot.pixels, slot.width, slot.height, 0x00FF0000, 0x0000FF00, 0x000000FF, 0xFF000000);
+					release(slot);
+
+					if (!image.Save((m_target + name).c_str(), 24)) {
+						std::cerr << "Could not write " << m_target << name << std::endl;
+					}
+				} else {
+					bool fits = y4m_planes(slot, planes);
+					release(slot);
+					if (fits) {
+						fputs("FRAME\n", m_y4m);
+						fwrite(&planes[0], 1, planes.size(), m_y4m);
+					}
+				}
+			}
+		}
+
+		// BT.601 studio swing, planes top row first. false when the frame doesn't match the stream size.
+		bool y4m_planes(Slot_t &slot, std::vector<uint8_t> &planes) {
+			if (m_y4m_width == 0) {
+				m_y4m_width = slot.width;
+				m_y4m_height = slot.height;
+				fprintf(m_y4m, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C444\n", m_y4m_width, m_y4m_height, m_fps);
+			}
+			if (slot.width != m_y4m_width || slot.height != m_y4m_height) {
+				std::cerr << "Skipping captured frame " << slot.frame << ", the window was resized." << std::endl;
+				return false;
+			}
+
+			int count = slot.width * slot.height;
+			planes.resize(count * 3);
+			uint8_t *y_plane = &planes[0], *u_plane = y_plane + count, *v_plane = u_plane + count;
+
+			for (int row = 0; row < slot.height; row++) {
+				const uint8_t *src = slot.pixels + (slot.height - 1 - row) * slot.width * 4;
+				int out = row * slot.width;
+				for (int x = 0; x < slot.width; x++, src += 4, out++) {
+					int b = src[0], g = src[1], r = src[2];
+					y_plane[out] = ((66 * r + 129 * g + 25 * b + 128) >> 8) + 16;
+					u_plane[out] = ((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128;
+					v_plane[out] = ((112 * r - 94 * g - 18 * b + 128) >> 8) + 128;
+				}
+			}
+			return true;
+		}
+
+	public:
+		FrameCapture() : m_head(0), m_frames(0), m_mode(CAPTURE_BMP), m_y4m(NULL), m_fps(30), m_quit(false), m_main_ms(0) {
+			for (int i = 0; i < CAPTURE_RING; i++) {
+				m_slots[i].pbo = 0;
+				m_slots[i].width = m_slots[i].height = 0;
+				m_slots[i].state = SLOT_IDLE;
+				m_slots[i].pixels = NULL;
+			}
+		}
+
+		// without a stop() first (GL has to still be around for that) only what was mapped makes it out
+		~FrameCapture() {
+			finish();
+		}
+
+		bool active() {
+			return m_writer.joinable();
+		}
+
+		// target is the file name prefix for CAPTURE_BMP, the stream for CAPTURE_Y4M ("-" is stdout)
+		bool start(int mode, const char *target, int fps = 30) {
+			if (active()) stop();
+
+			m_mode = mode;
+			m_target = target;
+			m_fps = fps;
+			m_y4m_width = m_y4m_height = 0;
+			if (m_mode == CAPTURE_Y4M) {
+				m_y4m = (m_target == "-") ? stdout : fopen(target, "wb");
+				if (m_y4m == NULL) {
+					std::cerr << "Could not open " << target << " for capture." << std::endl;
+					return false;
+				}
+			}
+
+			if (m_slots[0].pbo == 0) {
+				GLuint pbos[CAPTURE_RING];
+				glGenBuffers(CAPTURE_RING, pbos);
+				for (int i = 0; i < CAPTURE_RING; i++) m_slots[i].pbo = pbos[i];
+			}
+
+			m_head = 0;
+			m_frames = 0;
+			m_main_ms = 0;
+			m_quit = false;
+			m_writer = std::thread(&FrameCapture::write_loop, this);
+			return true;
+		}
+
+		// call with the frame drawn, before swapping
+		void grab(int width, int height) {
+			if (!active()) return;
+			std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+			glPixelStorei(GL_PACK_ALIGNMENT, 4);
+
+			// the writer is usually done with everything but the last frame or two
+			for (int i = 0; i < CAPTURE_RING; i++) reclaim(m_slots[i], false);
+
+			Slot_t &slot = m_slots[m_head];
+			reclaim(slot, true); // only blocks when the disk can't keep up
+			read(slot, width, height);
+
+			int lagged = (m_head + CAPTURE_RING - CAPTURE_LAG) % CAPTURE_RING;
+			if (m_slots[lagged].state == SLOT_READING) map(lagged);
+			m_head = (m_head + 1) % CAPTURE_RING;
+
+			m_main_ms += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+		}
+
+		// drains the ring and waits for everything to hit the disk
+		void stop() {
+			if (!active()) return;
+
+			// map whatever is still in flight, oldest first so frames stay in order
+			for (int i = 0; i < CAPTURE_RING; i++) {
+				int index = (m_head + i) % CAPTURE_RING;
+				if (m_slots[index].state == SLOT_READING) map(index);
+			}
+			for (int i = 0; i < CAPTURE_RING; i++) reclaim(m_slots[i], true);
+
+			finish();
+
+			// report on stderr, stdout may be the video
+			if (m_frames > 0) {
+				std::cerr << "Captured " << m_frames << " frames, " << m_main_ms / m_frames << " ms per frame on the main thread." << std::endl;
+			}
+		}
+};
+
+#endif
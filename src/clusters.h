@@ -0,0 +1,185 @@
+// clusters.h - clustered forward shading for the point lights (streetlights, headlights)
+//
+// The view frustum is cut into CLUSTER_X by CLUSTER_Y tiles on screen and CLUSTER_Z
+// slices in depth, spaced logarithmically out to LIGHT_DISTANCE. Every frame build()
+// finds the clusters each light's sphere touches and writes, per cluster, a range
+// into one list of light indices. frag.glsl looks up the cluster its fragment is in
+// and only loops over the lights in that range, so a fragment costs what its cluster
+// holds however many lights there are.
+//
+// Everything goes to the shaders through buffer textures (GL 3.1, unlike SSBOs):
+// the lights themselves, a (first, count) pair per cluster and the index list.
+// The clusters are found on the cpu, the per light part spread over the job pool.
+//
+// Fill lights, then once a frame build() and upload().
+
+#ifndef CLUSTERS_H
+#define CLUSTERS_H
+
+#ifdef __APPLE__
+#include <OpenGL/gl3.h>
+#else
+#include <GL/glew.h>
+#include <GL/gl.h>
+#endif
+
+#include <vector>
+
+#include <math.h>
+#include <stdint.h>
+
+#include "mat.h"
+#include "jobs.h"
+
+// also in frag.glsl
+#define CLUSTER_X 16
+#define CLUSTER_Y 9
+#define CLUSTER_Z 24
+#define CLUSTER_NEAR 2.0 // the first slice goes from the eye to here
+#define LIGHT_DISTANCE 600.0 // no point lights past this far from the eye
+#define CLUSTER_COUNT (CLUSTER_X * CLUSTER_Y * CLUSTER_Z)
+#define CLUSTER_LIGHT_CHUNK 1024 // lights per job
+
+// two RGBA32F texels in the lights buffer texture
+typedef struct PointLight_struct {
+	float x, y, z, radius; // world space, nothing past radius is lit
+	float r, g, b, pad;
+} PointLight_t;
+
+// the clusters a light touches, an inclusive box. x0 > x1 when it touches none
+typedef struct ClusterBox_struct {
+	uint8_t x0, x1, y0, y1, z0, z1;
+} ClusterBox_t;
+
+class LightClusters {
+	private:
+		GLuint m_buffers[3], m_textures[3]; // lights, cluster ranges, indices
+		float m_scale_x, m_scale_y; // the projection's x and y scale
+		size_t m_index_limit; // GL_MAX_TEXTURE_BUFFER_SIZE
+
+		std::vector<ClusterBox_t> m_boxes; // per light
+		std::vector<uint32_t> m_ranges; // first and count per cluster
+		std::vector<uint32_t> m_indices;
+
+		// view depth to slice, the same sum as frag.glsl
+		static int slice(float depth) {
+			if (depth <= CLUSTER_NEAR) return 0;
+			return (int) (log(depth / CLUSTER_NEAR) * (CLUSTER_Z / log(LIGHT_DISTANCE / CLUSTER_NEAR)));
+		}
+
+		// ndc (-1..1) to a tile, clamped to the screen
+		static int tile(float ndc, int tiles) {
+			int t = (int) floor((ndc * 0.5 + 0.5) * tiles);
+			return t < 0 ? 0 : (t >= tiles ? tiles - 1 : t);
+		}
+
+		// conservative: the sphere's box in view space, each side projected at whichever end of its depth range is widest
+		void place(const Mat4_t &view, const PointLight_t &light, ClusterBox_t &box) {
+			box.x0 = 1;
+			box.x1 = 0;
+			Vec3_t c = mat4_transform_point(view, Vec3_t(light.x, light.y, light.z));
+			float near = fmax(-c.z - light.radius, 0.01f), far = -c.z + light.radius;
+			if (far <= 0.01 || near >= LIGHT_DISTANCE) return;
+
+			float x0 = c.x - light.radius, x1 = c.x + light.radius, y0 = c.y - light.radius, y1 = c.y + light.radius;
+			box.x0 = tile(m_scale_x * x0 / (x0 < 0 ? near : far), CLUSTER_X);
+			box.x1 = tile(m_scale_x * x1 / (x1 > 0 ? near : far), CLUSTER_X);
+			box.y0 = tile(m_scale_y * y0 / (y0 < 0 ? near : far), CLUSTER_Y);
+			box.y1 = tile(m_scale_y * y1 / (y1 > 0 ? near : far), CLUSTER_Y);
+			box.z0 = slice(near);
+			int last = slice(far);
+			box.z1 = last < CLUSTER_Z ? last : CLUSTER_Z - 1;
+		}
+
+		template <typename T> void upload(int which, const std::vector<T> &data) {
+			glBindBuffer(GL_TEXTURE_BUFFER, m_buffers[which]);
+			glBufferData(GL_TEXTURE_BUFFER, data.size() * sizeof(T), data.empty() ? NULL : &data[0], GL_STREAM_DRAW);
+		}
+
+	public:
+		std::vector<PointLight_t> lights;
+
+		LightClusters() : m_scale_x(1), m_scale_y(1), m_index_limit(65536) {
+			for (int i = 0; i < 3; i++) m_buffers[i] = m_textures[i] = 0;
+		}
+
+		// buffer textures on first_unit onwards: lights, ranges, indices. starts with every cluster empty
+		void setup(GLenum first_unit) {
+			GLint limit;
+			glGetIntegerv(GL_MAX_TEXTURE_BUFFER_SIZE, &limit);
+			m_index_limit = limit;
+
+			const GLenum formats[3] = { GL_RGBA32F, GL_RG32UI, GL_R32UI };
+			glGenBuffers(3, m_buffers);
+			glGenTextures(3, m_textures);
+			for (int i = 0; i < 3; i++) {
+				glBindBuffer(GL_TEXTURE_BUFFER, m_buffers[i]);
+				glBufferData(GL_TEXTURE_BUFFER, 16, NULL, GL_STREAM_DRAW);
+				glActiveTexture(first_unit + i);
+				glBindTexture(GL_TEXTURE_BUFFER, m_textures[i]);
+				glTexBuffer(GL_TEXTURE_BUFFER, formats[i], m_buffers[i]);
+			}
+			glActiveTexture(GL_TEXTURE0);
+
+			m_ranges.assign(CLUSTER_COUNT * 2, 0);
+			upload(1, m_ranges);
+			glBindBuffer(GL_TEXTURE_BUFFER, 0);
+		}
+
+		// the camera's projection, the tiles only change with it
+		void set_projection(const Mat4_t &projection) {
+			m_scale_x = projection.at(0, 0);
+			m_scale_y = projection.at(1, 1);
+		}
+
+		void build(const Mat4_t &view, JobPool &jobs) {
+			m_boxes.resize(lights.size());
+			jobs.parallel_for(lights.size(), CLUSTER_LIGHT_CHUNK, [&](size_t begin, size_t end) {
+				for (size_t i = begin; i < end; i++) place(view, lights[i], m_boxes[i]);
+			});
+
+			// count, then turn the counts into firsts, then fill. a full index list drops what's left over
+			m_ranges.assign(CLUSTER_COUNT * 2, 0);
+			for (size_t i = 0; i < m_boxes.size(); i++) {
+				const ClusterBox_t &b = m_boxes[i];
+				for (int z = b.z0; z <= b.z1 && b.x0 <= b.x1; z++)
+					for (int y = b.y0; y <= b.y1; y++)
+						for (int x = b.x0; x <= b.x1; x++) m_ranges[((z * CLUSTER_Y + y) * CLUSTER_X + x) * 2 + 1]++;
+			}
+			uint32_t first = 0;
+			for (int c = 0; c < CLUSTER_COUNT; c++) {
+				uint32_t count = m_ranges[c * 2 + 1];
+				if (first + count > m_index_limit) count = m_index_limit - first;
+				m_ranges[c * 2] = first;
+				m_ranges[c * 2 + 1] = 0;
+				first += count;
+			}
+			m_indices.resize(first);
+			for (size_t i = 0; i < m_boxes.size(); i++) {
+				const ClusterBox_t &b = m_boxes[i];
+				for (int z = b.z0; z <= b.z1 && b.x0 <= b.x1; z++)
+					for (int y = b.y0; y <= b.y1; y++)
+						for (int x = b.x0; x <= b.x1; x++) {
+							int c = (z * CLUSTER_Y + y) * CLUSTER_X + x;
+							uint32_t slot = m_ranges[c * 2] + m_ranges[c * 2 + 1];
+							if (slot >= first || (c + 1 < CLUSTER_COUNT && slot >= m_ranges[c * 2 + 2])) continue;
+							m_indices[slot] = i;
+							m_ranges[c * 2 + 1]++;
+						}
+			}
+		}
+
+		void upload() {
+			upload(0, lights);
+			upload(1, m_ranges);
+			upload(2, m_indices);
+			glBindBuffer(GL_TEXTURE_BUFFER, 0);
+		}
+
+		// light references over all the clusters last build(), for the benchmark
+		size_t references() {
+			return m_indices.size();
+		}
+};
+
+#endif
@@ -0,0 +1,44 @@
+#version 430 core
+
+#include "frame.glsl"
+
+// one invocation per city block: copies its draw command into the indirect buffer,
+// with no instances if its bounding sphere is outside the view frustum.
+// mat4_frustum_planes() in mat.h is the cpu version.
+
+layout(local_size_x = 64) in; // CULL_GROUP_SIZE in main.cpp
+
+struct DrawCommand {
+	uint count;
+	uint instance_count;
+	uint first_index;
+	int base_vertex;
+	uint base_instance;
+};
+
+layout(std430, binding = 1) readonly buffer Commands { DrawCommand commands[]; };
+layout(std430, binding = 2) readonly buffer Bounds { vec4 bounds[]; }; // xyz center, w radius
+layout(std430, binding = 3) writeonly buffer Visible { DrawCommand visible[]; };
+
+uniform uint command_count;
+uniform uint instance_base; // where this frame's instances start, the commands' base_instance is relative to it
+
+void main() {
+	uint i = gl_GlobalInvocationID.x;
+	if (i >= command_count) return;
+
+	// rows of the view projection give the planes, left right bottom top near far
+	mat4 rows = transpose(view_projection);
+	vec4 planes[6] = vec4[6](rows[3] + rows[0], rows[3] - rows[0], rows[3] + rows[1], rows[3] - rows[1], rows[3] + rows[2], rows[3] - rows[2]);
+
+	vec4 sphere = bounds[i];
+	bool inside = true;
+	for (int p = 0; p < 6; p++) {
+		if (dot(planes[p].xyz, sphere.xyz) + planes[p].w < -sphere.w * length(planes[p].xyz)) inside = false;
+	}
+
+	DrawCommand command = commands[i];
+	if (!inside) command.instance_count = 0u;
+	command.base_instance += instance_base;
+	visible[i] = command;
+}
@@ -0,0 +1,108 @@
+// daylight.h - time of day: where the sun is and what the light and sky look like
+//
+// The hour comes from the scene clock (so replays and benchmarks see the same day),
+// but the lighting only moves in TIME_STEP_MINUTES steps: update() says when a step
+// has passed, and only then does anything need uploading or re-rendering (the cached
+// shadows redraw the city whenever the sun moves, see shadows.h).
+//
+// The sun rises in the east (+x) at 6, sets in the west at 18 and passes south of the
+// city (+z) at noon. No GL in here.
+
+#ifndef DAYLIGHT_H
+#define DAYLIGHT_H
+
+#include <math.h>
+
+#include "mat.h"
+
+#define TIME_STEP_MINUTES 5 // of game time between lighting changes
+#define SUN_TILT 0.45 // radians the sun's path leans south
+
+typedef struct Color_struct {
+	float r, g, b;
+	Color_struct(float rr, float gg, float bb) : r(rr), g(gg), b(bb) {};
+	Color_struct() : r(0), g(0), b(0) {};
+} Color_t;
+
+inline Color_t color_mix(const Color_t &a, const Color_t &b, float t) {
+	return Color_t(a.r + (b.r - a.r) * t, a.g + (b.g - a.g) * t, a.b + (b.b - a.b) * t);
+}
+
+inline float smooth_step(float edge0, float edge1, float x) {
+	float t = fmin(fmax((x - edge0) / (edge1 - edge0), 0.0f), 1.0f);
+	return t * t * (3 - 2 * t);
+}
+
+class TimeOfDay {
+	private:
+		double m_start_hour, m_day_seconds;
+		long m_step; // current TIME_STEP_MINUTES step, -1 before the first update
+
+		float m_hour;
+		Vec3_t m_sun; // towards the sun, world space
+		Color_t m_sun_color, m_ambient, m_sky;
+		float m_night; // 0 in daylight, 1 once it's dark
+
+		void light() {
+			// the sun goes all the way round, below the horizon at night
+			double angle = (m_hour - 6.0) / 24.0 * 2 * M_PI;
+			m_sun = Vec3_t(cos(angle), sin(angle) * cos(SUN_TILT), sin(angle) * sin(SUN_TILT));
+
+			// full white sun from a bit over the horizon, orange and fading down to it
+			float up = smooth_step(0.0, 0.15, m_sun.y);
+			float high = smooth_step(0.0, 0.4, m_sun.y);
+			Color_t sun = color_mix(Color_t(1.0, 0.55, 0.3), Color_t(1.0, 1.0, 1.0), high);
+			m_sun_color = Color_t(sun.r * up, sun.g * up, sun.b * up);
+
+			m_night = 1 - smooth_step(-0.15, 0.05, m_sun.y);
+			m_ambient = Color_t(0.1 * m_night, 0.12 * m_night, 0.2 * m_night); // moonlight
+
+			Color_t day(0.52, 0.8, 0.92), dusk(0.9, 0.55, 0.35), night(0.02, 0.03, 0.08);
+			m_sky = m_sun.y > 0 ? color_mix(dusk, day, high) : color_mix(dusk, night, smooth_step(0.0, -0.15, m_sun.y));
+		}
+
+	public:
+		TimeOfDay() : m_start_hour(15), m_day_seconds(600), m_step(-1), m_hour(15), m_night(0) {
+			light();
+		}
+
+		// day_seconds of scene time is a whole day, 0 stops the clock at start_hour
+		void set(double start_hour, double day_seconds) {
+			m_start_hour = start_hour;
+			m_day_seconds = day_seconds;
+			m_step = -1;
+		}
+
+		// jump the clock, for the key that skips ahead
+		void skip(double hours) {
+			m_start_hour = fmod(m_start_hour + hours, 24.0);
+		}
+
+		// true when the lighting changed since the last call
+		bool update(double seconds) {
+			double hour = m_start_hour;
+			if (m_day_seconds > 0) hour += seconds / m_day_seconds * 24.0;
+			hour = fmod(hour, 24.0);
+
+			long step = (long) floor(hour * 60.0 / TIME_STEP_MINUTES);
+			if (step == m_step) return false;
+			m_step = step;
+			m_hour = step * TIME_STEP_MINUTES / 60.0;
+			light();
+			return true;
+		}
+
+		float hour() { return m_hour; }
+		const Vec3_t &sun() { return m_sun; }
+		const Color_t &sun_color() { return m_sun_color; }
+		const Color_t &ambient() { return m_ambient; }
+		const Color_t &sky() { return m_sky; }
+		float night() { return m_night; }
+
+		// the sun's over the horizon and lighting anything, it's worth casting shadows
+		bool sun_up() {
+			return m_sun.y > 0;
+		}
+};
+
+#endif
@@ -1,15 +1,99 @@
-uniform sampler2D textures[6];
-uniform float tex_flag;
+#version 330 core
 
-varying vec2 texCoord;
-varying float diffVal;
+// built once with each of these defined (setup_graphics() in main.cpp), one per TEX_* in mesh.h,
+// so what gets sampled is fixed per program instead of branched on per fragment:
+//   UNTEXTURED       the vertex color
+//   TEXTURE_ATLAS    the facade atlas, and the windows at night
+//   TEXTURE_BASEMAP  the ground tiles
+//   ROAD_MARKINGS    the vertex color in dashes, u in dash periods and v the painted part of one (road.h)
+
+#include "frame.glsl"
+#include "lighting.glsl"
+
+#define SHADOW_BIAS 0.0005
+#define SHADOW_DARK 0.4 // what's left of the sun in shadow
+#define WINDOW_CELLS 32.0 // windows across an atlas texture, roughly
+#define WINDOW_GLOW vec3(1.0, 0.8, 0.45)
+
+// the light clusters, the same as clusters.h
+#define CLUSTER_X 16
+#define CLUSTER_Y 9
+#define CLUSTER_Z 24
+#define CLUSTER_NEAR 2.0
+#define LIGHT_DISTANCE 600.0
+
+#if defined(TEXTURE_ATLAS)
+uniform sampler2D atlas;
+#elif defined(TEXTURE_BASEMAP)
+uniform sampler2D basemap;
+#endif
+uniform sampler2DArrayShadow shadows;
+uniform samplerBuffer lights; // two texels a light: xyz and radius, then the color
+uniform usamplerBuffer light_clusters; // first index and count, per cluster
+uniform usamplerBuffer light_indices;
+
+in vec2 texCoord;
+in vec4 vertColor;
+in vec3 worldNormal;
+in vec3 worldPos;
+in float viewDepth;
+
+out vec4 fragColor;
+
+// 1 in the sun, 0 in shadow
+float sunlight() {
+	if (viewDepth >= shadow_splits.z) return 1.0;
+	int cascade = viewDepth < shadow_splits.x ? 0 : (viewDepth < shadow_splits.y ? 1 : 2);
+	vec3 p = (shadow_matrix[cascade] * vec4(worldPos, 1.0)).xyz * 0.5 + 0.5;
+	return texture(shadows, vec4(p.xy, cascade, p.z - SHADOW_BIAS));
+}
+
+// the streetlights and headlights, only the ones in this fragment's cluster
+vec3 point_lights(vec3 normal) {
+	if (viewDepth >= LIGHT_DISTANCE) return vec3(0.0);
+	ivec2 tile = min(ivec2(gl_FragCoord.xy * viewport.zw * vec2(CLUSTER_X, CLUSTER_Y)), ivec2(CLUSTER_X - 1, CLUSTER_Y - 1));
+	int slice = viewDepth <= CLUSTER_NEAR ? 0 : int(log(viewDepth / CLUSTER_NEAR) * (float(CLUSTER_Z) / log(LIGHT_DISTANCE / CLUSTER_NEAR)));
+	uvec2 range = texelFetch(light_clusters, (min(slice, CLUSTER_Z - 1) * CLUSTER_Y + tile.y) * CLUSTER_X + tile.x).xy;
+
+	vec3 total = vec3(0.0);
+	for (uint i = range.x; i < range.x + range.y; i++) {
+		int light = int(texelFetch(light_indices, int(i)).x);
+		vec4 sphere = texelFetch(lights, light * 2);
+		vec3 to_light = sphere.xyz - worldPos;
+		float reach = dot(to_light, to_light) / (sphere.w * sphere.w);
+		if (reach >= 1.0) continue;
+		float falloff = (1.0 - reach) * (1.0 - reach);
+		total += texelFetch(lights, light * 2 + 1).rgb * falloff * max(dot(normal, normalize(to_light)), 0.0);
+	}
+	return total;
+}
+
+#ifdef TEXTURE_ATLAS
+// a facade texel that's a lit window at night. the building's share of lit windows
+// comes in the vertex alpha, which window is lit is a hash of where it is in the atlas
+vec3 windows(vec4 texel) {
+	if (night <= 0.0 || texel.b < texel.r + 0.08) return vec3(0.0); // only the glass glows
+	vec2 cell = floor(texCoord * WINDOW_CELLS);
+	float pick = fract(sin(dot(cell, vec2(12.9898, 78.233))) * 43758.5453);
+	return pick < vertColor.a ? WINDOW_GLOW * night : vec3(0.0);
+}
+#endif
 
 void main() {
-	if (tex_flag == 0.0) gl_FragColor = gl_Color * diffVal;
-    else if (tex_flag == 1.0) gl_FragColor = texture2D(textures[0], texCoord)*diffVal;
-    else if (tex_flag == 2.0) gl_FragColor = texture2D(textures[1], texCoord)*diffVal;
-    else if (tex_flag == 3.0) gl_FragColor = texture2D(textures[2], texCoord)*diffVal;
-    else if (tex_flag == 4.0) gl_FragColor = texture2D(textures[3], texCoord)*diffVal;
-    else if (tex_flag == 5.0) gl_FragColor = texture2D(textures[4], texCoord)*diffVal;
-    else if (tex_flag == 6.0) gl_FragColor = texture2D(textures[5], texCoord)*diffVal;
+#ifdef ROAD_MARKINGS
+	if (fract(texCoord.x) >= texCoord.y) discard;
+#endif
+	// the normals are unit length per vertex, interpolating shortens them
+	vec3 normal = normalize(worldNormal);
+	float diffuse = max(dot(normal, sun.xyz), 0.0);
+	vec3 lamps = night > 0.0 ? point_lights(normal) * night : vec3(0.0); // they only come on after dark
+	vec4 light = vec4(ambient.rgb + sun_color.rgb * diffuse * mix(SHADOW_DARK, 1.0, sunlight()) + lamps, 1.0);
+#if defined(TEXTURE_ATLAS)
+	vec4 texel = texture(atlas, texCoord);
+	fragColor = texel * light + vec4(windows(texel), 0.0);
+#elif defined(TEXTURE_BASEMAP)
+	fragColor = texture(basemap, texCoord) * light;
+#else
+	fragColor = vertColor * light;
+#endif
 }
@@ -0,0 +1,10 @@
+// per frame state, filled once a frame by update_frame_uniforms() (FrameUniforms_t in main.cpp)
+layout(std140) uniform Frame {
+	mat4 view;
+	mat4 projection;
+	mat4 view_projection;
+	vec4 viewport; // width, height, 1 / width, 1 / height
+	float time; // seconds
+	mat4 shadow_matrix[3]; // world to each cascade's clip space, SHADOW_CASCADES in shadows.h
+	vec4 shadow_splits; // view depth where each cascade ends, all 0 with shadows off
+};
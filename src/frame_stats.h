@@ -0,0 +1,73 @@
+// frame_stats.h - per frame timings and counts for the benchmark mode
+//
+// add() a frame's time, draw calls, state changes and triangles, report() prints the mean, the
+// 50th / 95th / 99th percentile (nearest rank) and the max of the frame times and
+// the mean and max of the counts. No GL in here.
+
+#ifndef FRAME_STATS_H
+#define FRAME_STATS_H
+
+#include <vector>
+#include <ostream>
+#include <iomanip>
+#include <algorithm>
+
+#include <math.h>
+#include <stdint.h>
+
+class FrameStats {
+	private:
+		std::vector<double> m_ms;
+		std::vector<uint64_t> m_draws, m_state_changes, m_triangles;
+
+		static double percentile(const std::vector<double> &sorted, double p) {
+			size_t rank = (size_t) ceil(p / 100.0 * sorted.size());
+			return sorted[rank > 0 ? rank - 1 : 0];
+		}
+
+		template <typename T> static double mean(const std::vector<T> &values) {
+			double sum = 0;
+			for (size_t i = 0; i < values.size(); i++) sum += values[i];
+			return values.empty() ? 0 : sum / values.size();
+		}
+
+	public:
+		void reserve(size_t frames) {
+			m_ms.reserve(frames);
+			m_draws.reserve(frames);
+			m_state_changes.reserve(frames);
+			m_triangles.reserve(frames);
+		}
+
+		void add(double ms, uint64_t draws, uint64_t state_changes, uint64_t triangles) {
+			m_ms.push_back(ms);
+			m_draws.push_back(draws);
+			m_state_changes.push_back(state_changes);
+			m_triangles.push_back(triangles);
+		}
+
+		size_t frames() {
+			return m_ms.size();
+		}
+
+		void report(std::ostream &out) {
+			if (m_ms.empty()) {
+				out << "no frames" << std::endl;
+				return;
+			}
+			std::vector<double> sorted = m_ms;
+			std::sort(sorted.begin(), sorted.end());
+
+			out << std::fixed << std::setprecision(2);
+			out << m_ms.size() << " frames, frame ms: mean " << mean(m_ms) << "  p50 " << percentile(sorted, 50)
+				<< "  p95 " << percentile(sorted, 95) << "  p99 " << percentile(sorted, 99) << "  max " << sorted.back() << std::endl;
+			out << std::setprecision(0);
+			out << "draw calls per frame: mean " << mean(m_draws) << "  max " << *std::max_element(m_draws.begin(), m_draws.end()) << std::endl;
+			out << "state changes per frame: mean " << mean(m_state_changes) << "  max " << *std::max_element(m_state_changes.begin(), m_state_changes.end()) << std::endl;
+			out << "triangles per frame: mean " << mean(m_triangles) << "  max " << *std::max_element(m_triangles.begin(), m_triangles.end()) << std::endl;
+			out.unsetf(std::ios::floatfield);
+			out << std::setprecision(6);
+		}
+};
+
+#endif
@@ -0,0 +1,125 @@
+// jobs.h - a fixed pool of worker threads for splitting frame prep into chunks
+//
+// parallel_for(count, chunk, fn) calls fn(begin, end) over [0, count) in chunks of
+// at most chunk items, spread over the workers and the calling thread, and returns
+// once every chunk is done. Chunks are handed out in no particular order, so fn must
+// only write to what its own range owns. No GL in here, workers have no context.
+
+#ifndef JOBS_H
+#define JOBS_H
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <functional>
+#include <condition_variable>
+
+#include <stddef.h>
+
+class JobPool {
+	private:
+		std::vector<std::thread> m_workers;
+		std::mutex m_lock;
+		std::condition_variable m_wake, m_done;
+
+		// the job being run, only changes while no worker is in it
+		const std::function<void(size_t, size_t)> *m_job;
+		size_t m_count, m_chunk, m_chunks;
+		std::atomic<size_t> m_next; // next chunk to hand out
+		size_t m_finished; // chunks done, under m_lock
+		unsigned int m_active; // workers inside the job, under m_lock. it isn't replaced until they've all left
+		unsigned int m_generation; // bumped for every job so workers don't run one twice
+		bool m_quit;
+
+		// runs chunks until there are none left, returns how many this thread did
+		size_t run_chunks() {
+			size_t done = 0;
+			for (;;) {
+				size_t chunk = m_next.fetch_add(1);
+				if (chunk >= m_chunks) return done;
+				size_t begin = chunk * m_chunk;
+				size_t end = (begin + m_chunk < m_count) ? begin + m_chunk : m_count;
+				(*m_job)(begin, end);
+				done++;
+			}
+		}
+
+		// worker is true for a worker leaving the job, false for the caller
+		void finish_chunks(size_t done, bool worker) {
+			if (done == 0 && !worker) return;
+			std::lock_guard<std::mutex> guard(m_lock);
+			m_finished += done;
+			if (worker) m_active--;
+			if (m_finished == m_chunks && m_active == 0) m_done.notify_all();
+		}
+
+		void work_loop() {
+			unsigned int seen = 0;
+			for (;;) {
+				{
+					std::unique_lock<std::mutex> guard(m_lock);
+					while (m_generation == seen && !m_quit) m_wake.wait(guard);
+					if (m_quit) return;
+					seen = m_generation;
+					// all its chunks are done, parallel_for may have returned and the next job could come
+					// in while this thread is still looking at the counter
+					if (m_finished == m_chunks) continue;
+					m_active++;
+				}
+				finish_chunks(run_chunks(), true);
+			}
+		}
+
+	public:
+		// threads counts the caller, so JobPool(1) runs everything inline
+		JobPool(unsigned int threads = std::thread::hardware_concurrency()) : m_job(NULL), m_count(0), m_chunk(1), m_chunks(0), m_next(0), m_finished(0), m_active(0), m_generation(0), m_quit(false) {
+			for (unsigned int i = 1; i < threads; i++) m_workers.push_back(std::thread(&JobPool::work_loop, this));
+		}
+
+		~JobPool() {
+			{
+				std::lock_guard<std::mutex> guard(m_lock);
+				m_quit = true;
+				m_wake.notify_all();
+			}
+			for (size_t i = 0; i < m_workers.size(); i++) m_workers[i].join();
+		}
+
+		unsigned int threads() {
+			return m_workers.size() + 1;
+		}
+
+		void parallel_for(size_t count, size_t chunk, const std::function<void(size_t, size_t)> &fn) {
+			if (count == 0) return;
+			if (chunk == 0) chunk = 1;
+
+			// not worth waking anyone for
+			if (count <= chunk || m_workers.empty()) {
+				fn(0, count);
+				return;
+			}
+
+			{
+				std::lock_guard<std::mutex> guard(m_lock);
+				m_job = &fn;
+				m_count = count;
+				m_chunk = chunk;
+				m_chunks = (count + chunk - 1) / chunk;
+				m_next = 0;
+				m_finished = 0;
+				m_generation++;
+				m_wake.notify_all();
+			}
+
+			finish_chunks(run_chunks(), false);
+
+			// a worker can still be inside its last chunk after the counter runs out, or about to read
+			// the counter, and neither may see the next job's
+			std::unique_lock<std::mutex> guard(m_lock);
+			while (m_finished < m_chunks || m_active > 0) m_done.wait(guard);
+			m_job = NULL;
+		}
+};
+
+#endif
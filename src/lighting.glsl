@@ -0,0 +1,7 @@
+// the sun and sky, filled by update_lighting() (LightingUniforms_t in main.cpp) only when the time of day moves on
+layout(std140) uniform Lighting {
+	vec4 sun; // xyz towards the sun, world space
+	vec4 sun_color; // black once it's set
+	vec4 ambient; // moonlight, black by day
+	float night; // 0 by day, 1 once it's dark
+};
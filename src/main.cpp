@@ -4,14 +4,11 @@
 
 #ifdef __APPLE__
 //#include <GL/glew.h>
-#include <OpenGL/gl.h> 
-#include <OpenGL/glu.h>
+#include <OpenGL/gl3.h>
 #include <GLUT/glut.h>
 #else
 #include <GL/glew.h>
-#include <GL/gl.h> 
-#include <GL/glu.h>
-#include <GL/glut.h>
+#include <GL/freeglut.h> // for the core profile context setup
 
 #endif
 
@@ -19,42 +16,185 @@
 #include <vector>
 #include <fstream>
 #include <iostream>
+#include <algorithm>
+#include <chrono>
 
 #include <math.h>
 #include <time.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
 
 #include "bitmap.h"
+#include "texture_cache.h"
+#include "atlas.h"
+#include "capture.h"
+#include "mat.h"
+#include "mesh.h"
+#include "jobs.h"
+#include "stream_buffer.h"
+#include "sim.h"
+#include "models.h"
+#include "road.h"
+#include "replay.h"
+#include "camera_path.h"
+#include "frame_stats.h"
+#include "camera.h"
+#include "shadows.h"
+#include "daylight.h"
+#include "clusters.h"
+#include "shaders.h"
+#include "render_queue.h"
+#include "render_target.h"
 
 using namespace std;
 
 // some OGL globals
-GLuint shader_program;
+// vert.glsl + frag.glsl are built once per TEX_* in mesh.h, with that variant's define
+#define SHADER_VARIANTS 4
+const char *variant_defines[SHADER_VARIANTS] = { "UNTEXTURED", "TEXTURE_ATLAS", "TEXTURE_BASEMAP", "ROAD_MARKINGS" };
+const unsigned int variant_rank[SHADER_VARIANTS] = { 3, 0, 1, 2 }; // per TEX_*, the atlas draws first and untextured last
+GLuint programs[SHADER_VARIANTS];
+ShaderLibrary shader_library; // builds every program below, and rebuilds them when their files change
+int main_shaders[SHADER_VARIANTS], shadow_shaders = -1, cull_shaders = -1; // handles in shader_library
+bool shader_cache = true; // -no-shader-cache always compiles
 int viewport_width = 800;
 int viewport_height = 600;
 
 // program state
 unsigned int frame = 0;
 double rot_x = 0;
-double eyeX, eyeY, eyeZ, tarX, tarY, tarZ, upX, upY, upZ;
-double viewAngX, viewAngY;
+CameraController camera;
 double look_x = 0;
 double look_y = 0;
 int block_size = 30;
-bool spins = false;
 bool spins_pause = true;
-bool follow_car = false;
-GLuint textures[6];
-GLint sun_unif;
+TextureAtlas atlas;
+GLuint atlas_texture;
+const char *facade_files[6] = { "tex0.bmp", "tex1.bmp", "tex2.bmp", "tex3.bmp", "tex4.bmp", "tex5.bmp" };
+int facade_rects[6]; // index into atlas.rects for each of the above
+Mat4_t view_matrix, projection_matrix;
+
+// per frame state every program sees, std140 layout of the Frame block in frame.glsl
+#define FRAME_BINDING 0
+typedef struct FrameUniforms_struct {
+	Mat4_t view;
+	Mat4_t projection;
+	Mat4_t view_projection;
+	float viewport[4]; // width, height, 1 / width, 1 / height
+	float time; // seconds
+	float pad[3];
+	Mat4_t shadow_matrix[SHADOW_CASCADES];
+	float shadow_splits[4]; // view depth where each cascade ends, all 0 with shadows off
+} FrameUniforms_t;
+FrameUniforms_t frame_uniforms;
+GLuint frame_ubo;
+
+// the sun and sky, std140 layout of the Lighting block in lighting.glsl. only uploaded when time_of_day moves on a step
+#define LIGHTING_BINDING 1
+typedef struct LightingUniforms_struct {
+	float sun[4]; // xyz towards the sun, world space
+	float sun_color[4];
+	float ambient[4];
+	float night; // 0 by day, 1 once it's dark
+	float pad[3];
+} LightingUniforms_t;
+TimeOfDay time_of_day; // not "daylight", time.h has one
+GLuint lighting_ubo;
+
+// the city's shadows are cached until the sun moves (shadows.h), which it does every TIME_STEP_MINUTES
+#define SHADOW_TEXTURE_UNIT 2
+ShadowCascades shadows;
+GLuint shadow_program;
+GLint shadow_light_matrix, shadow_instanced; // uniforms in shadow.glsl
+bool shadows_enabled = true; // -no-shadows turns them off
+
+// after dark a light at every street corner and two in front of every car, shaded through clusters.h
+#define LIGHT_TEXTURE_UNIT 3 // and the two after it
+#define STREETLIGHT_HEIGHT 7.0
+#define STREETLIGHT_RADIUS 25.0
+#define HEADLIGHT_AHEAD 5.0 // units in front of the car's center
+#define HEADLIGHT_APART 1.5 // each side of it
+#define HEADLIGHT_RADIUS 10.0
+LightClusters clusters;
+size_t street_lights; // clusters.lights starts with these, the headlights follow
+bool point_lights = true; // -no-lights turns them off
+
+// the scene is drawn offscreen, multisampled, at whatever fraction of the window holds the frame time
+#define DEFAULT_MSAA_SAMPLES 4
+#define DEFAULT_TARGET_MS 16.0 // a 60 Hz refresh with a little to spare
+RenderTarget scene_target;
+int msaa_samples = DEFAULT_MSAA_SAMPLES; // -msaa <samples>, 0 for none
+double target_frame_ms = DEFAULT_TARGET_MS; // -target-ms <ms>, 0 always draws the whole window
+FrameCapture capture;
+int capture_mode = CAPTURE_BMP;
+const char *capture_target = "capture"; // file prefix, or the y4m stream
+
+// -record writes the seed and every input to a file, -replay plays one back frame for frame
+uint32_t seed = 1;
+ReplayWriter recorder;
+ReplayReader player;
+bool replaying = false;
+unsigned int scene_ms = 0; // frame_uniforms.time, recorded so a replay sees the same times
+int last_frame_ms = 0; // GLUT_ELAPSED_TIME at the last frame
+int replay_start_ms = 0;
+unsigned int replay_frames = 0;
+
+// -path <file> flies the camera along camera_path.h keyframes, -bench <frames> times that many frames and quits
+#define BENCH_FRAME_MS 16 // scene time per frame while benchmarking, so every run draws the same frames
+#define STATS_QUERIES 4 // triangle count queries in flight, each is read back this many frames later
+typedef struct PendingFrame_struct {
+	double ms;
+	unsigned int draws, state_changes;
+} PendingFrame_t;
+CameraPath camera_path;
+unsigned int bench_frames = 0; // 0 is no benchmark
+unsigned int bench_frame = 0;
+FrameStats bench_stats;
+unsigned int frame_draws = 0; // draw calls so far this frame
+GLuint primitive_queries[STATS_QUERIES];
+PendingFrame_t bench_pending[STATS_QUERIES]; // frames waiting on their triangle counts
+chrono::steady_clock::time_point bench_last;
+double bench_scale_sum = 0; // of scene_target.scale() every frame
+float bench_scale_min = 1;
+
+// optional base map for the ground, split into tiles because it can be huge
+#define BASEMAP_BLOCK_ROWS 16
+typedef struct Basemap_struct {
+	unsigned int width, height;
+	unsigned int tile_size;
+	unsigned int tiles_x, tiles_y;
+	bool top_down;
+	vector<GLuint> tiles; // row major, tile (0, 0) is the bottom left of the image
+} Basemap_t;
+Basemap_t basemap;
 
 // forward decs of some util funcs
-string get_contents(const char* filename);
-GLint setup_shader(const char* filename);
+void setup_programs();
 bool setup_graphics();
 void setup_textures();
 void setup_camera();
 void setup_viewport();
 GLuint load_texture(const char* filename);
+bool load_ktx_texture(const char* filename, GLuint &tex);
+GLuint build_atlas_texture();
+void setup_basemap(const char* filename);
+bool upload_basemap_rows(RGBA *rows, unsigned int first_row, unsigned int row_count, void *user);
+void draw_ground();
+void setup_frame_uniforms(GLuint program);
+void update_frame_uniforms();
+void update_lighting();
+void setup_geometry();
+void build_city(MeshBuilder &mesh);
+bool setup_culling();
+GLuint fill_car_instances();
+bool setup_shadows();
+void draw_shadows(GLuint instance_base);
+void setup_lights();
+void update_lights();
+void submit_city(GLuint instance_base);
+void submit_city_draw(int variant, unsigned int material, int kind, GLuint first, GLuint count, GLuint instances, GLuint instance_base, float depth);
+void bind_instances(GLuint base);
 void passive_motion(int x, int y);
 
 // forward decs of handlers
@@ -65,565 +205,186 @@ void keyboard_handler(unsigned char key, GLint pos_x, GLint pos_y);
 void keyboard_special_handler(int key, GLint pos_x, GLint pos_y);
 void idle_handler();
 
-// forward decs of camera functions
-void move(int dir);
-void look(int dir);
-void turn(int dir);
-void updateView();
-void track_car();
-double rads(double degrees);
-
-// constants
-#define RIGHT 0
-#define LEFT 1
-#define UP 2
-#define DOWN 3
-#define STOP 4
-#define PI 3.14159265
+// forward decs of what the handlers do, shared with replay
+void resize(int width, int height);
+void handle_key(unsigned char key);
+void handle_special(int key);
+bool play_frame_events();
+void quit();
+void bench_frame_start();
+void bench_frame_end();
+void bench_collect(unsigned int slot);
 
 // forward decs of some graphics helpers
 //void building(int height);
-void building(int height, int tex);
-void car_block(int height, float r, float g, float b);
+void building(MeshBuilder &mesh, int height, int tex, float lights);
+void car_block(MeshBuilder &mesh, int height, float r, float g, float b);
 
 // types and classes
-typedef struct Point2D_struct {
-	GLfloat x;
-	GLfloat y;
-	Point2D_struct(float xx, float yy) : x(xx), y(yy) {};
-	Point2D_struct() {};
-} Point2D_t;
-
-typedef struct Point3D_struct {
-	GLfloat x;
-	GLfloat y;
-	GLfloat z;
-	Point3D_struct(float xx, float yy, float zz) : x(xx), y(yy), z(zz) {};
-	Point3D_struct() {};
-} Point3D_t;
-
-class BlockIterator {
-	// Faux iterator.
-	// This is supposed to give us the smallest (x, y) point in each block
-	private:
-		int m_state;
-		int m_width, m_height;
-		int m_num_x_blocks, m_num_y_blocks;
-
-	public:
-		BlockIterator(int width, int height, int block_size) : m_width(width), m_height(height), m_state(0) {
-			// rounds down and throws out the extra space
-			m_num_x_blocks = m_width / block_size;
-			m_num_y_blocks = m_height / block_size;
-		}
-		
-		Point2D_t next() {
-			int x_offset = (m_width / m_num_x_blocks) * (m_state % m_num_x_blocks); // yes that's recreating block_size, but it's the trimmed one now
-			int y_offset = (m_state / m_num_x_blocks) * (m_height / m_num_y_blocks); // integer division
-
-			Point2D_t output = Point2D_t(x_offset, y_offset);// *output = new Point2D(x_offset, y_offset);
-			m_state++;
-			return output;
-		}
-
-		bool has_next() {
-			return (m_state < m_num_x_blocks * m_num_y_blocks) ? true : false;
-		}
-
-		void reset() {
-			m_state = 0;
-		}
-};
-
-class Building {
-	private:
-		int m_height;
-		int m_tex;
-		GLint m_tex_unif;
-
-		Point3D_t m_verts[8];
-		Point2D_t m_texcoords[4];
-		Point3D_t m_normals[8];
-
-		void vert(int n) {
-			Point3D_t normal = m_normals[n - 1];
-			Point3D_t vertex = m_verts[n - 1];
-			glNormal3f(normal.x, normal.y, normal.z);
-			glVertex3f(vertex.x, vertex.y, vertex.z);
-		}
-
-		void texcoord(int n) {
-			Point2D_t vertex = m_texcoords[n - 1];
-			glTexCoord2f(vertex.x, vertex.y);
-		}
-
-		void tex(int n) {
-			m_tex_unif = glGetUniformLocation(shader_program, "tex_flag");
-			glUniform1f(m_tex_unif, n);
-		}
-
-		// one private method per textured face (as we can't change texture in an FFP block). 6 faces here.
-
-		void emit_front() {
-			// front face
-			glBegin(GL_TRIANGLES);
-				glColor3d(1.0, 0.0, 0.0);
-				texcoord(4); vert(4);    texcoord(1); vert(1);    texcoord(2); vert(2); // LL tri
-				texcoord(4); vert(4);    texcoord(2); vert(2);    texcoord(3); vert(3); // UR tri
-			glEnd();
-		}
-
-		void emit_back() {
-			// back face
-			glBegin(GL_TRIANGLES);
-				glColor3d(0.0, 1.0, 0.0);
-				texcoord(4); vert(5);    texcoord(1); vert(7);    texcoord(2); vert(8); // LL tri
-				texcoord(4); vert(5);    texcoord(2); vert(8);    texcoord(3); vert(6); // UR tri
-			glEnd();			
-		}
-
-		void emit_left() {
-			// left face
-			glBegin(GL_TRIANGLES); 
-				glColor3d(0.0, 0.0, 1.0);
-				texcoord(4); vert(5);    texcoord(1); vert(7);    texcoord(2); vert(1); // LL tri
-				texcoord(4); vert(5);    texcoord(2); vert(1);    texcoord(3); vert(4); // UR tri
-			glEnd();
-		}
-
-		void emit_right() {
-			// right face
-			glBegin(GL_TRIANGLES);
-				glColor3d(1.0, 1.0, 1.0);
-				texcoord(4); vert(3);    texcoord(1); vert(2);    texcoord(2); vert(8); // LL tri
-				texcoord(4); vert(3);    texcoord(2); vert(8);    texcoord(3); vert(6); // UR tri
-			glEnd();
-		}
-
-		void emit_up() {
-			// up face
-			glBegin(GL_TRIANGLES);
-				glColor3d(0.76, 0.76, 0.76);
-				texcoord(4); vert(5);    texcoord(1); vert(4);    texcoord(2); vert(3); // LL tri
-				texcoord(4); vert(5);    texcoord(2); vert(3);    texcoord(3); vert(6); // UR tri
-			glEnd();
-		}
-
-		void emit_down() {
-			// down face
-			glBegin(GL_TRIANGLES);
-				glColor3d(1.0, 1.0, 0.0);
-				texcoord(4); vert(1);    texcoord(1); vert(7);    texcoord(2); vert(8); // LL tri
-				texcoord(4); vert(1);    texcoord(2); vert(8);    texcoord(3); vert(2); // UR tri
-			glEnd();
-		}
-
-	public:
-		Building(int height, int tex) : m_height(height), m_tex(tex+1) {
-			// uniform location to select texture
-			GLint m_tex_unif = glGetUniformLocation(shader_program, "tex_flag");
-
-			// geometry data
-			m_verts[0] = Point3D_t(-1, -1, 1);
-			m_verts[1] = Point3D_t( 1, -1, 1);
-			m_verts[2] = Point3D_t( 1,  1*m_height,  1);
-			m_verts[3] = Point3D_t(-1,  1*m_height,	 1);
-			m_verts[4] = Point3D_t(-1,  1*m_height, -1);
-			m_verts[5] = Point3D_t( 1,  1*m_height, -1);
-			m_verts[6] = Point3D_t(-1, -1, -1);
-			m_verts[7] = Point3D_t( 1, -1, -1);
-
-			m_texcoords[0] = Point2D_t(0, 0);
-			m_texcoords[1] = Point2D_t(1, 0);
-			m_texcoords[2] = Point2D_t(1, 1);
-			m_texcoords[3] = Point2D_t(0, 1);
-
-			//m_normals[0] = Point3D_t(-.577, 0, .577);
-			//m_normals[1] = Point3D_t(.577, 0, .577);
-			//m_normals[2] = Point3D_t(.577, .577, .577);
-			//m_normals[3] = Point3D_t(-.577, .577, .577);
-			//m_normals[4] = Point3D_t(-.577, .577, -.577);
-			//m_normals[5] = Point3D_t(.577, .577, -.577);
-			//m_normals[6] = Point3D_t(-.577,0 , -.577);
-			//m_normals[7] = Point3D_t(.577, 0, -.577);
-
-			m_normals[0] = Point3D_t(-1, 0,  1);
-			m_normals[1] = Point3D_t( 1, 0,  1);
-			m_normals[2] = Point3D_t( 1, 1,  1);
-			m_normals[3] = Point3D_t(-1, 1,  1);
-			m_normals[4] = Point3D_t(-1, 1, -1);
-			m_normals[5] = Point3D_t( 1, 1, -1);
-			m_normals[6] = Point3D_t(-1, 0, -1);
-			m_normals[7] = Point3D_t( 1, 0, -1);
-		}
-
-		void emit() {
-			// we need to emit exactly 36 verts for 12 tris for 6 faces for one rectangular prism.
-			m_tex_unif = glGetUniformLocation(shader_program, "tex_flag");
-
-			tex(m_tex); emit_front();
-			tex(m_tex); emit_back();
-			tex(m_tex); emit_left();
-			tex(m_tex); emit_right();
-			tex(m_tex+1); emit_up();
-			tex(m_tex+1); emit_down(); // can't see this texture anyways
-			//glUniform1f(m_tex_unif, 0);
-		}
-};
-
-class Car_Block {
-	private:
-		int m_height;
-		float color_r, color_g, color_b;
-		GLint m_tex_unif;
-
-		Point3D_t m_verts[8];
-		Point2D_t m_texcoords[4];
-		Point3D_t m_normals[8];
-
-		void vert(int n) {
-			Point3D_t normal = m_normals[n - 1];
-			Point3D_t vertex = m_verts[n - 1];
-			glNormal3f(normal.x, normal.y, normal.z);
-			glVertex3f(vertex.x, vertex.y, vertex.z);
-		}
-
-		void texcoord(int n) {
-			Point2D_t vertex = m_texcoords[n - 1];
-			glTexCoord2f(vertex.x, vertex.y);
-		}
-
-		void tex(int n) {
-			m_tex_unif = glGetUniformLocation(shader_program, "tex_flag");
-			glUniform1f(m_tex_unif, n);
-		}
-
-		// one private method per textured face (as we can't change texture in an FFP block). 6 faces here.
-
-		void emit_front() {
-			// front face
-			glBegin(GL_TRIANGLES);
-				glColor3d(color_r, color_g, color_b);
-				texcoord(4); vert(4);    texcoord(1); vert(1);    texcoord(2); vert(2); // LL tri
-				texcoord(4); vert(4);    texcoord(2); vert(2);    texcoord(3); vert(3); // UR tri
-			glEnd();
-		}
-
-		void emit_back() {
-			// back face
-			glBegin(GL_TRIANGLES);
-				glColor3d(color_r, color_g, color_b);
-				texcoord(4); vert(5);    texcoord(1); vert(7);    texcoord(2); vert(8); // LL tri
-				texcoord(4); vert(5);    texcoord(2); vert(8);    texcoord(3); vert(6); // UR tri
-			glEnd();			
-		}
-
-		void emit_left() {
-			// left face
-			glBegin(GL_TRIANGLES); 
-				glColor3d(color_r, color_g, color_b);
-				texcoord(4); vert(5);    texcoord(1); vert(7);    texcoord(2); vert(1); // LL tri
-				texcoord(4); vert(5);    texcoord(2); vert(1);    texcoord(3); vert(4); // UR tri
-			glEnd();
-		}
-
-		void emit_right() {
-			// right face
-			glBegin(GL_TRIANGLES);
-				glColor3d(color_r, color_g, color_b);
-				texcoord(4); vert(3);    texcoord(1); vert(2);    texcoord(2); vert(8); // LL tri
-				texcoord(4); vert(3);    texcoord(2); vert(8);    texcoord(3); vert(6); // UR tri
-			glEnd();
-		}
+// a vertex array over one MeshBuilder's worth of geometry
+typedef struct Geometry_struct {
+	GLuint vao, vbo, ibo;
+	GLsizei count; // indices
+} Geometry_t;
+
+void upload_geometry(MeshBuilder &mesh, Geometry_t &geometry);
+
+// DrawElementsIndirectCommand, also the DrawCommand struct in cull.glsl
+typedef struct DrawCommand_struct {
+	GLuint count, instance_count, first_index;
+	GLint base_vertex;
+	GLuint base_instance; // into the instance buffer, 0 is the untransformed white one
+} DrawCommand_t;
+
+typedef struct Bounds_struct {
+	float x, y, z, radius; // a vec4 in cull.glsl
+} Bounds_t;
+
+// a run of draw commands that all use one program
+typedef struct Batch_struct {
+	int variant; // TEX_*, which of programs
+	GLuint first, count; // commands
+} Batch_t;
+
+void add_command(MeshBuilder &mesh, uint32_t first_index);
+void sort_commands();
+void add_to_batch(vector<Batch_t> &batches, int variant, GLuint command);
 
-		void emit_up() {
-			// up face
-			glBegin(GL_TRIANGLES);
-				glColor3d(color_r, color_g, color_b);
-				texcoord(4); vert(5);    texcoord(1); vert(4);    texcoord(2); vert(3); // LL tri
-				texcoord(4); vert(5);    texcoord(2); vert(3);    texcoord(3); vert(6); // UR tri
-			glEnd();
-		}
-
-		void emit_down() {
-			// down face
-			glBegin(GL_TRIANGLES);
-				glColor3d(color_r, color_g, color_b);
-				texcoord(4); vert(1);    texcoord(1); vert(7);    texcoord(2); vert(8); // LL tri
-				texcoord(4); vert(1);    texcoord(2); vert(8);    texcoord(3); vert(2); // UR tri
-			glEnd();
-		}
-
-	public:
-		Car_Block(int height, float r, float g, float b) : m_height(height), color_r(r), color_g(g), color_b(b) {
-			// uniform location to select texture
-			GLint m_tex_unif = glGetUniformLocation(shader_program, "tex_flag");
-
-			// geometry data
-			m_verts[0] = Point3D_t(-1, -1, 1);
-			m_verts[1] = Point3D_t( 1, -1, 1);
-			m_verts[2] = Point3D_t( 1,  1*m_height,  1);
-			m_verts[3] = Point3D_t(-1,  1*m_height,	 1);
-			m_verts[4] = Point3D_t(-1,  1*m_height, -1);
-			m_verts[5] = Point3D_t( 1,  1*m_height, -1);
-			m_verts[6] = Point3D_t(-1, -1, -1);
-			m_verts[7] = Point3D_t( 1, -1, -1);
-
-			m_texcoords[0] = Point2D_t(0, 0);
-			m_texcoords[1] = Point2D_t(1, 0);
-			m_texcoords[2] = Point2D_t(1, 1);
-			m_texcoords[3] = Point2D_t(0, 1);
-
-			//m_normals[0] = Point3D_t(-.577, 0, .577);
-			//m_normals[1] = Point3D_t(.577, 0, .577);
-			//m_normals[2] = Point3D_t(.577, .577, .577);
-			//m_normals[3] = Point3D_t(-.577, .577, .577);
-			//m_normals[4] = Point3D_t(-.577, .577, -.577);
-			//m_normals[5] = Point3D_t(.577, .577, -.577);
-			//m_normals[6] = Point3D_t(-.577,0 , -.577);
-			//m_normals[7] = Point3D_t(.577, 0, -.577);
-
-			m_normals[0] = Point3D_t(-1, -1,  1);
-			m_normals[1] = Point3D_t( 1, -1,  1);
-			m_normals[2] = Point3D_t( 1, 1,  1);
-			m_normals[3] = Point3D_t(-1, 1,  1);
-			m_normals[4] = Point3D_t(-1, 1, -1);
-			m_normals[5] = Point3D_t( 1, 1, -1);
-			m_normals[6] = Point3D_t(-1, -1, -1);
-			m_normals[7] = Point3D_t( 1, -1, -1);
-		}
-
-		void emit() {
-			// we need to emit exactly 36 verts for 12 tris for 6 faces for one rectangular prism.
-			m_tex_unif = glGetUniformLocation(shader_program, "tex_flag");
-
-			tex(0); emit_front();
-			tex(0); emit_back();
-			tex(0); emit_left();
-			tex(0); emit_right();
-			tex(0); emit_up();
-			tex(0); emit_down(); // can't see this texture anyways
-			//glUniform1f(m_tex_unif, 0);
-		}
-};
-
-class Car {
-	private:
-		int m_color; // the color is 4. deal with it.
-		int m_heading; // RIGHT, LEFT, UP, or DOWN
-		float color_r, color_g, color_b;
-		double m_speed; // inverse of the number of frames to traverse one block
-		int m_ticks; // how many frames we are into the current movement
-
-		bool can_move() {
-			switch(m_heading) {
-				case RIGHT:
-					if(m_x_pos < 300 - 10 - 1)
-						return true;
-					break;
-				case LEFT:
-					if(m_x_pos > 0 + 10 + 1)
-						return true;
-					break;
-				case UP:
-					if (m_y_pos < 300 - 10 - 1)
-						return true;
-					break;
-				case DOWN:
-					if(m_y_pos > 0 + 10 + 1)
-						return true;
-					break;
-				case STOP:
-					return true;
-					break;
-			}
-			return false;
-		}
-
-	public:
-		double m_x_pos, m_y_pos; // center of the car
-
-		Car(int x_start, int y_start) : m_x_pos(x_start), m_y_pos(y_start) {
-			m_color = rand() % 6;
-			switch (m_color) {
-				case 0: // Red
-				color_r = 0.8; color_g = 0; color_b = 0; break;
-
-				case 1: // Green
-				color_r = 0; color_g = 0.8; color_b = 0; break;
-
-				case 2: // Blue
-				color_r = 0; color_g = 0; color_b = 0.8; break;
-
-				case 3: // Dark Grey
-				color_r = 0.4; color_g = 0.4; color_b = 0.4; break;
-
-				case 4: // White
-				color_r = 0.9; color_g = 0.9; color_b = 0.9; break;
-
-				case 5: // Yellow
-				color_r = 0.8; color_g = 0.8; color_b = 0; break;
-			}
-
-		}
-
-		int get_heading() {
-			return m_heading;
-		}
-
-		void start_movement(int heading, double speed) {
-			m_speed = speed;
-			m_ticks = 0;	
-			// Don't do U turns
-			if (heading == LEFT && m_heading == RIGHT) {
-			} else if (heading == RIGHT && m_heading == LEFT) {
-			} else if (heading == UP && m_heading == DOWN) {
-			} else if (heading == DOWN && m_heading == UP) {
-			} else { m_heading = heading; 
-			}
-		}
-
-		void tick() { // advance animation one frame
-			if (m_ticks == 1.0 / m_speed) {
-				do {
-					start_movement((rand() % 9) % 5, .01);
-				} while(!can_move());
-			}
-
-			m_ticks++;
-
-			// negate the correct terms for different directions
-			// we can move to true ipo easily if need be
-			switch(m_heading) {
-				case RIGHT:
-					m_x_pos += block_size * m_speed;
-					break;
-				case LEFT:
-					m_x_pos -= block_size * m_speed;
-					break;
-				case UP:
-					m_y_pos += block_size * m_speed;
-					break;
-				case DOWN:
-					m_y_pos -= block_size * m_speed;
-					break;
-				case STOP:
-					break;
-			}
-		}
-
-		bool is_stopped() {
-			return m_heading == STOP;
-		}
-		void drawYoSelf() {
-			
-			GLint tex_flag_unif = glGetUniformLocation(shader_program, "tex_flag"); // send the resolution to the shader
-			glUniform1f(tex_flag_unif, 0.0);	
-
-			glPushMatrix();
-			glTranslatef(m_x_pos, 0.0, -1 * m_y_pos);
-			if(m_heading == RIGHT || m_heading == LEFT)
-				glRotatef(90, 0, 1, 0);
-			car_block(1, color_r, color_g, color_b);
-
-			glPushMatrix();
-			glTranslatef(0, 2, 0);
-			car_block(1, color_r, color_g, color_b);
-			glPopMatrix();
-
-			glPushMatrix();
-			glTranslatef(0, 0, -2);
-			car_block(1, color_r, color_g, color_b);
-			glPopMatrix();
-
-			glPushMatrix();
-			glTranslatef(0, 0, 2);
-			car_block(1, color_r, color_g, color_b);
-			glPopMatrix();
-
-			/*glPushMatrix();
-			glTranslatef(0, 4, 0);
-			glRotatef(((m_ticks/m_speed)*360)*0.0174532925, 0, 1, 0);
-			car_block(1, color_r, color_g, color_b);
-			glPopMatrix();*/
-
-			glPopMatrix();
-		}
-};
-
-class RandomIterator {
-	private:
-		int m_state;
-		int m_size;
-		int m_range;
-		double *m_values;
-
-	public:
-		RandomIterator(int size, int range) : m_size(size), m_range(range), m_state(0) {
-			m_values = new double[m_size];
-			for (int i = 0; i < m_size; i++){
-				m_values[i] = rand() % m_range;
-			}
-		}
+BlockIterator *blocks = new BlockIterator(300, 300, block_size);
+RandomIterator *heights; // made in main() after the seed, then the cars
+TrafficConductor *car_controller; // made in main(), -cars <count> sets how many
+int car_count = 40;
+
+// gpu side of the scene. the city doesn't move, so it's baked into world space once,
+// one block after another so each block is a range of the index buffer with its own draw command.
+// the car mesh sits at the end of the same buffers and is drawn instanced by one more command.
+#define CULL_GROUP_SIZE 64 // local_size_x in cull.glsl
+#define INSTANCE_CHUNK 1024 // cars per job when filling the instance buffer
+#define CULL_CHUNK 256 // blocks per job when culling on the cpu
+Geometry_t city, ground_tiles;
+StreamBuffer car_instances; // each frame's instance 0 leaves the static blocks untransformed and untinted, the cars follow it
+const CarInstance_t identity_instance = { 0.0, 0.0, 0.0, 0.0, 1.0, 1.0, 1.0, 1.0 };
+JobPool jobs; // frame prep, the main thread only maps, unmaps and draws
+RenderQueue render_queue; // the main pass, ground and city, flushed once a frame
+RenderState render_state(bind_instances); // every program, vertex array, texture and instance binding during a frame
+vector<DrawCommand_t> city_commands; // static blocks, every instance_count is 1
+vector<Bounds_t> city_bounds; // one per command
+vector<int> city_variants; // one per command
+vector<Batch_t> city_batches; // city_commands then car_command, a batch per variant
+DrawCommand_t car_command;
+uint32_t shadow_first_index = 0; // the road markings before it are painted on and cast no shadow
+vector<DrawCommand_t> visible_commands; // cpu culling's output
+vector<Batch_t> visible_batches; // over visible_commands
+vector<float> visible_depths; // view depth of each visible command's bounds
+vector<uint8_t> block_visible; // per command, so the culling jobs don't share anything
+GLuint indirect_buffer; // what actually gets drawn, city_commands (culled) then car_command
+GLuint command_buffer, bounds_buffer, cull_program; // gpu culling only
+GLint cull_instance_base; // uniform in cull.glsl
+// both get turned off in setup_graphics() when the driver doesn't have them
+bool multi_draw = true; // glMultiDrawElementsIndirect, otherwise a draw per visible block
+bool gpu_culling = true; // cull.glsl writes the indirect buffer, otherwise the cpu does
+bool persistent_instances = true; // car instances in a persistently mapped ring, otherwise orphaned every frame
 
-		double next() {
-			return m_values[m_state++];
-		}
-		bool has_next() {
-			return (m_state < m_size) ? true : false;
-		}
-		void reset() {
-			m_state = 0;
-		}
-};
-
-class TrafficConductor {
-	private:
-		int m_car_number;
-	public:
-		vector<Car*> cars;
-		TrafficConductor(int car_number) : m_car_number(car_number) {
-			for (int i = 0; i < m_car_number; i++) {
-				cars.push_back(new Car( (rand() % 10)*30, (rand() % 10)*30));
-				//cars.push_back(new Car(30, 30));
-			}
-		}
+int main(int argc, char **argv) {
+	// init glut and let it eat the args it wants to
+    //time_t timer;
+	//srand(time(&timer));
+	glutInit(&argc, argv);
 
-		void start_cars() {
-			for(vector<Car*>::iterator car = cars.begin(); car != cars.end(); ++car) {
-				(*car)->start_movement(UP, .01);
+	// -capture <prefix> records bmps from the first frame, -y4m <file | -> records a video stream
+	// -no-indirect, -cpu-cull and -no-persistent force the fallback paths, for comparison, -no-shadows skips the shadow pass
+	// and -no-lights the streetlights and headlights. -no-shader-cache compiles the shaders every time
+	// -msaa <samples> sets the multisampling, -target-ms <ms> the gpu frame time the resolution scales to hold
+	// -seed <n> picks the city and traffic, -record <file> / -replay <file> see replay.h
+	// -path <file> flies a camera path, -bench <frames> reports frame times over that many frames
+	// -hour <h> is the time of day to start at, -day <seconds> how long a day lasts (0 stops the clock)
+	bool capture_now = false;
+	const char *record_file = NULL;
+	double hour = 15, day_seconds = 600;
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-no-indirect") == 0) {
+			multi_draw = gpu_culling = false;
+		} else if (strcmp(argv[i], "-cpu-cull") == 0) {
+			gpu_culling = false;
+		} else if (strcmp(argv[i], "-no-persistent") == 0) {
+			persistent_instances = false;
+		} else if (strcmp(argv[i], "-no-shadows") == 0) {
+			shadows_enabled = false;
+		} else if (strcmp(argv[i], "-no-lights") == 0) {
+			point_lights = false;
+		} else if (strcmp(argv[i], "-no-shader-cache") == 0) {
+			shader_cache = false;
+		} else if (strcmp(argv[i], "-msaa") == 0 && i + 1 < argc) {
+			msaa_samples = max(atoi(argv[++i]), 0);
+		} else if (strcmp(argv[i], "-target-ms") == 0 && i + 1 < argc) {
+			target_frame_ms = max(atof(argv[++i]), 0.0);
+		} else if (strcmp(argv[i], "-cars") == 0 && i + 1 < argc) {
+			car_count = max(atoi(argv[++i]), 1);
+		} else if (strcmp(argv[i], "-capture") == 0 && i + 1 < argc) {
+			capture_mode = CAPTURE_BMP;
+			capture_target = argv[++i];
+			capture_now = true;
+		} else if (strcmp(argv[i], "-y4m") == 0 && i + 1 < argc) {
+			capture_mode = CAPTURE_Y4M;
+			capture_target = argv[++i];
+			capture_now = true;
+		} else if (strcmp(argv[i], "-seed") == 0 && i + 1 < argc) {
+			seed = strtoul(argv[++i], NULL, 10);
+		} else if (strcmp(argv[i], "-record") == 0 && i + 1 < argc) {
+			record_file = argv[++i];
+		} else if (strcmp(argv[i], "-replay") == 0 && i + 1 < argc) {
+			if (!player.open(argv[++i])) {
+				cerr << "Could not read replay " << argv[i] << endl;
+				return 1;
 			}
-		}
-
-		void tick_cars() {
-			for(vector<Car*>::iterator car = cars.begin(); car != cars.end(); ++car) {
-				(*car)->tick();
+			replaying = true;
+		} else if (strcmp(argv[i], "-path") == 0 && i + 1 < argc) {
+			if (!camera_path.load(argv[++i])) {
+				cerr << "Could not read camera path " << argv[i] << endl;
+				return 1;
 			}
+		} else if (strcmp(argv[i], "-hour") == 0 && i + 1 < argc) {
+			hour = atof(argv[++i]);
+		} else if (strcmp(argv[i], "-day") == 0 && i + 1 < argc) {
+			day_seconds = max(atof(argv[++i]), 0.0);
+		} else if (strcmp(argv[i], "-bench") == 0 && i + 1 < argc) {
+			bench_frames = max(atoi(argv[++i]), 1);
+			bench_stats.reserve(bench_frames);
 		}
+	}
 
-		void draw_cars() {
-			for(vector<Car*>::iterator car = cars.begin(); car != cars.end(); ++car) {
-				(*car)->drawYoSelf();
-			}
-		}
-};
+	// a replay starts from the same place the recording did
+	if (replaying) {
+		const ReplayHeader_t &header = player.header();
+		seed = header.seed;
+		car_count = header.cars;
+		viewport_width = header.width;
+		viewport_height = header.height;
+		record_file = NULL;
+	}
+	if (record_file != NULL) {
+		ReplayHeader_t header = { REPLAY_VERSION, seed, (uint32_t) car_count, (uint32_t) viewport_width, (uint32_t) viewport_height };
+		if (!recorder.open(record_file, header)) cerr << "Could not write replay " << record_file << endl;
+	}
 
-BlockIterator *blocks = new BlockIterator(300, 300, block_size);
-RandomIterator *heights = new RandomIterator(100, 5);
-TrafficConductor *car_controller = new TrafficConductor(40);
+	// the heights and then the cars, in that order, are all the random numbers there are
+	sim_seed(seed);
+	heights = new RandomIterator(100, 5);
+	time_of_day.set(hour, day_seconds);
 
-int main(int argc, char **argv) {
-	// init glut and let it eat the args it wants to
-    //time_t timer;
-	//srand(time(&timer));
-	glutInit(&argc, argv);
+	// before setup_graphics, the instance buffer is sized for the cars
+	car_controller = new TrafficConductor(car_count);
 
 	if(setup_graphics() != true) {
-		cout << "Exiting with errors." << endl;
+		cerr << "Exiting with errors." << endl;
 		return 1;
 	}
 
+	if (capture_now) capture.start(capture_mode, capture_target);
+	if (bench_frames > 0) glGenQueries(STATS_QUERIES, primitive_queries);
+
 	car_controller->start_cars();
+	last_frame_ms = replay_start_ms = glutGet(GLUT_ELAPSED_TIME);
 
 	// good to go! enter main loop
 	glutMainLoop();
@@ -631,65 +392,67 @@ int main(int argc, char **argv) {
 
 
 ////////////////////////////////////////////// some OGL utility functions
-string get_contents(const char* filename) {
-	// stream to string conversion nabbed from stack overflow
-	ifstream fh(filename);
-	string str((istreambuf_iterator<char>(fh)), istreambuf_iterator<char>());
-	return str;
-}
-
-GLint setup_shader(const char* filename, GLenum kind) {
-	GLint shader = glCreateShader(kind);
-	string source = get_contents(filename);
+GLuint load_texture(const char* filename) {
+	GLuint tex;
 
-	// ugly, have to figure out the proper cast
-	const char *wrap[1];
-	wrap[0] = source.c_str();
+	// prefer the precompressed cache made by texconv (make textures), it's just a memcpy to the driver
+	if (load_ktx_texture(ktx_name(filename).c_str(), tex)) return tex;
 
-	// try to compile shader
-	glShaderSource(shader, 1, wrap, NULL); // 1, NULL means take a 1-length array of cstrings
-	glCompileShader(shader);
+	CBitmap image(filename);
+	glGenTextures(1, &tex);
+	glBindTexture(GL_TEXTURE_2D, tex);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, image.GetWidth(), image.GetHeight(), 0, GL_RGBA, GL_UNSIGNED_BYTE, image.GetBits());
 
-	// check if it worked
-	GLint status;
-	glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 
-	if(status != GL_TRUE) {
-		// shader error. print it and return with failure.
-		GLchar error_log[1024]; // hopefully long enough
-		GLsizei length; // of the copied message
 
-		glGetShaderInfoLog(shader, 1024, &length, error_log); // copy error to error_log
-		cout << "Shader did not compile correctly." << endl;
-		cout << error_log << endl;
+	return tex;
+}
 
-		return -1;
-	}
+bool load_ktx_texture(const char* filename, GLuint &tex) {
+	KtxImage image;
+	if (!image.load(filename)) return false;
 
-	// success!
-	return shader;
-}
+	#ifndef __APPLE__
+	// no s3tc means no point in the compressed cache, fall back to the bitmap
+	if (image.is_compressed() && !GLEW_EXT_texture_compression_s3tc) return false;
+	#endif
 
-GLuint load_texture(const char* filename) {
-	CBitmap image(filename);
-	GLuint tex;
 	glGenTextures(1, &tex);
 	glBindTexture(GL_TEXTURE_2D, tex);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, image.GetWidth(), image.GetHeight(), 0, GL_RGBA, GL_UNSIGNED_BYTE, image.GetBits());
 
+	for (unsigned int i = 0; i < image.levels.size(); i++) {
+		KtxLevel_t &level = image.levels[i];
+		if (image.is_compressed()) {
+			glCompressedTexImage2D(GL_TEXTURE_2D, i, image.header.gl_internal_format, level.width, level.height, 0, level.size, level.data);
+		} else {
+			glTexImage2D(GL_TEXTURE_2D, i, image.header.gl_internal_format, level.width, level.height, 0, image.header.gl_format, image.header.gl_type, level.data);
+		}
+	}
+
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, image.levels.size() - 1);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, image.levels.size() > 1 ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 
-
-	return tex;
+	return true;
 }
 
 bool setup_graphics() {
 	// start by setting up glut
 	glutInitWindowSize(viewport_width, viewport_height);
+	#ifdef __APPLE__
+	glutInitDisplayMode(GLUT_3_2_CORE_PROFILE | GLUT_DOUBLE | GLUT_RGB | GLUT_DEPTH);
+	#else
     glutInitDisplayMode(GLUT_DOUBLE | GLUT_RGB | GLUT_DEPTH); // forgetting GLUT_DEPTH earned me a segfault!
+	// core profile, no matrix stack or immediate mode to pay for
+	glutInitContextVersion(3, 3);
+	glutInitContextProfile(GLUT_CORE_PROFILE);
+	#endif
 
    	 // make our window
   	glutCreateWindow("Tiny Town");
@@ -705,51 +468,49 @@ bool setup_graphics() {
 	glutSpecialFunc(keyboard_special_handler);
 
 	#ifndef __APPLE__
-	glewInit();
+	glewExperimental = GL_TRUE; // otherwise glew only looks for core entry points in the extension string
+	if (glewInit() != GLEW_OK) {
+		cerr << "Could not initialize GLEW." << endl;
+		return false;
+	}
+	glGetError(); // glewInit trips a GL_INVALID_ENUM on core contexts, don't let it linger
+
+	// gpu driven submission is 4.3, anything older draws the blocks one by one
+	multi_draw = multi_draw && (GLEW_VERSION_4_3 || (GLEW_ARB_multi_draw_indirect && GLEW_ARB_base_instance));
+	gpu_culling = gpu_culling && multi_draw && (GLEW_VERSION_4_3 || (GLEW_ARB_compute_shader && GLEW_ARB_shader_storage_buffer_object));
+	persistent_instances = persistent_instances && (GLEW_VERSION_4_4 || GLEW_ARB_buffer_storage);
+	#else
+	multi_draw = gpu_culling = persistent_instances = false;
 	#endif
 	
-	// now we can set up our shaders
-	shader_program = glCreateProgram(); // holds collection of shaders
-	GLint arrow_frag_shader = setup_shader("frag.glsl", GL_FRAGMENT_SHADER);
-	GLint arrow_vert_shader = setup_shader("vert.glsl", GL_VERTEX_SHADER);
-
-	// check shader compiled okay
-	if(arrow_frag_shader == -1 || arrow_vert_shader == -1) {
-		cout << "Aborting due to shader compilation error." << endl;
-		return false; // exit with error
-	}
-
-	// attach the shader to the program, then link and activate it.
-	glAttachShader(shader_program, arrow_frag_shader);
-	glAttachShader(shader_program, arrow_vert_shader);
-
-	glLinkProgram(shader_program);
-
-	// make sure it linked
-	GLint status;
-	glGetProgramiv(shader_program, GL_LINK_STATUS, &status);
-
-	if(status == GL_FALSE) {
-		// link error. print and die.
-		GLchar error_log[1024];
-		GLsizei length;
-		glGetProgramInfoLog(shader_program, 1024, &length, error_log);
-		cout << "Link error." << endl;
-		cout << error_log << endl;
-		cout << "Aborting due to link error." << endl;
-		return false;
+	// now we can set up our shaders, out of the binary cache when nothing's changed since last time
+	shader_library.setup(shader_cache, true);
+	const ShaderStage_t stages[2] = { { "vert.glsl", GL_VERTEX_SHADER }, { "frag.glsl", GL_FRAGMENT_SHADER } };
+	for (int v = 0; v < SHADER_VARIANTS; v++) {
+		main_shaders[v] = shader_library.load(stages, 2, string("#define ") + variant_defines[v] + "\n");
+		if (main_shaders[v] == -1) {
+			cerr << "Aborting due to shader compilation error." << endl;
+			return false; // exit with error
+		}
 	}
 
 	// Load textures
 	setup_textures();
+	setup_basemap("basemap.bmp");
+	setup_geometry();
+	if (gpu_culling && !setup_culling()) {
+		cerr << "Culling on the cpu instead." << endl;
+		gpu_culling = false;
+	}
+	if (shadows_enabled && !setup_shadows()) {
+		cerr << "No shadows." << endl;
+		shadows_enabled = false;
+	}
+	setup_lights();
+	setup_programs();
+	if (!scene_target.setup(msaa_samples, target_frame_ms, viewport_width, viewport_height)) cerr << "Drawing straight to the window." << endl;
 	// Initialize Camera
 	setup_camera();
-	sun_unif = glGetUniformLocation(shader_program, "sun_pos"); // send the resolution to the shader
-
-
-	
-	// PHEW! All ready to go! Push the button.
-	glUseProgram(shader_program);
 	
 	setup_viewport();
 
@@ -757,40 +518,151 @@ bool setup_graphics() {
 }
 
 void setup_camera() {
-	eyeX = 50.0; eyeY = 150.00; eyeZ = 100.0;
-    upX  = 0.0; upY  = 1.0;  upZ  = 0.0;
-    viewAngX = 20.0; viewAngY = -35.0;
-	updateView();
+	camera.place(Vec3_t(50.0, 150.0, 100.0), 20.0, -35.0);
+	if (!camera_path.empty()) camera.toggle(CAMERA_PATH);
 }
 
 void setup_textures() {
-	glEnable(GL_TEXTURE_2D);
+	// every facade lives in one atlas, so buildings never switch samplers
 	glActiveTexture(GL_TEXTURE0);
-	textures[0] = load_texture("tex0.bmp");
-	glBindSampler(GL_TEXTURE0, textures[0]);
 
+	bool prebuilt = atlas.load("atlas.txt");
+	for (int i = 0; i < 6 && prebuilt; i++) {
+		facade_rects[i] = atlas.find(facade_files[i]);
+		if (facade_rects[i] < 0) prebuilt = false;
+	}
+
+	if (prebuilt) {
+		atlas_texture = load_texture("atlas.bmp");
+		// the gutter only covers the first few mips, don't sample past them
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 3);
+	} else {
+		// no 'make atlas' output around, pack it ourselves
+		atlas_texture = build_atlas_texture();
+		for (int i = 0; i < 6; i++) facade_rects[i] = i;
+	}
+}
+
+GLuint build_atlas_texture() {
+	vector<CBitmap*> images;
+	vector<string> names;
+	for (int i = 0; i < 6; i++) {
+		images.push_back(new CBitmap(facade_files[i]));
+		names.push_back(facade_files[i]);
+	}
+
+	vector<RGBA> texels;
+	atlas.build(images, names, texels);
+
+	GLuint tex;
+	glGenTextures(1, &tex);
+	glBindTexture(GL_TEXTURE_2D, tex);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, atlas.width, atlas.height, 0, GL_RGBA, GL_UNSIGNED_BYTE, &texels[0]);
+
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+
+	for (int i = 0; i < 6; i++) delete images[i];
+	return tex;
+}
+
+void setup_basemap(const char* filename) {
+	// streams the image in BASEMAP_BLOCK_ROWS sized bands straight into the tile textures,
+	// so satellite sized images never have to fit in memory all at once
+	CBitmapReader reader;
+	if (!reader.Open(filename)) return; // optional
+
+	GLint max_size;
+	glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_size);
+
+	basemap.width = reader.GetWidth();
+	basemap.height = reader.GetHeight();
+	basemap.top_down = reader.IsTopDown();
+	basemap.tile_size = max_size < 1024 ? max_size : 1024;
+	basemap.tiles_x = (basemap.width + basemap.tile_size - 1) / basemap.tile_size;
+	basemap.tiles_y = (basemap.height + basemap.tile_size - 1) / basemap.tile_size;
+	basemap.tiles.resize(basemap.tiles_x * basemap.tiles_y);
+
+	// basemap lives on unit 1, leave the atlas bound on 0
 	glActiveTexture(GL_TEXTURE1);
-	textures[1] = load_texture("tex1.bmp");
-	glBindSampler(GL_TEXTURE1, textures[1]);
+	glGenTextures(basemap.tiles.size(), &basemap.tiles[0]);
+	for (unsigned int ty = 0; ty < basemap.tiles_y; ty++) {
+		for (unsigned int tx = 0; tx < basemap.tiles_x; tx++) {
+			unsigned int w = min(basemap.tile_size, basemap.width - tx * basemap.tile_size);
+			unsigned int h = min(basemap.tile_size, basemap.height - ty * basemap.tile_size);
+			glBindTexture(GL_TEXTURE_2D, basemap.tiles[ty * basemap.tiles_x + tx]);
+			glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, w, h, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		}
+	}
 
-	glActiveTexture(GL_TEXTURE2);
-	textures[2] = load_texture("tex2.bmp");
-	glBindSampler(GL_TEXTURE2, textures[2]);
+	RGBA *rows = new RGBA[basemap.width * BASEMAP_BLOCK_ROWS];
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, basemap.width);
+	bool ok = reader.Decode(rows, BASEMAP_BLOCK_ROWS, upload_basemap_rows, &basemap);
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+	glPixelStorei(GL_UNPACK_SKIP_PIXELS, 0);
+	glPixelStorei(GL_UNPACK_SKIP_ROWS, 0);
+	delete [] rows;
+
+	if (!ok) cerr << "Base map " << filename << " is truncated." << endl;
+
+	// one quad per tile, stretched over the same area as the plain ground, bottom of the image towards +z
+	MeshBuilder mesh;
+	mesh.tex(TEX_BASEMAP);
+	for (unsigned int ty = 0; ty < basemap.tiles_y; ty++) {
+		for (unsigned int tx = 0; tx < basemap.tiles_x; tx++) {
+			float x0 = -5.0 + 310.0 * (tx * basemap.tile_size) / basemap.width;
+			float x1 = -5.0 + 310.0 * min((tx + 1) * basemap.tile_size, basemap.width) / basemap.width;
+			float z0 = 5.0 - 310.0 * (ty * basemap.tile_size) / basemap.height;
+			float z1 = 5.0 - 310.0 * min((ty + 1) * basemap.tile_size, basemap.height) / basemap.height;
+
+			mesh.normal(0.0, 1.0, 0.0);
+			uint32_t a, b, c, d;
+			mesh.texcoord(0, 1); a = mesh.vertex(x0, 0.0, z1);
+			mesh.texcoord(0, 0); b = mesh.vertex(x0, 0.0, z0);
+			mesh.texcoord(1, 0); c = mesh.vertex(x1, 0.0, z0);
+			mesh.texcoord(1, 1); d = mesh.vertex(x1, 0.0, z1);
+			mesh.quad(a, b, c, d);
+		}
+	}
+	upload_geometry(mesh, ground_tiles);
 
-	glActiveTexture(GL_TEXTURE3);
-	textures[3] = load_texture("tex3.bmp");
-	glBindSampler(GL_TEXTURE3, textures[3]);
+	glActiveTexture(GL_TEXTURE0);
+}
 
-	glActiveTexture(GL_TEXTURE4);
-	textures[4] = load_texture("tex4.bmp");
-	glBindSampler(GL_TEXTURE4, textures[4]);
+bool upload_basemap_rows(RGBA *rows, unsigned int first_row, unsigned int row_count, void *user) {
+	Basemap_t *map = (Basemap_t*) user;
 
-	glActiveTexture(GL_TEXTURE5);
-	textures[5] = load_texture("tex5.bmp");
-	glBindSampler(GL_TEXTURE5, textures[5]);
+	// GL wants bottom up. top down files come in reversed, flip the band in place.
+	unsigned int row = first_row;
+	if (map->top_down) {
+		for (unsigned int i = 0; i < row_count / 2; i++) {
+			swap_ranges(rows + i * map->width, rows + (i + 1) * map->width, rows + (row_count - 1 - i) * map->width);
+		}
+		row = map->height - first_row - row_count;
+	}
 
-	GLint tex_unif = glGetUniformLocation(shader_program, "textures"); // send the resolution to the shader
-	glUniform1iv(tex_unif, 6, (const GLint*) textures);
+	// a band can straddle a row of tiles
+	unsigned int done = 0;
+	while (done < row_count) {
+		unsigned int ty = (row + done) / map->tile_size;
+		unsigned int tile_row = (row + done) - ty * map->tile_size;
+		unsigned int count = min(row_count - done, map->tile_size - tile_row);
+
+		glPixelStorei(GL_UNPACK_SKIP_ROWS, done);
+		for (unsigned int tx = 0; tx < map->tiles_x; tx++) {
+			unsigned int w = min(map->tile_size, map->width - tx * map->tile_size);
+			glPixelStorei(GL_UNPACK_SKIP_PIXELS, tx * map->tile_size);
+			glBindTexture(GL_TEXTURE_2D, map->tiles[ty * map->tiles_x + tx]);
+			glTexSubImage2D(GL_TEXTURE_2D, 0, 0, tile_row, w, count, GL_RGBA, GL_UNSIGNED_BYTE, rows);
+		}
+		done += count;
+	}
+	return true;
 }
 
 void setup_viewport() {
@@ -800,180 +672,94 @@ void setup_viewport() {
 	// set some default colors - we should never see them, but if we do we know something's wrong
 	//glClearColor(1, 1, 1, 1.0);
 	glClearColor(0.52, 0.8, 0.92, 1.0);
-	glColor3d(0, 0, 0);
-
-	// feed it a projection
-	glMatrixMode(GL_PROJECTION);
-	glLoadIdentity();
-	gluPerspective(75, viewport_width/viewport_height, .1, 1000);
-	//gluOrtho2D(0, viewport_width, 0, viewport_height); // this is fine because I deal with the projection later!
 
-	// and set it back to normal
-	glMatrixMode(GL_MODELVIEW);
+	// feed it a projection (goes out with the rest of the frame uniforms)
+	projection_matrix = mat4_perspective(75, (float) viewport_width / viewport_height, .1, 1000);
+	shadows.set_projection(75, (float) viewport_width / viewport_height, .1);
+	clusters.set_projection(projection_matrix);
 
 	// not managing the depth buffer has led to lots of segfaults.
 	// at least I think that's why.
 	glEnable(GL_DEPTH_TEST);
-	glEnable(GL_NORMALIZE);
 
 
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-
-	// fill uniforms - size, scale, and time elapsed in millis
-	GLint size_unif = glGetUniformLocation(shader_program, "size"); // send the resolution to the shader
-	glUniform2f(size_unif, viewport_width, viewport_height);
 }
 
 ////////////////////////////////////////////// OGL handlers
 void reshape_handler(GLint new_x, GLint new_y) {
+	// a replay resizes when the recording did, not when the window system says
+	if (replaying) return;
+	recorder.reshape(new_x, new_y);
+	resize(new_x, new_y);
+}
+
+void resize(int width, int height) {
 	// keep state globals in sync
-	viewport_width = new_x;
-	viewport_height = new_y;
+	viewport_width = width;
+	viewport_height = height;
 
 	// unsure as to exactly how much I have to do here.
 	glViewport(0, 0, viewport_width, viewport_height);
+	projection_matrix = mat4_perspective(75, (float) viewport_width / viewport_height, .1, 1000);
+	shadows.set_projection(75, (float) viewport_width / viewport_height, .1);
+	clusters.set_projection(projection_matrix);
+	scene_target.resize(viewport_width, viewport_height);
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT); // not managing the depth buffer has led to lots of segfaults.
-
-	// update uniforms that changed
-	GLint size_unif = glGetUniformLocation(shader_program, "size"); // send the resolution to the shader
-	glUniform2f(size_unif, viewport_width, viewport_height);
 }
 
 void display_handler() {
-	glUniform3f(sun_unif, 0.0, 1.0, 1.0);
-	if (spins_pause) frame++;
-
-	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-
-	glLoadIdentity();
-
-	
-	if (spins) gluLookAt(300*cos(frame/150.0)+150, 150, 300*sin(frame/150.0)-150, 150, 0, -150, 0, 1, 0);
-	else if (follow_car) track_car();
-	else gluLookAt(eyeX, eyeY, eyeZ, tarX, tarY, tarZ, upX, upY, upZ);
-
-	glUniform3f(sun_unif, 0.0, 1.0, 1.0);
-	GLint tex_flag_unif = glGetUniformLocation(shader_program, "tex_flag"); // send the resolution to the shader
-	glUniform1f(tex_flag_unif, 0.0);
-
-	glColor3d(0.2, 0.2, 0.2);
-	glBegin(GL_QUADS);
-		glNormal3f(0.0, 1.0, 0.0);
-		glVertex3f(-5.0, 0.0, -305.0);
-
-		glNormal3f(0.0, 1.0, 0.0);
-		glVertex3f(-5.0, 0.0, 5.0);
-
-		glNormal3f(0.0, 1.0, 0.0);
-		glVertex3f(305.0, 0.0, 5.0);
-
-		glNormal3f(0.0, 1.0, 0.0);
-		glVertex3f(305.0, 0.0, -305.0);
-	glEnd();
-
-	glUniform1f(tex_flag_unif, 0.0);
-
-	// Draw asphalt around buildings
-	blocks->reset();
-	while(blocks->has_next()) {
-		Point2D_t p = blocks->next();
-		glColor3d(0.5, 0.5, 0.5);
-		glBegin(GL_TRIANGLE_STRIP);
-			glVertex3f(p.x+5,  0.1, -1*p.y-25); 
-			glVertex3f(p.x+5,  0.1, -1*p.y-5); 
-			glVertex3f(p.x+25, 0.1, -1*p.y-25); 
-			glVertex3f(p.x+25, 0.1, -1*p.y-5); 
-		glEnd();
+	// the input for this frame comes from the file when replaying, and goes into it when recording
+	int now = glutGet(GLUT_ELAPSED_TIME);
+	if (replaying) {
+		if (!play_frame_events()) quit(); // that was the last frame
+		replay_frames++;
+	} else {
+		int ms = bench_frames > 0 ? BENCH_FRAME_MS : now - last_frame_ms;
+		recorder.frame(ms);
+		scene_ms += ms;
 	}
+	last_frame_ms = now;
+	if (bench_frames > 0) bench_frame_start();
 
-	// Draw street lines
-	blocks->reset();
-	while(blocks->has_next()) {
-		Point2D_t p = blocks->next();
-		glColor3d(0.9, 0.9, 0.0);
-		glBegin(GL_TRIANGLES);
-			// Draw street lines along x axis
-			for (int i = 2; i < block_size+2; i+=6) {
-				glVertex3f(p.x+i,   0.1, -1*p.y-30);    glVertex3f(p.x+i,   0.1, -1*p.y-29.75); 
-				glVertex3f(p.x+i+2, 0.1, -1*p.y-30);    glVertex3f(p.x+i+2, 0.1, -1*p.y-30); 
-				glVertex3f(p.x+i,   0.1, -1*p.y-29.75); glVertex3f(p.x+i+2, 0.1, -1*p.y-29.75); 
-
-				glVertex3f(p.x+i,   0.1, -1*p.y);      glVertex3f(p.x+i,   0.1, -1*p.y-0.25); 
-				glVertex3f(p.x+i+2, 0.1, -1*p.y);      glVertex3f(p.x+i+2, 0.1, -1*p.y); 
-				glVertex3f(p.x+i,   0.1, -1*p.y-0.25); glVertex3f(p.x+i+2, 0.1, -1*p.y-0.25); 
-
-			}
-			// Draw street lines along y axis
-			for (int i = 2; i < block_size+2; i+=6) {
-				glVertex3f(p.x,      0.1, -1*p.y-i);   glVertex3f(p.x+0.25, 0.1, -1*p.y-i); 
-				glVertex3f(p.x,      0.1, -1*p.y-i-2); glVertex3f(p.x,      0.1, -1*p.y-i-2);
-				glVertex3f(p.x+0.25, 0.1, -1*p.y-i);   glVertex3f(p.x+0.25, 0.1, -1*p.y-i-2);
-
-				glVertex3f(p.x+30,    0.1, -1*p.y-i);   glVertex3f(p.x+29.75, 0.1, -1*p.y-i); 
-				glVertex3f(p.x+30,    0.1, -1*p.y-i-2); glVertex3f(p.x+30,    0.1, -1*p.y-i-2);
-				glVertex3f(p.x+29.75, 0.1, -1*p.y-i);   glVertex3f(p.x+29.75, 0.1, -1*p.y-i-2);
-			}
-		glEnd();
-	}
+	// a saved shader goes in before the frame that uses it
+	if (shader_library.poll()) setup_programs();
 
-	glUniform1f(tex_flag_unif, 0.0);
-	// Draw buildings
-	int tex = 0;
-	heights->reset();
-	blocks->reset();
-	while(blocks->has_next()) {
-		Point2D_t p = blocks->next();
-		glPushMatrix();
-			int sf = heights->next();
-			if (sf * 10 > 10) {
-				// block_size / 2 moves the building to the center of the block
-				glTranslatef(p.x + block_size / 2, 2.0, -1 * p.y - block_size / 2);
-				glScalef(5.0, 1.0, 5.0); // expand the footprint
-				building(10.0 * sf, tex % 3);
-				tex++;
-			} else {
-				// If no building draw grass
-				glUniform1f(tex_flag_unif, 0.0);
-				glColor3d(0.2, 0.6, 0.2);
-				glBegin(GL_TRIANGLE_STRIP);
-					glNormal3f(0.0, 1.0, 0.0);
-					glVertex3f(p.x+7,  0.16, -1*p.y-23); 
-					glNormal3f(0.0, 1.0, 0.0);
-					glVertex3f(p.x+7,  0.16, -1*p.y-7); 
-					glNormal3f(0.0, 1.0, 0.0);
-					glVertex3f(p.x+23, 0.16, -1*p.y-23); 
-					glNormal3f(0.0, 1.0, 0.0);
-					glVertex3f(p.x+23, 0.16, -1*p.y-7); 
-				glEnd();
-				glUniform1f(tex_flag_unif, 0.0);
-
-			//if(abs(p.x*p.x + p.x/p.y + p.y*p.y) < 70000) {
-					glPushMatrix();
-					glTranslatef(p.x + block_size / 2, 15, -1 * p.y - block_size / 2);
-					glutSolidSphere(10, 5, 5);
-					glPopMatrix();
-					
-					glPushMatrix();
-					glColor3f(.6, .3, 0);
-					glScalef(1, 15.0/2, 1);
-					glTranslatef(p.x + block_size / 2, 1.01, -1 * p.y - block_size / 2);
-					glRotatef(90, 1, 0, 0);
-					glutSolidTorus(1, 1.2, 6, 6);
-					glPopMatrix();
-				//}
-			}
-		glPopMatrix();
-	}
+	if (spins_pause) frame++;
 
-	glUniform1f(tex_flag_unif, 0.0);
-	car_controller->draw_cars();
+	scene_target.begin();
+
+	// the free camera only changes on input, the rest move every frame
+	if (camera.mode() == CAMERA_PATH) {
+		Vec3_t eye, target;
+		camera_path.sample(scene_ms / 1000.0, eye, target);
+		camera.look_at(eye, target);
+	} else if (camera.mode() == CAMERA_SPIN) camera.spin(frame);
+	else if (camera.mode() == CAMERA_CHASE) camera.chase(*car_controller->cars[camera.car()]);
+	view_matrix = camera.state().view;
+
+	// the sun, the sky and the lit windows only move every few game minutes
+	if (time_of_day.update(scene_ms / 1000.0)) update_lighting();
+	update_frame_uniforms();
+
+	// the cars go into the shadows before anything samples them
+	GLuint instance_base = fill_car_instances();
+	if (point_lights && time_of_day.night() > 0) update_lights();
+	draw_shadows(instance_base);
+	draw_ground();
+	submit_city(instance_base);
+	frame_draws += render_queue.flush(render_state);
+	car_instances.fence();
+	scene_target.end();
 	car_controller->tick_cars();
+	if (bench_frames > 0) bench_frame_end();
 
+	capture.grab(viewport_width, viewport_height);
 	glutSwapBuffers();
 }
 
 void mouse_handler(GLint button, GLint state, GLint pos_x, GLint pos_y) {
-	if (follow_car) {
+	if (camera.mode() == CAMERA_CHASE) {
 		//look_x = (double) pos_x/viewport_width;
 		//look_y = (double) pos_y/viewport_height;	
 	}
@@ -982,46 +768,139 @@ void mouse_handler(GLint button, GLint state, GLint pos_x, GLint pos_y) {
 }
 
 void keyboard_handler(unsigned char key, GLint pos_x, GLint pos_y) {
+	// the replay is driving, the only key that still works is quit
+	if (replaying && key != 'q') return;
+	if (!replaying) recorder.key(key);
+	handle_key(key);
+
+	// and request an update right away so it's responsive.
+	glutPostRedisplay();
+}
+
+void handle_key(unsigned char key) {
 	// read in our curves
 	switch(key) {
-		case 'q': exit(0); break;
+		case 'q': quit(); break;
 
-        case 'w': move(4); break; // forward
-        case 's': move(5); break; // back
-        case 'a': move(2); break; // left
-        case 'd': move(3); break; // right
+        case 'w': camera.move(4); break; // forward
+        case 's': camera.move(5); break; // back
+        case 'a': camera.move(2); break; // left
+        case 'd': camera.move(3); break; // right
 
-        case 'r': move(0); break; // up
-        case 'f': move(1); break; // down
+        case 'r': camera.move(0); break; // up
+        case 'f': camera.move(1); break; // down
 
-        case 'i': look(0); break; // look up
-        case 'k': look(1); break; // look down
-        case 'j': look(2); break; // look left
-        case 'l': look(3); break; // look right
+        case 'i': camera.look(0); break; // look up
+        case 'k': camera.look(1); break; // look down
+        case 'j': camera.look(2); break; // look left
+        case 'l': camera.look(3); break; // look right
 
-        case '1': spins = !spins; follow_car = false; break; // look right
+        case '1': camera.toggle(CAMERA_SPIN); break; // spin around the city
         case '2': spins_pause = !spins_pause; break; // look right
-		case '3': follow_car = !follow_car; spins = false; break;
+		case '3': camera.toggle(CAMERA_CHASE); break; // chase a car
+		case 't': time_of_day.skip(1); break; // an hour later
+		case '[': camera.select_car(-1, car_controller->cars.size()); break; // chase the previous car
+		case ']': camera.select_car(1, car_controller->cars.size()); break; // chase the next car
+
+		case 'c': // start / stop recording
+			if (capture.active()) capture.stop();
+			else capture.start(capture_mode, capture_target);
+			break;
 
 		default:
 			break;
 	}
-	
+}
+
+void keyboard_special_handler(int key, GLint pos_x, GLint pos_y) {
+	if (replaying) return;
+	recorder.special(key);
+	handle_special(key);
+
 	// and request an update right away so it's responsive.
 	glutPostRedisplay();
 }
 
-void keyboard_special_handler(int key, GLint pos_x, GLint pos_y) {
+void handle_special(int key) {
 	switch(key) {
-		case GLUT_KEY_UP: look(0); break;
-		case GLUT_KEY_DOWN: look(1); break;
-		case GLUT_KEY_LEFT: look(2); break;
-		case GLUT_KEY_RIGHT: look(3); break;
+		case GLUT_KEY_UP: camera.look(0); break;
+		case GLUT_KEY_DOWN: camera.look(1); break;
+		case GLUT_KEY_LEFT: camera.look(2); break;
+		case GLUT_KEY_RIGHT: camera.look(3); break;
 		default: break;
 	}
-	
-	// and request an update right away so it's responsive.
-	glutPostRedisplay();
+}
+
+// applies the recorded input up to the end of the next frame, false when there are no frames left
+bool play_frame_events() {
+	ReplayEvent_t event;
+	while (player.next(event)) {
+		switch (event.type) {
+			case REPLAY_KEY: handle_key(event.a); break;
+			case REPLAY_SPECIAL: handle_special(event.a); break;
+			case REPLAY_RESHAPE:
+				glutReshapeWindow(event.a, event.b);
+				resize(event.a, event.b);
+				break;
+			case REPLAY_FRAME:
+				scene_ms += event.a;
+				return true;
+		}
+	}
+	return false;
+}
+
+// times from one frame's start to the next, counts from the frame's own draws
+void bench_frame_start() {
+	chrono::steady_clock::time_point now = chrono::steady_clock::now();
+	if (bench_frame > 0) bench_pending[(bench_frame - 1) % STATS_QUERIES].ms = chrono::duration<double, milli>(now - bench_last).count();
+	bench_last = now;
+
+	if (bench_frame == bench_frames) {
+		// the last few frames' queries are still out, wait for them
+		for (unsigned int f = bench_frames > STATS_QUERIES ? bench_frames - STATS_QUERIES : 0; f < bench_frames; f++) bench_collect(f % STATS_QUERIES);
+		cerr << "benchmark: ";
+		bench_stats.report(cerr);
+		if (shadows_enabled) cerr << "static shadow passes: " << shadows.static_passes() << endl;
+		if (target_frame_ms > 0) cerr << "render scale: mean " << bench_scale_sum / bench_frames << "  min " << bench_scale_min << endl;
+		if (point_lights) cerr << "point lights: " << clusters.lights.size() << ", in " << clusters.references() << " cluster slots the last frame" << endl;
+		quit();
+	}
+
+	// the frame that last used this query was STATS_QUERIES frames ago, its count is long done
+	unsigned int slot = bench_frame % STATS_QUERIES;
+	if (bench_frame >= STATS_QUERIES) bench_collect(slot);
+	frame_draws = 0;
+	render_state.reset_changes();
+	glBeginQuery(GL_PRIMITIVES_GENERATED, primitive_queries[slot]);
+}
+
+void bench_frame_end() {
+	glEndQuery(GL_PRIMITIVES_GENERATED);
+	bench_pending[bench_frame % STATS_QUERIES].draws = frame_draws;
+	bench_pending[bench_frame % STATS_QUERIES].state_changes = render_state.changes();
+	bench_scale_sum += scene_target.scale();
+	bench_scale_min = min(bench_scale_min, scene_target.scale());
+	bench_frame++;
+}
+
+void bench_collect(unsigned int slot) {
+	GLuint triangles = 0;
+	glGetQueryObjectuiv(primitive_queries[slot], GL_QUERY_RESULT, &triangles);
+	bench_stats.add(bench_pending[slot].ms, bench_pending[slot].draws, bench_pending[slot].state_changes, triangles);
+}
+
+void quit() {
+	if (replaying) {
+		double seconds = (glutGet(GLUT_ELAPSED_TIME) - replay_start_ms) / 1000.0;
+		cerr << "replayed " << replay_frames << " frames in " << seconds << " s, " << replay_frames / max(seconds, 0.001) << " fps" << endl;
+	}
+	// equal for a recording and its replay, sim_bench -replay prints the same
+	if (replaying || recorder.active()) cerr << "traffic checksum " << hex << car_controller->checksum() << dec << endl;
+
+	capture.stop();
+	recorder.close();
+	exit(0);
 }
 
 void idle_handler() {
@@ -1031,82 +910,536 @@ void idle_handler() {
 
 ////////////////////////////////////////////// Some other helpers
 
-void building(int height, int tex) {
-	Building b(height, tex*2);
-	b.emit();
+// everything that lives in the programs themselves, set again whenever shader_library swaps one in
+void setup_programs() {
+	for (int v = 0; v < SHADER_VARIANTS; v++) {
+		// a variant without one of these samplers just doesn't find it
+		GLuint program = programs[v] = shader_library.program(main_shaders[v]);
+		glUseProgram(program);
+		setup_frame_uniforms(program);
+		glUniform1i(glGetUniformLocation(program, "atlas"), 0); // texture unit, not texture name
+		glUniform1i(glGetUniformLocation(program, "basemap"), 1);
+		// even with shadows off, a shadow sampler can't share the atlas' unit, same for the lights
+		glUniform1i(glGetUniformLocation(program, "shadows"), SHADOW_TEXTURE_UNIT);
+		glUniform1i(glGetUniformLocation(program, "lights"), LIGHT_TEXTURE_UNIT);
+		glUniform1i(glGetUniformLocation(program, "light_clusters"), LIGHT_TEXTURE_UNIT + 1);
+		glUniform1i(glGetUniformLocation(program, "light_indices"), LIGHT_TEXTURE_UNIT + 2);
+	}
+
+	if (shadows_enabled) {
+		shadow_program = shader_library.program(shadow_shaders);
+		shadow_light_matrix = glGetUniformLocation(shadow_program, "light_matrix");
+		shadow_instanced = glGetUniformLocation(shadow_program, "instanced");
+	}
+
+	#ifndef __APPLE__
+	if (gpu_culling) {
+		cull_program = shader_library.program(cull_shaders);
+		setup_frame_uniforms(cull_program);
+		glUseProgram(cull_program);
+		glUniform1ui(glGetUniformLocation(cull_program, "command_count"), city_commands.size());
+		cull_instance_base = glGetUniformLocation(cull_program, "instance_base");
+	}
+	#endif
+	render_state.invalidate();
 }
 
-void car_block(int height, float r, float g, float b) {
-	Car_Block c(height, r, g, b);
-	c.emit();
+void setup_frame_uniforms(GLuint program) {
+	if (frame_ubo == 0) {
+		glGenBuffers(1, &frame_ubo);
+		glBindBuffer(GL_UNIFORM_BUFFER, frame_ubo);
+		glBufferData(GL_UNIFORM_BUFFER, sizeof(FrameUniforms_t), NULL, GL_DYNAMIC_DRAW);
+		glBindBufferBase(GL_UNIFORM_BUFFER, FRAME_BINDING, frame_ubo);
+	}
+
+	if (lighting_ubo == 0) {
+		glGenBuffers(1, &lighting_ubo);
+		glBindBuffer(GL_UNIFORM_BUFFER, lighting_ubo);
+		glBufferData(GL_UNIFORM_BUFFER, sizeof(LightingUniforms_t), NULL, GL_DYNAMIC_DRAW);
+		glBindBufferBase(GL_UNIFORM_BUFFER, LIGHTING_BINDING, lighting_ubo);
+	}
+
+	// every program that includes frame.glsl (or lighting.glsl) reads the same buffer
+	GLuint block = glGetUniformBlockIndex(program, "Frame");
+	if (block != GL_INVALID_INDEX) glUniformBlockBinding(program, block, FRAME_BINDING);
+	block = glGetUniformBlockIndex(program, "Lighting");
+	if (block != GL_INVALID_INDEX) glUniformBlockBinding(program, block, LIGHTING_BINDING);
 }
 
-////////////////////////////////////////////// Camera control
-void track_car() {
-	vector<Car*>::iterator it = car_controller->cars.begin();
-	double x_pos = (*it)->m_x_pos;
-	double y_pos = (*it)->m_y_pos;
-
-	if ((*it)->get_heading() == UP) {
-		gluLookAt(x_pos, 10.0, -y_pos,    x_pos, 10, -y_pos-1,   0, 1, 0); 
-	} else if ((*it)->get_heading() == DOWN) {
-		gluLookAt(x_pos, 10.0, -y_pos,    x_pos, 10, -y_pos+1,   0, 1, 0); 
-	} else if ((*it)->get_heading() == LEFT) {
-		gluLookAt(x_pos, 10.0, -y_pos,    x_pos-1, 10, -y_pos,   0, 1, 0); 
-	} else if ((*it)->get_heading() == RIGHT) {			
-		gluLookAt(x_pos, 10.0, -y_pos,    x_pos+1, 10, -y_pos,   0, 1, 0); 
-	} else {
-		gluLookAt(x_pos, 10.0, -y_pos,    x_pos+1, 10, -y_pos,   0, 1, 0); 
+void update_frame_uniforms() {
+	// one upload per frame, however many programs end up reading it
+	frame_uniforms.view = view_matrix;
+	frame_uniforms.projection = projection_matrix;
+	frame_uniforms.view_projection = projection_matrix * view_matrix;
+	// what's drawn to, which is less than the window when the resolution's down
+	frame_uniforms.viewport[0] = scene_target.width();
+	frame_uniforms.viewport[1] = scene_target.height();
+	frame_uniforms.viewport[2] = 1.0 / scene_target.width();
+	frame_uniforms.viewport[3] = 1.0 / scene_target.height();
+	frame_uniforms.time = scene_ms / 1000.0;
+
+	// the cascades follow the camera, but only move (and redraw the city) when they have to.
+	// no sun, no shadows: the splits stay 0 and the cascades keep the last sun until it's back up
+	memset(frame_uniforms.shadow_splits, 0, sizeof(frame_uniforms.shadow_splits));
+	if (shadows_enabled && time_of_day.sun_up()) {
+		const CameraState_t &view = camera.state();
+		shadows.set_sun(time_of_day.sun());
+		shadows.fit(view.eye, view.forward);
+		for (int c = 0; c < SHADOW_CASCADES; c++) {
+			frame_uniforms.shadow_matrix[c] = shadows.matrix(c);
+			frame_uniforms.shadow_splits[c] = shadows.split(c);
+		}
+	}
+
+	glBindBuffer(GL_UNIFORM_BUFFER, frame_ubo);
+	glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(FrameUniforms_t), &frame_uniforms);
+}
+
+void update_lighting() {
+	LightingUniforms_t lighting;
+	const Vec3_t &sun = time_of_day.sun();
+	const Color_t &sun_color = time_of_day.sun_color(), &ambient = time_of_day.ambient(), &sky = time_of_day.sky();
+	lighting.sun[0] = sun.x;
+	lighting.sun[1] = sun.y;
+	lighting.sun[2] = sun.z;
+	lighting.sun[3] = 0.0;
+	lighting.sun_color[0] = sun_color.r;
+	lighting.sun_color[1] = sun_color.g;
+	lighting.sun_color[2] = sun_color.b;
+	lighting.sun_color[3] = 1.0;
+	lighting.ambient[0] = ambient.r;
+	lighting.ambient[1] = ambient.g;
+	lighting.ambient[2] = ambient.b;
+	lighting.ambient[3] = 1.0;
+	lighting.night = time_of_day.night();
+	lighting.pad[0] = lighting.pad[1] = lighting.pad[2] = 0.0;
+
+	glBindBuffer(GL_UNIFORM_BUFFER, lighting_ubo);
+	glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(LightingUniforms_t), &lighting);
+	glClearColor(sky.r, sky.g, sky.b, 1.0);
+}
+
+void draw_ground() {
+	// the plain ground is part of the city mesh, only the base map needs its own draws
+	if (basemap.tiles.empty()) return;
+
+	// a tile each, on unit 1 where the atlas can stay bound on 0
+	for (unsigned int i = 0; i < basemap.tiles.size(); i++) {
+		RenderItem_t item = { render_key(variant_rank[TEX_BASEMAP], i + 1, 0, 0), programs[TEX_BASEMAP], ground_tiles.vao, 1, basemap.tiles[i], RENDER_ELEMENTS, i * 6, 6, 1, RENDER_NO_INSTANCES };
+		render_queue.submit(item);
+	}
+}
+
+// this frame's car instances, returns where they start. fence() the buffer once the draws using them are in.
+GLuint fill_car_instances() {
+	// the workers write the cars straight into this frame's part of the instance buffer,
+	// all the main thread does per car is wait for them
+	size_t cars = car_controller->cars.size();
+	CarInstance_t *instances = (CarInstance_t*) car_instances.begin(cars + 1);
+	GLuint base = car_instances.base();
+	car_command.instance_count = 0;
+	if (instances != NULL) {
+		instances[0] = identity_instance;
+		jobs.parallel_for(cars, INSTANCE_CHUNK, [&](size_t begin, size_t end) {
+			car_controller->instances(instances + 1, begin, end);
+		});
+		if (car_instances.end()) car_command.instance_count = cars;
+	}
+	return base;
+}
+
+bool setup_shadows() {
+	// depth only, no fragment shader
+	const ShaderStage_t stages[1] = { { "shadow.glsl", GL_VERTEX_SHADER } };
+	shadow_shaders = shader_library.load(stages, 1);
+	if (shadow_shaders == -1) return false;
+
+	// the blocks' bounding spheres take in everything, cars included
+	Vec3_t scene_min(1e30, 1e30, 1e30), scene_max(-1e30, -1e30, -1e30);
+	for (size_t i = 0; i < city_bounds.size(); i++) {
+		const Bounds_t &b = city_bounds[i];
+		scene_min = Vec3_t(min(scene_min.x, b.x - b.radius), min(scene_min.y, b.y - b.radius), min(scene_min.z, b.z - b.radius));
+		scene_max = Vec3_t(max(scene_max.x, b.x + b.radius), max(scene_max.y, b.y + b.radius), max(scene_max.z, b.z + b.radius));
+	}
+	if (!shadows.setup(scene_min, scene_max)) return false;
+
+	glActiveTexture(GL_TEXTURE0 + SHADOW_TEXTURE_UNIT);
+	glBindTexture(GL_TEXTURE_2D_ARRAY, shadows.texture());
+	glActiveTexture(GL_TEXTURE0);
+	return true;
+}
+
+void setup_lights() {
+	// with no lights every cluster stays empty, the shader still reads them at night
+	clusters.setup(GL_TEXTURE0 + LIGHT_TEXTURE_UNIT);
+	if (!point_lights) return;
+
+	// the corners of every block, the edges of the city included
+	PointLight_t light = { 0, STREETLIGHT_HEIGHT, 0, STREETLIGHT_RADIUS, 1.0, 0.7, 0.35, 0 };
+	for (int x = 0; x <= 300; x += block_size) {
+		for (int y = 0; y <= 300; y += block_size) {
+			light.x = x;
+			light.z = -y;
+			clusters.lights.push_back(light);
+		}
+	}
+	street_lights = clusters.lights.size();
+	clusters.lights.resize(street_lights + 2 * car_controller->cars.size());
+}
+
+// the headlights follow the cars, then the whole lot goes into the clusters
+void update_lights() {
+	PointLight_t *headlights = &clusters.lights[street_lights];
+	jobs.parallel_for(car_controller->cars.size(), INSTANCE_CHUNK, [&](size_t begin, size_t end) {
+		PointLight_t light = { 0, 1.0, 0, HEADLIGHT_RADIUS, 1.0, 0.9, 0.7, 0 };
+		for (size_t i = begin; i < end; i++) {
+			// a stopped car's lights sit on it
+			Car &car = *car_controller->cars[i];
+			const float *ahead = chase_headings[car.get_heading()];
+			float x = car.m_x_pos + ahead[0] * HEADLIGHT_AHEAD, z = -car.m_y_pos + ahead[1] * HEADLIGHT_AHEAD;
+			light.x = x - ahead[1] * HEADLIGHT_APART;
+			light.z = z + ahead[0] * HEADLIGHT_APART;
+			headlights[i * 2] = light;
+			light.x = x + ahead[1] * HEADLIGHT_APART;
+			light.z = z - ahead[0] * HEADLIGHT_APART;
+			headlights[i * 2 + 1] = light;
+		}
+	});
+	clusters.build(view_matrix, jobs);
+	clusters.upload();
+}
+
+// the city into any stale cascade, then the cars into all of them
+void draw_shadows(GLuint instance_base) {
+	if (!shadows_enabled || !time_of_day.sun_up()) return;
+
+	render_state.use_program(shadow_program);
+	render_state.bind_vertex_array(city.vao);
+	glEnable(GL_POLYGON_OFFSET_FILL);
+	glPolygonOffset(2.0, 4.0); // slope scaled, keeps the lit faces from shadowing themselves
+	for (int c = 0; c < SHADOW_CASCADES; c++) {
+		glUniformMatrix4fv(shadow_light_matrix, 1, GL_FALSE, shadows.matrix(c).m);
+		if (shadows.stale(c)) {
+			// everything between the road markings and the car mesh, in one draw
+			shadows.begin_static(c);
+			glUniform1i(shadow_instanced, 0);
+			glDrawElements(GL_TRIANGLES, car_command.first_index - shadow_first_index, GL_UNSIGNED_INT, (void*) (shadow_first_index * sizeof(uint32_t)));
+			frame_draws++;
+			shadows.cached(c);
+		}
+
+		shadows.begin_live(c);
+		if (car_command.instance_count > 0) {
+			glUniform1i(shadow_instanced, 1);
+			render_state.bind_instances(instance_base + car_command.base_instance);
+			glDrawElementsInstanced(GL_TRIANGLES, car_command.count, GL_UNSIGNED_INT, (void*) (car_command.first_index * sizeof(uint32_t)), car_command.instance_count);
+			frame_draws++;
+		}
+	}
+	glDisable(GL_POLYGON_OFFSET_FILL);
+	shadows.end(scene_target.framebuffer(), scene_target.width(), scene_target.height());
+}
+
+// queues the city's draws. every command's base_instance is relative to this frame's instances, which start at instance_base
+void submit_city(GLuint instance_base) {
+	#ifndef __APPLE__
+	if (gpu_culling) {
+		// the whole city is a dispatch and a draw however many blocks there are
+		GLsizei count = city_commands.size();
+		DrawCommand_t cars = car_command;
+		cars.base_instance += instance_base;
+		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, indirect_buffer);
+		glBufferSubData(GL_DRAW_INDIRECT_BUFFER, count * sizeof(DrawCommand_t), sizeof(DrawCommand_t), &cars);
+
+		render_state.use_program(cull_program);
+		glUniform1ui(cull_instance_base, instance_base);
+		glDispatchCompute((count + CULL_GROUP_SIZE - 1) / CULL_GROUP_SIZE, 1, 1);
+		glMemoryBarrier(GL_COMMAND_BARRIER_BIT);
+
+		// culled commands stay in with no instances, so the batches line up with city_commands
+		for (size_t b = 0; b < city_batches.size(); b++) submit_city_draw(city_batches[b].variant, 0, RENDER_INDIRECT, city_batches[b].first, city_batches[b].count, 0, 0, 0);
+		return;
+	}
+	#endif
+
+	// same test as cull.glsl split over the workers, then keep only what's visible, in order
+	float planes[6][4];
+	mat4_frustum_planes(frame_uniforms.view_projection, planes);
+	block_visible.resize(city_commands.size());
+	jobs.parallel_for(city_commands.size(), CULL_CHUNK, [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; i++) {
+			const Bounds_t &b = city_bounds[i];
+			block_visible[i] = sphere_in_frustum(planes, Vec3_t(b.x, b.y, b.z), b.radius);
+		}
+	});
+	visible_commands.clear();
+	visible_batches.clear();
+	visible_depths.clear();
+	for (size_t i = 0; i < city_commands.size(); i++) {
+		if (!block_visible[i]) continue;
+		add_to_batch(visible_batches, city_variants[i], visible_commands.size());
+		visible_commands.push_back(city_commands[i]);
+		visible_depths.push_back(-mat4_transform_point(view_matrix, Vec3_t(city_bounds[i].x, city_bounds[i].y, city_bounds[i].z)).z);
+	}
+	if (car_command.instance_count > 0) {
+		add_to_batch(visible_batches, TEX_NONE, visible_commands.size());
+		visible_commands.push_back(car_command);
+		visible_depths.push_back(0);
+	}
+	if (visible_commands.empty()) return;
+	for (size_t i = 0; i < visible_commands.size(); i++) visible_commands[i].base_instance += instance_base;
+
+	#ifndef __APPLE__
+	if (multi_draw) {
+		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, indirect_buffer);
+		glBufferSubData(GL_DRAW_INDIRECT_BUFFER, 0, visible_commands.size() * sizeof(DrawCommand_t), &visible_commands[0]);
+		for (size_t b = 0; b < visible_batches.size(); b++) submit_city_draw(visible_batches[b].variant, 0, RENDER_INDIRECT, visible_batches[b].first, visible_batches[b].count, 0, 0, 0);
+		return;
+	}
+	#endif
+
+	// no indirect draws, and no base instance either, so the cars move the instance attributes instead.
+	// a draw per block, which the queue puts nearest first
+	size_t cars = car_command.instance_count > 0 ? visible_commands.size() - 1 : visible_commands.size(); // the cars' command, last
+	for (size_t b = 0; b < visible_batches.size(); b++) {
+		for (GLuint i = visible_batches[b].first; i < visible_batches[b].first + visible_batches[b].count; i++) {
+			const DrawCommand_t &c = visible_commands[i];
+			unsigned int material = i == cars ? 1 : 0;
+			submit_city_draw(visible_batches[b].variant, material, RENDER_ELEMENTS, c.first_index, c.count, c.instance_count, c.base_instance, visible_depths[i]);
+		}
 	}
 }
 
-void move(int dir) {
-    switch (dir) {
-        //case 0: tarY += 4.0; eyeY += 0.4; updateView(); break; // Rise
-        case 0: eyeY += 4.0; updateView(); break; // Rise
+// a draw out of the city's buffers with variant's program, material 0 for the static blocks and 1 for the cars.
+// the multi draws need the instance attributes at 0, where the commands' base_instance counts from
+void submit_city_draw(int variant, unsigned int material, int kind, GLuint first, GLuint count, GLuint instances, GLuint instance_base, float depth) {
+	RenderItem_t item = { render_key(variant_rank[variant], 0, material, depth), programs[variant], city.vao, 0, 0, kind, first, count, instances, instance_base };
+	render_queue.submit(item);
+}
 
-        //case 1: tarY -= 4.0; eyeY -= 0.4; updateView(); break; // Drop
-        case 1: eyeY -= 4.0; updateView(); break; // Drop
+// points the instance attributes of the bound vertex array at instance base onwards
+void bind_instances(GLuint base) {
+	glBindBuffer(GL_ARRAY_BUFFER, car_instances.buffer());
+	glVertexAttribPointer(5, 4, GL_FLOAT, GL_FALSE, sizeof(CarInstance_t), (void*) (base * sizeof(CarInstance_t) + offsetof(CarInstance_t, x)));
+	glVertexAttribPointer(6, 4, GL_FLOAT, GL_FALSE, sizeof(CarInstance_t), (void*) (base * sizeof(CarInstance_t) + offsetof(CarInstance_t, r)));
+}
 
-        case 2: eyeX -= 2.0*cos(rads(viewAngX)); // Left
-                eyeZ -= 2.0*sin(rads(viewAngX));
-                updateView(); break;
+void setup_geometry() {
+	MeshBuilder mesh;
+	build_city(mesh);
+
+	// the four blocks Car::instance() places, in white so the instance color comes through
+	uint32_t first_index = mesh.indices.size();
+	car_block(mesh, 1, 1.0, 1.0, 1.0);
+	mesh.set_transform(mat4_translate(0, 2, 0));
+	car_block(mesh, 1, 1.0, 1.0, 1.0);
+	mesh.set_transform(mat4_translate(0, 0, -2));
+	car_block(mesh, 1, 1.0, 1.0, 1.0);
+	mesh.set_transform(mat4_translate(0, 0, 2));
+	car_block(mesh, 1, 1.0, 1.0, 1.0);
+	mesh.set_transform(mat4_identity());
+	car_command.count = mesh.indices.size() - first_index;
+	car_command.instance_count = 0;
+	car_command.first_index = first_index;
+	car_command.base_vertex = 0;
+	car_command.base_instance = 1;
+	city_batches.clear();
+	for (size_t i = 0; i < city_commands.size(); i++) add_to_batch(city_batches, city_variants[i], i);
+	add_to_batch(city_batches, TEX_NONE, city_commands.size());
+
+	upload_geometry(mesh, city);
+
+	car_instances.setup(GL_ARRAY_BUFFER, sizeof(CarInstance_t), car_controller->cars.size() + 1, persistent_instances);
+	persistent_instances = car_instances.persistent();
+
+	glBindVertexArray(city.vao);
+	glEnableVertexAttribArray(5);
+	glVertexAttribDivisor(5, 1);
+	glEnableVertexAttribArray(6);
+	glVertexAttribDivisor(6, 1);
+	bind_instances(0);
+	glBindVertexArray(0);
+
+	// the basemap tiles aren't instanced, they get no offset and a white tint
+	glVertexAttrib4f(5, 0.0, 0.0, 0.0, 0.0);
+	glVertexAttrib4f(6, 1.0, 1.0, 1.0, 1.0);
+
+	// room for every command, culled or not, plus the cars
+	if (multi_draw) {
+		glGenBuffers(1, &indirect_buffer);
+		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, indirect_buffer);
+		glBufferData(GL_DRAW_INDIRECT_BUFFER, (city_commands.size() + 1) * sizeof(DrawCommand_t), NULL, GL_DYNAMIC_DRAW);
+		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+	}
+}
 
-        case 3: eyeX += 2.0*cos(rads(viewAngX)); // Right
-                eyeZ += 2.0*sin(rads(viewAngX));
-                updateView(); break;
+bool setup_culling() {
+	#ifdef __APPLE__
+	return false;
+	#else
+	const ShaderStage_t stages[1] = { { "cull.glsl", GL_COMPUTE_SHADER } };
+	cull_shaders = shader_library.load(stages, 1);
+	if (cull_shaders == -1) return false;
+
+	// bindings match cull.glsl, the output is the indirect buffer itself
+	glGenBuffers(1, &command_buffer);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, command_buffer);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, city_commands.size() * sizeof(DrawCommand_t), &city_commands[0], GL_STATIC_DRAW);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, command_buffer);
+
+	glGenBuffers(1, &bounds_buffer);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, bounds_buffer);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, city_bounds.size() * sizeof(Bounds_t), &city_bounds[0], GL_STATIC_DRAW);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, bounds_buffer);
+
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, indirect_buffer);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+	return true;
+	#endif
+}
+
+void upload_geometry(MeshBuilder &mesh, Geometry_t &geometry) {
+	glGenVertexArrays(1, &geometry.vao);
+	glBindVertexArray(geometry.vao);
+
+	glGenBuffers(1, &geometry.vbo);
+	glBindBuffer(GL_ARRAY_BUFFER, geometry.vbo);
+	glBufferData(GL_ARRAY_BUFFER, mesh.vertices.size() * sizeof(Vertex_t), mesh.vertices.empty() ? NULL : &mesh.vertices[0], GL_STATIC_DRAW);
+
+	glGenBuffers(1, &geometry.ibo);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, geometry.ibo);
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, mesh.indices.size() * sizeof(uint32_t), mesh.indices.empty() ? NULL : &mesh.indices[0], GL_STATIC_DRAW);
+	geometry.count = mesh.indices.size();
+
+	// locations match the layout() qualifiers in vert.glsl
+	glEnableVertexAttribArray(0);
+	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex_t), (void*) offsetof(Vertex_t, x));
+	glEnableVertexAttribArray(1);
+	glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex_t), (void*) offsetof(Vertex_t, nx));
+	glEnableVertexAttribArray(2);
+	glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex_t), (void*) offsetof(Vertex_t, u));
+	glEnableVertexAttribArray(3);
+	glVertexAttribPointer(3, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(Vertex_t), (void*) offsetof(Vertex_t, r));
+
+	glBindVertexArray(0);
+}
+
+void build_city(MeshBuilder &mesh) {
+	// everything display_handler used to draw every frame, minus the cars
+	city_commands.clear();
+	city_bounds.clear();
+	city_variants.clear();
+
+	// the streets don't depend on the blocks, so they're all made at once and drawn whatever's in view.
+	// the markings go first, the shadows start after them
+	int blocks_x = 300 / block_size, blocks_y = 300 / block_size;
+	road_markings(mesh, blocks_x, blocks_y, block_size);
+	shadow_first_index = mesh.indices.size();
+	road_lots(mesh, blocks_x, blocks_y, block_size, basemap.tiles.empty());
+	add_command(mesh, 0);
+
+	// then a block at a time, so each one is a single draw command
+	int tex = 0;
+	heights->reset();
+	blocks->reset();
+	while(blocks->has_next()) {
+		Point2D_t p = blocks->next();
+		uint32_t first_index = mesh.indices.size();
+		mesh.set_transform(mat4_identity());
+		mesh.tex(TEX_NONE);
+		mesh.normal(0.0, 1.0, 0.0);
+
+		// a building, or grass and a tree where there's no building
+		int sf = heights->next();
+		if (sf * 10 > 10) {
+			// block_size / 2 moves the building to the center of the block
+			mesh.set_transform(mat4_translate(p.x + block_size / 2, 2.0, -1 * p.y - block_size / 2) * mat4_scale(5.0, 1.0, 5.0)); // expand the footprint
+			// how many of its windows are lit at night, from where it is so it doesn't take a random number
+			uint32_t lit = ((uint32_t) (int) p.x * 73856093u) ^ ((uint32_t) (int) p.y * 19349663u);
+			building(mesh, 10.0 * sf, tex % 3, 0.25 + (lit % 61) / 100.0);
+			tex++;
+		} else {
+			mesh.color(0.2, 0.6, 0.2);
+			uint32_t a = mesh.vertex(p.x+7,  0.16, -1*p.y-23);
+			uint32_t b = mesh.vertex(p.x+7,  0.16, -1*p.y-7);
+			uint32_t c = mesh.vertex(p.x+23, 0.16, -1*p.y-23);
+			uint32_t d = mesh.vertex(p.x+23, 0.16, -1*p.y-7);
+			mesh.quad(a, b, d, c);
+
+			mesh.set_transform(mat4_translate(p.x + block_size / 2, 15, -1 * p.y - block_size / 2));
+			mesh.sphere(10, 5, 5);
+
+			mesh.color(.6, .3, 0);
+			mesh.set_transform(mat4_scale(1, 15.0/2, 1) * mat4_translate(p.x + block_size / 2, 1.01, -1 * p.y - block_size / 2) * mat4_rotate(90, 1, 0, 0));
+			mesh.torus(1, 1.2, 6, 6);
+		}
+		add_command(mesh, first_index);
+	}
+	mesh.set_transform(mat4_identity());
+	sort_commands();
+}
 
-        case 4: eyeZ -= 2.0*cos(rads(viewAngX))*cos(rads(viewAngY)); // Forward
-                eyeX += 2.0*sin(rads(viewAngX))*cos(rads(viewAngY));
-                eyeY += 2.0*sin(rads(viewAngY));
-                updateView(); break;
+// whatever was emitted since first_index becomes a draw command per run of triangles with the same texture,
+// each with a sphere around it to cull by
+void add_command(MeshBuilder &mesh, uint32_t first_index) {
+	for (uint32_t start = first_index, end; start < mesh.indices.size(); start = end) {
+		int variant = (int) mesh.vertices[mesh.indices[start]].tex;
+		for (end = start + 3; end < mesh.indices.size() && (int) mesh.vertices[mesh.indices[end]].tex == variant; end += 3);
+
+		const Vertex_t &first = mesh.vertices[mesh.indices[start]];
+		Vec3_t low = Vec3_t(first.x, first.y, first.z), high = low;
+		for (uint32_t i = start; i < end; i++) {
+			const Vertex_t &v = mesh.vertices[mesh.indices[i]];
+			low = Vec3_t(min(low.x, v.x), min(low.y, v.y), min(low.z, v.z));
+			high = Vec3_t(max(high.x, v.x), max(high.y, v.y), max(high.z, v.z));
+		}
+		Vec3_t center = (low + high) * 0.5;
+		Bounds_t bounds = { center.x, center.y, center.z, vec3_length(high - center) };
+		city_bounds.push_back(bounds);
+
+		DrawCommand_t command = { end - start, 1, start, 0, 0 };
+		city_commands.push_back(command);
+		city_variants.push_back(variant);
+	}
+}
 
-        case 5: eyeZ += 2.0*cos(rads(viewAngX))*cos(rads(viewAngY)); // Backwards
-                eyeX -= 2.0*sin(rads(viewAngX))*cos(rads(viewAngY));
-                eyeY -= 2.0*sin(rads(viewAngY));
-                updateView(); break;
-    }
+// groups the commands by variant in variant_rank order, untextured last where the car command joins them,
+// so a frame switches programs once per variant. only the commands move, the index buffer stays in block order
+void sort_commands() {
+	vector<DrawCommand_t> commands;
+	vector<Bounds_t> bounds;
+	vector<int> variants;
+	for (unsigned int rank = 0; rank < SHADER_VARIANTS; rank++) {
+		for (size_t i = 0; i < city_commands.size(); i++) {
+			if (variant_rank[city_variants[i]] != rank) continue;
+			commands.push_back(city_commands[i]);
+			bounds.push_back(city_bounds[i]);
+			variants.push_back(city_variants[i]);
+		}
+	}
+	city_commands.swap(commands);
+	city_bounds.swap(bounds);
+	city_variants.swap(variants);
 }
 
-void look(int dir) {
-    switch (dir) {
-        case 0: viewAngY += 5.0; updateView(); break; // up
-        case 1: viewAngY -= 5.0; updateView(); break; //down
-        case 2: viewAngX -= 5.0; updateView(); break; //left
-        case 3: viewAngX += 5.0; updateView(); break; // right
-    }
+// command goes on the end of the last batch if that's the same variant, otherwise starts a new one
+void add_to_batch(vector<Batch_t> &batches, int variant, GLuint command) {
+	if (!batches.empty() && batches.back().variant == variant && batches.back().first + batches.back().count == command) batches.back().count++;
+	else {
+		Batch_t batch = { variant, command, 1 };
+		batches.push_back(batch);
+	}
 }
 
-void updateView() {
-    if (viewAngY > 85.0) viewAngY = 85;
-    if (viewAngY < -85.0) viewAngY = -85; 
-    tarZ = eyeZ - (cos(rads(viewAngX)))*(cos(rads(viewAngY)));
-    tarX = eyeX + (sin(rads(viewAngX)))*(cos(rads(viewAngY)));
-    tarY = eyeY + (sin(rads(viewAngY)));
+void building(MeshBuilder &mesh, int height, int tex, float lights) {
+	// facades are the even textures, their roofs the odd ones
+	Building b(height, &atlas.rects[facade_rects[tex*2]], &atlas.rects[facade_rects[tex*2+1]], lights);
+	b.emit(mesh);
 }
 
-double rads(double degrees) {
-    return degrees*(PI/180.0);
+void car_block(MeshBuilder &mesh, int height, float r, float g, float b) {
+	Car_Block c(height, r, g, b);
+	c.emit(mesh);
 }
 
 void passive_motion(int x, int y) {
@@ -0,0 +1,194 @@
+// mat.h - the bits of vector / matrix math the renderer needs
+//
+// Matrices are column major, same as GL, so Mat4_t::m goes to glUniformMatrix4fv /
+// uniform buffers untransposed. The constructors follow the old fixed function calls
+// (glTranslatef, glRotatef, gluPerspective, gluLookAt) so geometry ported off the
+// matrix stack comes out where it used to.
+
+#ifndef MAT_H
+#define MAT_H
+
+#include <math.h>
+#include <string.h>
+
+typedef struct Vec3_struct {
+	float x, y, z;
+	Vec3_struct(float xx, float yy, float zz) : x(xx), y(yy), z(zz) {};
+	Vec3_struct() : x(0), y(0), z(0) {};
+} Vec3_t;
+
+inline Vec3_t operator+(const Vec3_t &a, const Vec3_t &b) { return Vec3_t(a.x + b.x, a.y + b.y, a.z + b.z); }
+inline Vec3_t operator-(const Vec3_t &a, const Vec3_t &b) { return Vec3_t(a.x - b.x, a.y - b.y, a.z - b.z); }
+inline Vec3_t operator*(const Vec3_t &a, float s) { return Vec3_t(a.x * s, a.y * s, a.z * s); }
+
+inline float vec3_dot(const Vec3_t &a, const Vec3_t &b) {
+	return a.x * b.x + a.y * b.y + a.z * b.z;
+}
+
+inline Vec3_t vec3_cross(const Vec3_t &a, const Vec3_t &b) {
+	return Vec3_t(a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x);
+}
+
+inline float vec3_length(const Vec3_t &a) {
+	return sqrtf(vec3_dot(a, a));
+}
+
+inline Vec3_t vec3_normalize(const Vec3_t &a) {
+	float length = vec3_length(a);
+	return length > 0 ? a * (1.0f / length) : a;
+}
+
+typedef struct Mat4_struct {
+	float m[16]; // column major, m[column * 4 + row]
+
+	float &at(int row, int column) { return m[column * 4 + row]; }
+	float at(int row, int column) const { return m[column * 4 + row]; }
+} Mat4_t;
+
+inline Mat4_t mat4_identity() {
+	Mat4_t r;
+	memset(r.m, 0, sizeof(r.m));
+	r.m[0] = r.m[5] = r.m[10] = r.m[15] = 1;
+	return r;
+}
+
+inline Mat4_t operator*(const Mat4_t &a, const Mat4_t &b) {
+	Mat4_t r;
+	for (int column = 0; column < 4; column++) {
+		for (int row = 0; row < 4; row++) {
+			r.at(row, column) = a.at(row, 0) * b.at(0, column) + a.at(row, 1) * b.at(1, column) + a.at(row, 2) * b.at(2, column) + a.at(row, 3) * b.at(3, column);
+		}
+	}
+	return r;
+}
+
+inline Mat4_t mat4_translate(float x, float y, float z) {
+	Mat4_t r = mat4_identity();
+	r.m[12] = x;
+	r.m[13] = y;
+	r.m[14] = z;
+	return r;
+}
+
+inline Mat4_t mat4_scale(float x, float y, float z) {
+	Mat4_t r = mat4_identity();
+	r.m[0] = x;
+	r.m[5] = y;
+	r.m[10] = z;
+	return r;
+}
+
+// degrees about an arbitrary axis, like glRotatef
+inline Mat4_t mat4_rotate(float degrees, float x, float y, float z) {
+	Vec3_t a = vec3_normalize(Vec3_t(x, y, z));
+	float c = cosf(degrees * (float) M_PI / 180.0f);
+	float s = sinf(degrees * (float) M_PI / 180.0f);
+	float t = 1 - c;
+
+	Mat4_t r = mat4_identity();
+	r.at(0, 0) = a.x * a.x * t + c;       r.at(0, 1) = a.x * a.y * t - a.z * s; r.at(0, 2) = a.x * a.z * t + a.y * s;
+	r.at(1, 0) = a.y * a.x * t + a.z * s; r.at(1, 1) = a.y * a.y * t + c;       r.at(1, 2) = a.y * a.z * t - a.x * s;
+	r.at(2, 0) = a.z * a.x * t - a.y * s; r.at(2, 1) = a.z * a.y * t + a.x * s; r.at(2, 2) = a.z * a.z * t + c;
+	return r;
+}
+
+// like gluPerspective, fovy in degrees
+inline Mat4_t mat4_perspective(float fovy, float aspect, float near, float far) {
+	float f = 1.0f / tanf(fovy * (float) M_PI / 360.0f);
+
+	Mat4_t r;
+	memset(r.m, 0, sizeof(r.m));
+	r.at(0, 0) = f / aspect;
+	r.at(1, 1) = f;
+	r.at(2, 2) = (far + near) / (near - far);
+	r.at(2, 3) = 2 * far * near / (near - far);
+	r.at(3, 2) = -1;
+	return r;
+}
+
+// like glOrtho
+inline Mat4_t mat4_ortho(float left, float right, float bottom, float top, float near, float far) {
+	Mat4_t r = mat4_identity();
+	r.at(0, 0) = 2 / (right - left);
+	r.at(1, 1) = 2 / (top - bottom);
+	r.at(2, 2) = -2 / (far - near);
+	r.at(0, 3) = -(right + left) / (right - left);
+	r.at(1, 3) = -(top + bottom) / (top - bottom);
+	r.at(2, 3) = -(far + near) / (far - near);
+	return r;
+}
+
+// view matrix straight from a camera's orthonormal basis (s right, u up, f forward)
+inline Mat4_t mat4_view(const Vec3_t &eye, const Vec3_t &s, const Vec3_t &u, const Vec3_t &f) {
+	Mat4_t r = mat4_identity();
+	r.at(0, 0) = s.x;  r.at(0, 1) = s.y;  r.at(0, 2) = s.z;  r.at(0, 3) = -vec3_dot(s, eye);
+	r.at(1, 0) = u.x;  r.at(1, 1) = u.y;  r.at(1, 2) = u.z;  r.at(1, 3) = -vec3_dot(u, eye);
+	r.at(2, 0) = -f.x; r.at(2, 1) = -f.y; r.at(2, 2) = -f.z; r.at(2, 3) = vec3_dot(f, eye);
+	return r;
+}
+
+// like gluLookAt
+inline Mat4_t mat4_look_at(const Vec3_t &eye, const Vec3_t &center, const Vec3_t &up) {
+	Vec3_t f = vec3_normalize(center - eye);
+	Vec3_t s = vec3_normalize(vec3_cross(f, up));
+	Vec3_t u = vec3_cross(s, f);
+	return mat4_view(eye, s, u, f);
+}
+
+inline Vec3_t mat4_transform_point(const Mat4_t &a, const Vec3_t &p) {
+	return Vec3_t(a.at(0, 0) * p.x + a.at(0, 1) * p.y + a.at(0, 2) * p.z + a.at(0, 3),
+	              a.at(1, 0) * p.x + a.at(1, 1) * p.y + a.at(1, 2) * p.z + a.at(1, 3),
+	              a.at(2, 0) * p.x + a.at(2, 1) * p.y + a.at(2, 2) * p.z + a.at(2, 3));
+}
+
+inline Vec3_t mat4_transform_dir(const Mat4_t &a, const Vec3_t &d) {
+	return Vec3_t(a.at(0, 0) * d.x + a.at(0, 1) * d.y + a.at(0, 2) * d.z,
+	              a.at(1, 0) * d.x + a.at(1, 1) * d.y + a.at(1, 2) * d.z,
+	              a.at(2, 0) * d.x + a.at(2, 1) * d.y + a.at(2, 2) * d.z);
+}
+
+// inverse transpose of the upper 3x3, what gl_NormalMatrix was (the rest is identity)
+inline Mat4_t mat4_normal_matrix(const Mat4_t &a) {
+	float c00 = a.at(1, 1) * a.at(2, 2) - a.at(1, 2) * a.at(2, 1);
+	float c01 = a.at(1, 2) * a.at(2, 0) - a.at(1, 0) * a.at(2, 2);
+	float c02 = a.at(1, 0) * a.at(2, 1) - a.at(1, 1) * a.at(2, 0);
+	float c10 = a.at(0, 2) * a.at(2, 1) - a.at(0, 1) * a.at(2, 2);
+	float c11 = a.at(0, 0) * a.at(2, 2) - a.at(0, 2) * a.at(2, 0);
+	float c12 = a.at(0, 1) * a.at(2, 0) - a.at(0, 0) * a.at(2, 1);
+	float c20 = a.at(0, 1) * a.at(1, 2) - a.at(0, 2) * a.at(1, 1);
+	float c21 = a.at(0, 2) * a.at(1, 0) - a.at(0, 0) * a.at(1, 2);
+	float c22 = a.at(0, 0) * a.at(1, 1) - a.at(0, 1) * a.at(1, 0);
+	float det = a.at(0, 0) * c00 + a.at(0, 1) * c01 + a.at(0, 2) * c02;
+
+	// the cofactor matrix is the inverse transpose times the determinant
+	Mat4_t r = mat4_identity();
+	r.at(0, 0) = c00 / det; r.at(0, 1) = c01 / det; r.at(0, 2) = c02 / det;
+	r.at(1, 0) = c10 / det; r.at(1, 1) = c11 / det; r.at(1, 2) = c12 / det;
+	r.at(2, 0) = c20 / det; r.at(2, 1) = c21 / det; r.at(2, 2) = c22 / det;
+	return r;
+}
+
+// frustum planes (a, b, c, d with ax + by + cz + d >= 0 inside) of a view projection, in the space it maps from.
+// left, right, bottom, top, near, far. cull.glsl does the same on the gpu.
+inline void mat4_frustum_planes(const Mat4_t &a, float planes[6][4]) {
+	for (int i = 0; i < 6; i++) {
+		int row = i / 2;
+		float sign = (i % 2 == 0) ? 1.0f : -1.0f;
+		float length = 0;
+		for (int j = 0; j < 4; j++) {
+			planes[i][j] = a.at(3, j) + sign * a.at(row, j);
+			if (j < 3) length += planes[i][j] * planes[i][j];
+		}
+		length = sqrtf(length);
+		for (int j = 0; j < 4; j++) planes[i][j] /= length;
+	}
+}
+
+inline bool sphere_in_frustum(const float planes[6][4], const Vec3_t &center, float radius) {
+	for (int i = 0; i < 6; i++) {
+		if (planes[i][0] * center.x + planes[i][1] * center.y + planes[i][2] * center.z + planes[i][3] < -radius) return false;
+	}
+	return true;
+}
+
+#endif
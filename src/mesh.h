@@ -0,0 +1,132 @@
+// mesh.h - cpu side geometry for the renderer, no GL in here
+//
+// MeshBuilder collects indexed triangles the way the old immediate mode code did:
+// set the current color / texcoord / normal, then emit vertices. Everything goes
+// through the current transform on the way in, so the static city can be baked
+// into world space once and drawn with a single call.
+
+#ifndef MESH_H
+#define MESH_H
+
+#include <vector>
+
+#include <stdint.h>
+
+#include "mat.h"
+
+// which of the fragment shader's variants draws it, see frag.glsl
+#define TEX_NONE 0
+#define TEX_ATLAS 1
+#define TEX_BASEMAP 2
+#define TEX_ROAD 3 // no texture, dashes from the texcoords
+
+typedef struct Vertex_struct {
+	float x, y, z;
+	float nx, ny, nz;
+	float u, v;
+	uint8_t r, g, b, a;
+	float tex; // one of TEX_*, only read on the cpu to split the draw commands
+} Vertex_t;
+
+class MeshBuilder {
+	private:
+		Mat4_t m_transform, m_normal_transform;
+		Vec3_t m_normal;
+		float m_u, m_v;
+		uint8_t m_color[4];
+		float m_tex;
+
+	public:
+		std::vector<Vertex_t> vertices;
+		std::vector<uint32_t> indices;
+
+		MeshBuilder() : m_normal(0, 1, 0), m_u(0), m_v(0), m_tex(TEX_NONE) {
+			set_transform(mat4_identity());
+			color(1, 1, 1);
+		}
+
+		void set_transform(const Mat4_t &transform) {
+			m_transform = transform;
+			m_normal_transform = mat4_normal_matrix(transform);
+		}
+
+		void color(float r, float g, float b, float a = 1.0f) {
+			m_color[0] = (uint8_t) (r * 255 + 0.5f);
+			m_color[1] = (uint8_t) (g * 255 + 0.5f);
+			m_color[2] = (uint8_t) (b * 255 + 0.5f);
+			m_color[3] = (uint8_t) (a * 255 + 0.5f);
+		}
+
+		void normal(float x, float y, float z) { m_normal = Vec3_t(x, y, z); }
+		void texcoord(float u, float v) { m_u = u; m_v = v; }
+		void tex(int which) { m_tex = which; }
+
+		// adds a vertex with the current state, returns its index
+		uint32_t vertex(float x, float y, float z) {
+			Vec3_t p = mat4_transform_point(m_transform, Vec3_t(x, y, z));
+			Vec3_t n = vec3_normalize(mat4_transform_dir(m_normal_transform, m_normal));
+
+			Vertex_t v = { p.x, p.y, p.z, n.x, n.y, n.z, m_u, m_v, m_color[0], m_color[1], m_color[2], m_color[3], m_tex };
+			vertices.push_back(v);
+			return vertices.size() - 1;
+		}
+
+		void triangle(uint32_t a, uint32_t b, uint32_t c) {
+			indices.push_back(a);
+			indices.push_back(b);
+			indices.push_back(c);
+		}
+
+		// GL_TRIANGLES style, every three vertices since first make a triangle
+		void close_triangles(uint32_t first) {
+			for (uint32_t i = first; i + 2 < vertices.size(); i += 3) triangle(i, i + 1, i + 2);
+		}
+
+		// GL_QUADS / GL_TRIANGLE_STRIP style quad, a b c d counterclockwise
+		void quad(uint32_t a, uint32_t b, uint32_t c, uint32_t d) {
+			triangle(a, b, c);
+			triangle(a, c, d);
+		}
+
+		// same tessellation as glutSolidSphere, poles on z
+		void sphere(float radius, int slices, int stacks) {
+			uint32_t first = vertices.size();
+			for (int i = 0; i <= stacks; i++) {
+				float phi = (float) M_PI * i / stacks;
+				for (int j = 0; j <= slices; j++) {
+					float theta = 2 * (float) M_PI * j / slices;
+					float x = sinf(phi) * cosf(theta), y = sinf(phi) * sinf(theta), z = cosf(phi);
+					normal(x, y, z);
+					vertex(x * radius, y * radius, z * radius);
+				}
+			}
+			for (int i = 0; i < stacks; i++) {
+				for (int j = 0; j < slices; j++) {
+					uint32_t a = first + i * (slices + 1) + j, b = a + slices + 1;
+					quad(a, b, b + 1, a + 1);
+				}
+			}
+		}
+
+		// same as glutSolidTorus, ring around z
+		void torus(float inner, float outer, int sides, int rings) {
+			uint32_t first = vertices.size();
+			for (int i = 0; i <= rings; i++) {
+				float theta = 2 * (float) M_PI * i / rings;
+				for (int j = 0; j <= sides; j++) {
+					float phi = 2 * (float) M_PI * j / sides;
+					float nx = cosf(theta) * cosf(phi), ny = sinf(theta) * cosf(phi), nz = sinf(phi);
+					normal(nx, ny, nz);
+					vertex(cosf(theta) * (outer + inner * cosf(phi)), sinf(theta) * (outer + inner * cosf(phi)), inner * sinf(phi));
+				}
+			}
+			for (int i = 0; i < rings; i++) {
+				for (int j = 0; j < sides; j++) {
+					uint32_t a = first + i * (sides + 1) + j, b = a + sides + 1;
+					quad(a, b, b + 1, a + 1);
+				}
+			}
+		}
+};
+
+#endif
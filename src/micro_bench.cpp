@@ -0,0 +1,426 @@
+// micro_bench.cpp - microbenchmarks for the bitmap code and city generation
+//
+// usage: micro_bench [-filter <substring>] [-min-time <seconds>] [-json <file>]
+//
+// Each benchmark runs its body in batches, doubling the batch until one takes
+// at least -min-time, and reports the time per iteration of that last batch.
+// -json writes the results in the same layout as Google Benchmark's JSON output
+// (context + benchmarks[] with real_time / cpu_time in ns), so runs from two
+// commits can be diffed with its compare.py, or anything else that reads it.
+
+#include <vector>
+#include <string>
+#include <fstream>
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <functional>
+#include <thread>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bitmap.h"
+#include "mesh.h"
+#include "atlas.h"
+#include "sim.h"
+#include "models.h"
+#include "road.h"
+
+using namespace std;
+
+////////////////////////////////////////////// harness
+
+typedef struct Result_struct {
+	string name;
+	long long iterations;
+	double real_ns, cpu_ns; // per iteration
+	double bytes, items; // per iteration, 0 when not set
+} Result_t;
+
+class Bench {
+	private:
+		double m_min_time;
+		double m_bytes, m_items;
+
+	public:
+		Result_t result;
+
+		Bench(const string &name, double min_time) : m_min_time(min_time), m_bytes(0), m_items(0) {
+			result.name = name;
+			result.iterations = 0;
+			result.real_ns = result.cpu_ns = 0;
+			result.bytes = result.items = 0;
+		}
+
+		// per iteration of the body, for the throughput columns
+		void bytes(double count) { m_bytes = count; }
+		void items(double count) { m_items = count; }
+
+		void run(const function<void()> &body) {
+			for (long long batch = 1; ; batch *= 2) {
+				clock_t cpu_start = clock();
+				chrono::steady_clock::time_point start = chrono::steady_clock::now();
+				for (long long i = 0; i < batch; i++) body();
+				double real = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+				double cpu = (double) (clock() - cpu_start) / CLOCKS_PER_SEC;
+
+				if (real >= m_min_time || batch >= (1LL << 40)) {
+					result.iterations = batch;
+					result.real_ns = real * 1e9 / batch;
+					result.cpu_ns = cpu * 1e9 / batch;
+					result.bytes = m_bytes;
+					result.items = m_items;
+					return;
+				}
+			}
+		}
+};
+
+typedef struct Benchmark_struct {
+	string name;
+	function<void(Bench&)> fn;
+} Benchmark_t;
+
+static vector<Benchmark_t> benchmarks;
+
+static void add(const string &name, function<void(Bench&)> fn) {
+	Benchmark_t b = { name, fn };
+	benchmarks.push_back(b);
+}
+
+// keeps the optimizer from throwing away a result
+static volatile uint64_t sink;
+
+static string json_escape(const string &s) {
+	string out;
+	for (size_t i = 0; i < s.size(); i++) {
+		if (s[i] == '"' || s[i] == '\\') out += '\\';
+		out += s[i];
+	}
+	return out;
+}
+
+static void write_json(const char *filename, const char *executable, const vector<Result_t> &results) {
+	ofstream out(filename);
+	if (!out.is_open()) {
+		cerr << "Could not write " << filename << endl;
+		return;
+	}
+
+	char date[64];
+	time_t now = time(NULL);
+	strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S%z", localtime(&now));
+
+	out << "{\n  \"context\": {\n";
+	out << "    \"date\": \"" << date << "\",\n";
+	out << "    \"executable\": \"" << json_escape(executable) << "\",\n";
+	out << "    \"num_cpus\": " << thread::hardware_concurrency() << ",\n";
+#ifdef NDEBUG
+	out << "    \"library_build_type\": \"release\"\n";
+#else
+	out << "    \"library_build_type\": \"debug\"\n";
+#endif
+	out << "  },\n  \"benchmarks\": [\n";
+	out << setprecision(10);
+	for (size_t i = 0; i < results.size(); i++) {
+		const Result_t &r = results[i];
+		out << "    {\n";
+		out << "      \"name\": \"" << json_escape(r.name) << "\",\n";
+		out << "      \"run_name\": \"" << json_escape(r.name) << "\",\n";
+		out << "      \"run_type\": \"iteration\",\n";
+		out << "      \"iterations\": " << r.iterations << ",\n";
+		out << "      \"real_time\": " << r.real_ns << ",\n";
+		out << "      \"cpu_time\": " << r.cpu_ns << ",\n";
+		if (r.bytes > 0) out << "      \"bytes_per_second\": " << r.bytes * 1e9 / r.real_ns << ",\n";
+		if (r.items > 0) out << "      \"items_per_second\": " << r.items * 1e9 / r.real_ns << ",\n";
+		out << "      \"time_unit\": \"ns\"\n";
+		out << "    }" << (i + 1 < results.size() ? "," : "") << "\n";
+	}
+	out << "  ]\n}\n";
+}
+
+////////////////////////////////////////////// inputs
+
+#define IMAGE_SIZE 1024
+
+// blocky rather than noisy, so the palette and RLE formats see the runs real images have
+static void make_image(CBitmap &image, unsigned int size) {
+	vector<uint32_t> pixels(size * size);
+	for (unsigned int y = 0; y < size; y++) {
+		for (unsigned int x = 0; x < size; x++) {
+			unsigned int block = (x / 37) * 7 + (y / 23) * 13;
+			uint8_t r = (block * 29) & 0xFF, g = (block * 71 + y) & 0xFF, b = (block * 113) & 0xFF;
+			pixels[y * size + x] = r | (g << 8) | (b << 16) | 0xFF000000;
+		}
+	}
+	image.SetBits(&pixels[0], size, size, 0x000000FF, 0x0000FF00, 0x00FF0000, 0xFF000000);
+}
+
+// gray paletted files by hand, Save() can't write 1 bit ones. rle is RLE8 / RLE4, runs of one index only.
+static bool write_indexed(CBitmap &image, const char *filename, unsigned int bits, bool rle) {
+	unsigned int width = image.GetWidth(), height = image.GetHeight();
+	const RGBA *pixels = (const RGBA*) image.GetBits();
+	unsigned int colors = 1 << bits;
+	unsigned int line = ((width * bits + 31) / 32) * 4;
+
+	vector<BGRA> palette(colors);
+	for (unsigned int i = 0; i < colors; i++) {
+		palette[i].Red = palette[i].Green = palette[i].Blue = i * 255 / (colors - 1);
+		palette[i].Alpha = 0xFF;
+	}
+
+	vector<uint8_t> data, indices(width);
+	for (unsigned int y = 0; y < height; y++) {
+		for (unsigned int x = 0; x < width; x++) {
+			const RGBA &p = pixels[y * width + x];
+			indices[x] = ((p.Red * 77 + p.Green * 150 + p.Blue * 29) >> 8) * (colors - 1) / 255;
+		}
+
+		if (!rle) {
+			size_t start = data.size();
+			data.resize(start + line, 0);
+			for (unsigned int x = 0; x < width; x++) {
+				data[start + x * bits / 8] |= indices[x] << (8 - bits - (x * bits) % 8);
+			}
+			continue;
+		}
+
+		for (unsigned int x = 0; x < width; ) {
+			unsigned int run = 1;
+			while (x + run < width && run < 255 && indices[x + run] == indices[x]) run++;
+			data.push_back(run);
+			data.push_back(bits == 4 ? (indices[x] << 4) | indices[x] : indices[x]);
+			x += run;
+		}
+		data.push_back(0); // end of line
+		data.push_back(0);
+	}
+	if (rle) {
+		data.push_back(0); // end of bitmap
+		data.push_back(1);
+	}
+
+	BITMAP_FILEHEADER bfh;
+	BITMAP_HEADER bh;
+	memset(&bfh, 0, sizeof(bfh));
+	memset(&bh, 0, sizeof(bh));
+	bfh.Signature = BITMAP_SIGNATURE;
+	bfh.BitsOffset = BITMAP_FILEHEADER_SIZE + sizeof(BITMAP_HEADER) + colors * sizeof(BGRA);
+	bfh.Size = bfh.BitsOffset + data.size();
+	bh.HeaderSize = sizeof(BITMAP_HEADER);
+	bh.Width = width;
+	bh.Height = height;
+	bh.Planes = 1;
+	bh.BitCount = bits;
+	bh.Compression = rle ? (bits == 4 ? 2 : 1) : 0;
+	bh.SizeImage = data.size();
+	bh.ClrUsed = colors;
+
+	ofstream out(filename, ios::binary);
+	out.write((const char*) &bfh, BITMAP_FILEHEADER_SIZE);
+	out.write((const char*) &bh, sizeof(BITMAP_HEADER));
+	out.write((const char*) &palette[0], colors * sizeof(BGRA));
+	out.write((const char*) &data[0], data.size());
+	return out.good();
+}
+
+static size_t file_size(const char *filename) {
+	ifstream in(filename, ios::binary | ios::ate);
+	return in.is_open() ? (size_t) in.tellg() : 0;
+}
+
+////////////////////////////////////////////// benchmarks
+
+typedef struct Format_struct {
+	const char *name;
+	unsigned int red, green, blue, alpha;
+} Format_t;
+
+static const Format_t formats[] = {
+	{ "rgba8888", 0x000000FF, 0x0000FF00, 0x00FF0000, 0xFF000000 },
+	{ "bgra8888", 0x00FF0000, 0x0000FF00, 0x000000FF, 0xFF000000 },
+	{ "bgr888", 0x00FF0000, 0x0000FF00, 0x000000FF, 0 },
+	{ "rgb565", 0xF800, 0x07E0, 0x001F, 0 },
+	{ "argb1555", 0x7C00, 0x03E0, 0x001F, 0x8000 },
+};
+
+static vector<string> temp_files;
+
+static void register_bitmap(CBitmap &image) {
+	// Load, one file per bit depth plus the two RLE flavors
+	static const unsigned int depths[] = { 16, 24, 32 };
+	for (size_t i = 0; i < sizeof(depths) / sizeof(depths[0]); i++) {
+		char name[64];
+		snprintf(name, sizeof(name), "micro_bench_%u.bmp", depths[i]);
+		image.Save(name, depths[i]);
+	}
+	write_indexed(image, "micro_bench_1.bmp", 1, false);
+	write_indexed(image, "micro_bench_4.bmp", 4, false);
+	write_indexed(image, "micro_bench_8.bmp", 8, false);
+	write_indexed(image, "micro_bench_rle4.bmp", 4, true);
+	write_indexed(image, "micro_bench_rle8.bmp", 8, true);
+
+	static const char *loads[][2] = {
+		{ "Load/bpp1", "micro_bench_1.bmp" }, { "Load/bpp4", "micro_bench_4.bmp" }, { "Load/bpp8", "micro_bench_8.bmp" },
+		{ "Load/bpp16", "micro_bench_16.bmp" }, { "Load/bpp24", "micro_bench_24.bmp" }, { "Load/bpp32", "micro_bench_32.bmp" },
+		{ "Load/rle4", "micro_bench_rle4.bmp" }, { "Load/rle8", "micro_bench_rle8.bmp" },
+	};
+	for (size_t i = 0; i < sizeof(loads) / sizeof(loads[0]); i++) {
+		const char *file = loads[i][1];
+		temp_files.push_back(file);
+		add(loads[i][0], [file](Bench &b) {
+			CBitmap loaded;
+			if (!loaded.Load(file) || loaded.GetWidth() != IMAGE_SIZE) cerr << file << " didn't load, timing the failure" << endl;
+			b.bytes(file_size(file));
+			b.items(IMAGE_SIZE * IMAGE_SIZE);
+			b.run([&]() { sink += loaded.Load(file); });
+		});
+	}
+
+	// GetBits / SetBits, bytes are the packed side
+	for (size_t i = 0; i < sizeof(formats) / sizeof(formats[0]); i++) {
+		const Format_t f = formats[i];
+		add(string("GetBits/") + f.name, [&image, f](Bench &b) {
+			unsigned int size = 0;
+			image.GetBits(NULL, size, f.red, f.green, f.blue, f.alpha, true);
+			vector<uint8_t> packed(size);
+			b.bytes(size);
+			b.items(IMAGE_SIZE * IMAGE_SIZE);
+			b.run([&]() { unsigned int s = size; sink += image.GetBits(&packed[0], s, f.red, f.green, f.blue, f.alpha, true); });
+		});
+		add(string("SetBits/") + f.name, [&image, f](Bench &b) {
+			unsigned int size = 0;
+			image.GetBits(NULL, size, f.red, f.green, f.blue, f.alpha, false);
+			vector<uint8_t> packed(size);
+			image.GetBits(&packed[0], size, f.red, f.green, f.blue, f.alpha, false);
+			CBitmap unpacked;
+			b.bytes(size);
+			b.items(IMAGE_SIZE * IMAGE_SIZE);
+			b.run([&]() { sink += unpacked.SetBits(&packed[0], IMAGE_SIZE, IMAGE_SIZE, f.red, f.green, f.blue, f.alpha); });
+		});
+	}
+
+	// Save, through the page cache like Load
+	static const unsigned int saves[] = { 8, 16, 24, 32 };
+	for (size_t i = 0; i < sizeof(saves) / sizeof(saves[0]); i++) {
+		unsigned int depth = saves[i];
+		add("Save/bpp" + to_string(depth), [&image, depth](Bench &b) {
+			image.Save("micro_bench_save.bmp", depth);
+			b.bytes(file_size("micro_bench_save.bmp"));
+			b.items(IMAGE_SIZE * IMAGE_SIZE);
+			b.run([&]() { sink += image.Save("micro_bench_save.bmp", depth); });
+		});
+	}
+	temp_files.push_back("micro_bench_save.bmp");
+}
+
+static void register_city() {
+	// the default 10 x 10 city and a 100 x 100 one
+	static const int sizes[] = { 300, 3000 };
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		int size = sizes[i];
+		add("BlockIterator/traverse/" + to_string(size / 30), [size](Bench &b) {
+			BlockIterator blocks(size, size, 30);
+			b.items((size / 30) * (size / 30));
+			b.run([&]() {
+				blocks.reset();
+				float sum = 0;
+				while (blocks.has_next()) sum += blocks.next().x;
+				sink += (uint64_t) sum;
+			});
+		});
+
+		int count = (size / 30) * (size / 30);
+		add("RandomIterator/generate/" + to_string(count), [count](Bench &b) {
+			b.items(count);
+			b.run([&]() {
+				RandomIterator heights(count, 5);
+				sink += (uint64_t) heights.next();
+			});
+		});
+	}
+
+	// one building into a fresh mesh, and a whole city's worth into one mesh like build_city does
+	add("Building/emit", [](Bench &b) {
+		AtlasRect_t side = { "side", 0, 0, 64, 64, 0.0, 0.0, 0.5, 0.5 }, top = side;
+		b.items(1);
+		b.run([&]() {
+			MeshBuilder mesh;
+			Building building(30, &side, &top);
+			building.emit(mesh);
+			sink += mesh.vertices.size();
+		});
+	});
+	add("Building/emit_city/100", [](Bench &b) {
+		AtlasRect_t side = { "side", 0, 0, 64, 64, 0.0, 0.0, 0.5, 0.5 }, top = side;
+		b.items(100);
+		b.run([&]() {
+			MeshBuilder mesh;
+			for (int i = 0; i < 100; i++) {
+				mesh.set_transform(mat4_translate((i % 10) * 30 + 15, 2.0, -(i / 10) * 30 - 15) * mat4_scale(5.0, 1.0, 5.0));
+				Building building(10 * (i % 5 + 1), &side, &top);
+				building.emit(mesh);
+			}
+			sink += mesh.vertices.size();
+		});
+	});
+
+	// the ground, lots and markings for a whole grid, like build_city does before the blocks
+	for (int blocks = 10; blocks <= 100; blocks *= 10) {
+		add("Road/emit/" + to_string(blocks * blocks), [blocks](Bench &b) {
+			b.items(blocks * blocks);
+			b.run([&]() {
+				MeshBuilder mesh;
+				road_markings(mesh, blocks, blocks, 30);
+				road_lots(mesh, blocks, blocks, 30, true);
+				sink += mesh.vertices.size();
+			});
+		});
+	}
+}
+
+int main(int argc, char **argv) {
+	const char *filter = "";
+	const char *json = NULL;
+	double min_time = 0.25;
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-filter") == 0 && i + 1 < argc) filter = argv[++i];
+		else if (strcmp(argv[i], "-min-time") == 0 && i + 1 < argc) min_time = atof(argv[++i]);
+		else if (strcmp(argv[i], "-json") == 0 && i + 1 < argc) json = argv[++i];
+		else {
+			cout << "usage: micro_bench [-filter <substring>] [-min-time <seconds>] [-json <file>]" << endl;
+			return 1;
+		}
+	}
+
+	CBitmap image;
+	make_image(image, IMAGE_SIZE);
+	register_bitmap(image);
+	register_city();
+
+	cout << left << setw(32) << "benchmark" << right << setw(14) << "time ns" << setw(14) << "cpu ns" << setw(14) << "iterations" << setw(14) << "MB/s" << setw(14) << "items/s" << endl;
+
+	vector<Result_t> results;
+	for (size_t i = 0; i < benchmarks.size(); i++) {
+		if (benchmarks[i].name.find(filter) == string::npos) continue;
+
+		Bench b(benchmarks[i].name, min_time);
+		benchmarks[i].fn(b);
+		results.push_back(b.result);
+
+		const Result_t &r = b.result;
+		cout << left << setw(32) << r.name << right << fixed << setprecision(0) << setw(14) << r.real_ns << setw(14) << r.cpu_ns << setw(14) << r.iterations;
+		if (r.bytes > 0) cout << setprecision(1) << setw(14) << r.bytes * 1e3 / r.real_ns;
+		else cout << setw(14) << "";
+		if (r.items > 0) cout << setprecision(0) << setw(14) << r.items * 1e9 / r.real_ns;
+		cout << endl;
+	}
+
+	for (size_t i = 0; i < temp_files.size(); i++) remove(temp_files[i].c_str());
+
+	if (json != NULL) write_json(json, argv[0], results);
+	return 0;
+}
@@ -0,0 +1,276 @@
+// models.h - the building and car block models, emitted into a MeshBuilder
+//
+// What used to be drawn in immediate mode a face at a time, now written into a
+// MeshBuilder so the city can be baked once (and benchmarked without GL).
+
+#ifndef MODELS_H
+#define MODELS_H
+
+#include <stdint.h>
+
+#include "mesh.h"
+#include "atlas.h"
+#include "sim.h"
+
+typedef struct Point3D_struct {
+	float x;
+	float y;
+	float z;
+	Point3D_struct(float xx, float yy, float zz) : x(xx), y(yy), z(zz) {};
+	Point3D_struct() {};
+} Point3D_t;
+
+class Building {
+	private:
+		int m_height;
+		float m_lights; // share of the windows lit at night, goes out in the color's alpha
+		AtlasRect_t *m_side_rect, *m_top_rect;
+		AtlasRect_t *m_rect; // rect of the face being emitted
+		MeshBuilder *m_mesh;
+		uint32_t m_first; // first vertex of the face being emitted
+
+		Point3D_t m_verts[8];
+		Point2D_t m_texcoords[4];
+
+		// the face's normal is already set, every corner of a face gets the same one
+		void vert(int n) {
+			Point3D_t vertex = m_verts[n - 1];
+			m_mesh->vertex(vertex.x, vertex.y, vertex.z);
+		}
+
+		void texcoord(int n) {
+			// remap the face's 0..1 coords into its rect in the atlas
+			Point2D_t vertex = m_texcoords[n - 1];
+			m_mesh->texcoord(m_rect->u0 + vertex.x * (m_rect->u1 - m_rect->u0), m_rect->v0 + vertex.y * (m_rect->v1 - m_rect->v0));
+		}
+
+		// stand-ins for glBegin(GL_TRIANGLES) / glEnd
+		void begin() {
+			m_first = m_mesh->vertices.size();
+		}
+
+		void end() {
+			m_mesh->close_triangles(m_first);
+		}
+
+		// one private method per face. 6 faces here.
+
+		void emit_front() {
+			// front face
+			begin();
+				m_mesh->color(1.0, 0.0, 0.0, m_lights);
+				m_mesh->normal(0, 0, 1);
+				texcoord(4); vert(4);    texcoord(1); vert(1);    texcoord(2); vert(2); // LL tri
+				texcoord(4); vert(4);    texcoord(2); vert(2);    texcoord(3); vert(3); // UR tri
+			end();
+		}
+
+		void emit_back() {
+			// back face
+			begin();
+				m_mesh->color(0.0, 1.0, 0.0, m_lights);
+				m_mesh->normal(0, 0, -1);
+				texcoord(4); vert(5);    texcoord(1); vert(7);    texcoord(2); vert(8); // LL tri
+				texcoord(4); vert(5);    texcoord(2); vert(8);    texcoord(3); vert(6); // UR tri
+			end();
+		}
+
+		void emit_left() {
+			// left face
+			begin();
+				m_mesh->color(0.0, 0.0, 1.0, m_lights);
+				m_mesh->normal(-1, 0, 0);
+				texcoord(4); vert(5);    texcoord(1); vert(7);    texcoord(2); vert(1); // LL tri
+				texcoord(4); vert(5);    texcoord(2); vert(1);    texcoord(3); vert(4); // UR tri
+			end();
+		}
+
+		void emit_right() {
+			// right face
+			begin();
+				m_mesh->color(1.0, 1.0, 1.0, m_lights);
+				m_mesh->normal(1, 0, 0);
+				texcoord(4); vert(3);    texcoord(1); vert(2);    texcoord(2); vert(8); // LL tri
+				texcoord(4); vert(3);    texcoord(2); vert(8);    texcoord(3); vert(6); // UR tri
+			end();
+		}
+
+		void emit_up() {
+			// up face
+			begin();
+				m_mesh->color(0.76, 0.76, 0.76, m_lights);
+				m_mesh->normal(0, 1, 0);
+				texcoord(4); vert(5);    texcoord(1); vert(4);    texcoord(2); vert(3); // LL tri
+				texcoord(4); vert(5);    texcoord(2); vert(3);    texcoord(3); vert(6); // UR tri
+			end();
+		}
+
+		void emit_down() {
+			// down face
+			begin();
+				m_mesh->color(1.0, 1.0, 0.0, m_lights);
+				m_mesh->normal(0, -1, 0);
+				texcoord(4); vert(1);    texcoord(1); vert(7);    texcoord(2); vert(8); // LL tri
+				texcoord(4); vert(1);    texcoord(2); vert(8);    texcoord(3); vert(2); // UR tri
+			end();
+		}
+
+	public:
+		Building(int height, AtlasRect_t *side, AtlasRect_t *top, float lights = 0) : m_height(height), m_lights(lights), m_side_rect(side), m_top_rect(top), m_rect(side), m_mesh(NULL) {
+			// geometry data
+			m_verts[0] = Point3D_t(-1, -1, 1);
+			m_verts[1] = Point3D_t( 1, -1, 1);
+			m_verts[2] = Point3D_t( 1,  1*m_height,  1);
+			m_verts[3] = Point3D_t(-1,  1*m_height,	 1);
+			m_verts[4] = Point3D_t(-1,  1*m_height, -1);
+			m_verts[5] = Point3D_t( 1,  1*m_height, -1);
+			m_verts[6] = Point3D_t(-1, -1, -1);
+			m_verts[7] = Point3D_t( 1, -1, -1);
+
+			m_texcoords[0] = Point2D_t(0, 0);
+			m_texcoords[1] = Point2D_t(1, 0);
+			m_texcoords[2] = Point2D_t(1, 1);
+			m_texcoords[3] = Point2D_t(0, 1);
+		}
+
+		void emit(MeshBuilder &mesh) {
+			// we need to emit exactly 36 verts for 12 tris for 6 faces for one rectangular prism.
+			m_mesh = &mesh;
+
+			// everything is in the atlas, so one texture state for the whole building
+			m_mesh->tex(TEX_ATLAS);
+			m_rect = m_side_rect;
+			emit_front();
+			emit_back();
+			emit_left();
+			emit_right();
+			m_rect = m_top_rect;
+			emit_up();
+			emit_down(); // can't see this texture anyways
+		}
+};
+
+class Car_Block {
+	private:
+		int m_height;
+		float color_r, color_g, color_b;
+		MeshBuilder *m_mesh;
+		uint32_t m_first;
+
+		Point3D_t m_verts[8];
+		Point2D_t m_texcoords[4];
+
+		// the face's normal is already set, every corner of a face gets the same one
+		void vert(int n) {
+			Point3D_t vertex = m_verts[n - 1];
+			m_mesh->vertex(vertex.x, vertex.y, vertex.z);
+		}
+
+		void texcoord(int n) {
+			Point2D_t vertex = m_texcoords[n - 1];
+			m_mesh->texcoord(vertex.x, vertex.y);
+		}
+
+		void begin() {
+			m_first = m_mesh->vertices.size();
+		}
+
+		void end() {
+			m_mesh->close_triangles(m_first);
+		}
+
+		// one private method per face, 6 faces here.
+
+		void emit_front() {
+			// front face
+			begin();
+				m_mesh->color(color_r, color_g, color_b);
+				m_mesh->normal(0, 0, 1);
+				texcoord(4); vert(4);    texcoord(1); vert(1);    texcoord(2); vert(2); // LL tri
+				texcoord(4); vert(4);    texcoord(2); vert(2);    texcoord(3); vert(3); // UR tri
+			end();
+		}
+
+		void emit_back() {
+			// back face
+			begin();
+				m_mesh->color(color_r, color_g, color_b);
+				m_mesh->normal(0, 0, -1);
+				texcoord(4); vert(5);    texcoord(1); vert(7);    texcoord(2); vert(8); // LL tri
+				texcoord(4); vert(5);    texcoord(2); vert(8);    texcoord(3); vert(6); // UR tri
+			end();
+		}
+
+		void emit_left() {
+			// left face
+			begin();
+				m_mesh->color(color_r, color_g, color_b);
+				m_mesh->normal(-1, 0, 0);
+				texcoord(4); vert(5);    texcoord(1); vert(7);    texcoord(2); vert(1); // LL tri
+				texcoord(4); vert(5);    texcoord(2); vert(1);    texcoord(3); vert(4); // UR tri
+			end();
+		}
+
+		void emit_right() {
+			// right face
+			begin();
+				m_mesh->color(color_r, color_g, color_b);
+				m_mesh->normal(1, 0, 0);
+				texcoord(4); vert(3);    texcoord(1); vert(2);    texcoord(2); vert(8); // LL tri
+				texcoord(4); vert(3);    texcoord(2); vert(8);    texcoord(3); vert(6); // UR tri
+			end();
+		}
+
+		void emit_up() {
+			// up face
+			begin();
+				m_mesh->color(color_r, color_g, color_b);
+				m_mesh->normal(0, 1, 0);
+				texcoord(4); vert(5);    texcoord(1); vert(4);    texcoord(2); vert(3); // LL tri
+				texcoord(4); vert(5);    texcoord(2); vert(3);    texcoord(3); vert(6); // UR tri
+			end();
+		}
+
+		void emit_down() {
+			// down face
+			begin();
+				m_mesh->color(color_r, color_g, color_b);
+				m_mesh->normal(0, -1, 0);
+				texcoord(4); vert(1);    texcoord(1); vert(7);    texcoord(2); vert(8); // LL tri
+				texcoord(4); vert(1);    texcoord(2); vert(8);    texcoord(3); vert(2); // UR tri
+			end();
+		}
+
+	public:
+		Car_Block(int height, float r, float g, float b) : m_height(height), color_r(r), color_g(g), color_b(b), m_mesh(NULL) {
+			// geometry data
+			m_verts[0] = Point3D_t(-1, -1, 1);
+			m_verts[1] = Point3D_t( 1, -1, 1);
+			m_verts[2] = Point3D_t( 1,  1*m_height,  1);
+			m_verts[3] = Point3D_t(-1,  1*m_height,	 1);
+			m_verts[4] = Point3D_t(-1,  1*m_height, -1);
+			m_verts[5] = Point3D_t( 1,  1*m_height, -1);
+			m_verts[6] = Point3D_t(-1, -1, -1);
+			m_verts[7] = Point3D_t( 1, -1, -1);
+
+			m_texcoords[0] = Point2D_t(0, 0);
+			m_texcoords[1] = Point2D_t(1, 0);
+			m_texcoords[2] = Point2D_t(1, 1);
+			m_texcoords[3] = Point2D_t(0, 1);
+		}
+
+		void emit(MeshBuilder &mesh) {
+			// we need to emit exactly 36 verts for 12 tris for 6 faces for one rectangular prism.
+			m_mesh = &mesh;
+
+			m_mesh->tex(TEX_NONE);
+			emit_front();
+			emit_back();
+			emit_left();
+			emit_right();
+			emit_up();
+			emit_down(); // can't see this texture anyways
+		}
+};
+
+#endif
@@ -0,0 +1,150 @@
+// render_queue.h - the main pass's draws, sorted by the state they need
+//
+// submit() a draw with the program, vertex array, texture and instances it needs and a
+// sort key from render_key(), then flush() sorts them and draws them in that order. The
+// key puts the program first (the dearest switch), then the texture, then the material
+// (which instances it reads), then the depth, so draws sharing state end up next to each
+// other, and within that the nearest go first and hide what's behind them.
+//
+// RenderState sits between the draws and GL. It knows what's bound and skips any call that
+// binds the same thing again, and counts the calls that do change something. Everything
+// that binds a program, vertex array or texture during a frame should go through it, and
+// anything that binds one behind its back (setup, a shader reload) calls invalidate().
+
+#ifndef RENDER_QUEUE_H
+#define RENDER_QUEUE_H
+
+#ifdef __APPLE__
+#include <OpenGL/gl3.h>
+#else
+#include <GL/glew.h>
+#include <GL/gl.h>
+#endif
+
+#include <vector>
+#include <algorithm>
+
+#include <stdint.h>
+#include <string.h>
+
+#define RENDER_TEXTURE_UNITS 8 // units RenderState keeps track of, the ones past it aren't filtered
+#define RENDER_NO_INSTANCES 0xffffffffu // the instance_base of a draw that doesn't read the instance attributes
+
+// what an item draws
+#define RENDER_ELEMENTS 0 // glDrawElementsInstanced, first and count are indices
+#define RENDER_INDIRECT 1 // glMultiDrawElementsIndirect out of the bound GL_DRAW_INDIRECT_BUFFER, first and count are commands
+#define RENDER_COMMAND_SIZE (5 * sizeof(GLuint)) // a DrawElementsIndirectCommand
+
+// program in the top 8 bits, texture in the next 16, material in 8, and the depth's float bits
+// at the bottom (in order for anything not negative). program, texture and material are the
+// caller's own small numbers, in the order it wants them drawn
+inline uint64_t render_key(unsigned int program, unsigned int texture, unsigned int material, float depth) {
+	uint32_t bits = 0;
+	if (depth > 0) memcpy(&bits, &depth, sizeof(bits));
+	return ((uint64_t) (program & 0xff) << 56) | ((uint64_t) (texture & 0xffff) << 40) | ((uint64_t) (material & 0xff) << 32) | bits;
+}
+
+typedef struct RenderItem_struct {
+	uint64_t key; // render_key()
+	GLuint program, vao;
+	GLuint texture_unit, texture; // a GL_TEXTURE_2D it needs on texture_unit, texture 0 for none
+	int kind; // RENDER_*
+	GLuint first, count;
+	GLuint instances; // RENDER_ELEMENTS only
+	GLuint instance_base; // where the instance attributes start, or RENDER_NO_INSTANCES
+} RenderItem_t;
+
+class RenderState {
+	private:
+		GLuint m_program, m_vao;
+		GLuint m_textures[RENDER_TEXTURE_UNITS];
+		GLuint m_instance_base; // RENDER_NO_INSTANCES when it isn't known
+		void (*m_bind_instances)(GLuint base);
+		unsigned int m_changes;
+
+	public:
+		// bind_instances points the instance attributes of the bound vertex array at base onwards.
+		// only one vertex array has instance attributes, every item with instances uses it
+		RenderState(void (*bind_instances)(GLuint base)) : m_bind_instances(bind_instances), m_changes(0) {
+			invalidate();
+		}
+
+		// forget what's bound, the next of each gets bound whatever it is
+		void invalidate() {
+			m_program = m_vao = 0xffffffffu;
+			for (int u = 0; u < RENDER_TEXTURE_UNITS; u++) m_textures[u] = 0xffffffffu;
+			m_instance_base = RENDER_NO_INSTANCES;
+		}
+
+		void use_program(GLuint program) {
+			if (program == m_program) return;
+			glUseProgram(m_program = program);
+			m_changes++;
+		}
+
+		void bind_vertex_array(GLuint vao) {
+			if (vao == m_vao) return;
+			glBindVertexArray(m_vao = vao);
+			m_changes++;
+		}
+
+		// leaves unit 0 active, like everything else does
+		void bind_texture(GLuint unit, GLenum target, GLuint texture) {
+			if (unit < RENDER_TEXTURE_UNITS && texture == m_textures[unit]) return;
+			if (unit < RENDER_TEXTURE_UNITS) m_textures[unit] = texture;
+			if (unit != 0) glActiveTexture(GL_TEXTURE0 + unit);
+			glBindTexture(target, texture);
+			if (unit != 0) glActiveTexture(GL_TEXTURE0);
+			m_changes++;
+		}
+
+		void bind_instances(GLuint base) {
+			if (base == m_instance_base) return;
+			m_bind_instances(m_instance_base = base);
+			m_changes++;
+		}
+
+		// binds that changed something since the last reset_changes()
+		unsigned int changes() { return m_changes; }
+		void reset_changes() { m_changes = 0; }
+};
+
+class RenderQueue {
+	private:
+		std::vector<RenderItem_t> m_items;
+
+		static bool before(const RenderItem_t &a, const RenderItem_t &b) {
+			return a.key < b.key;
+		}
+
+	public:
+		void submit(const RenderItem_t &item) {
+			m_items.push_back(item);
+		}
+
+		// draws everything submitted since the last flush, returns the draw calls
+		unsigned int flush(RenderState &state) {
+			// equal keys keep the order they came in
+			std::stable_sort(m_items.begin(), m_items.end(), before);
+			unsigned int draws = 0;
+			for (size_t i = 0; i < m_items.size(); i++) {
+				const RenderItem_t &item = m_items[i];
+				state.use_program(item.program);
+				state.bind_vertex_array(item.vao);
+				if (item.texture != 0) state.bind_texture(item.texture_unit, GL_TEXTURE_2D, item.texture);
+				if (item.instance_base != RENDER_NO_INSTANCES) state.bind_instances(item.instance_base);
+
+				if (item.kind == RENDER_ELEMENTS) {
+					glDrawElementsInstanced(GL_TRIANGLES, item.count, GL_UNSIGNED_INT, (void*) (item.first * sizeof(uint32_t)), item.instances);
+				}
+				#ifndef __APPLE__
+				else glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, (void*) (item.first * RENDER_COMMAND_SIZE), item.count, 0);
+				#endif
+				draws++;
+			}
+			m_items.clear();
+			return draws;
+		}
+};
+
+#endif
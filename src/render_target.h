@@ -0,0 +1,201 @@
+// render_target.h - the scene drawn offscreen, multisampled, at a resolution that holds a frame time
+//
+// The frame goes into a framebuffer the size of the window (multisampled when there are
+// samples), but only into the bottom left scale() of it, and end() resolves and stretches
+// that part over the window. GL_TIME_ELAPSED queries time everything between begin() and
+// end() on the gpu, read back RESOLUTION_QUERIES frames later so nothing waits on them.
+// Over the target frame time the scale drops towards where it should be (the cost goes
+// with the pixels), a few steps at a time, and well under it the scale creeps back up a
+// step at a time. After a change it waits RESOLUTION_SETTLE frames, and only trusts
+// timings taken at the new scale, so it doesn't hunt.
+//
+// With no samples and no target it's not there at all: begin() clears the window and
+// everything draws straight into it, like before.
+//
+// setup() once there's a context, resize() with the window, then each frame begin(),
+// draw (binding framebuffer() again after drawing anywhere else) and end().
+
+#ifndef RENDER_TARGET_H
+#define RENDER_TARGET_H
+
+#ifdef __APPLE__
+#include <OpenGL/gl3.h>
+#else
+#include <GL/glew.h>
+#include <GL/gl.h>
+#endif
+
+#include <math.h>
+
+#define RESOLUTION_STEPS 20 // a step is 1 / this of the window's width and height
+#define RESOLUTION_MIN_STEPS 10 // never less than half
+#define RESOLUTION_MAX_DROP 3 // steps at once, so one slow frame can't take it all the way down
+#define RESOLUTION_HEADROOM 0.8 // step back up under this much of the target
+#define RESOLUTION_SMOOTHING 0.25 // of each new timing that goes into the average
+#define RESOLUTION_SETTLE 8 // frames after a change before the next
+#define RESOLUTION_QUERIES 4 // timer queries in flight, each read back this many frames later
+
+class RenderTarget {
+	private:
+		bool m_enabled;
+		int m_samples;
+		double m_target_ms; // 0 keeps the whole window
+		GLuint m_fbo, m_color, m_depth; // what the scene draws into
+		GLuint m_resolve_fbo, m_resolve; // multisampled only, the samples resolved before they're stretched
+		int m_window_width, m_window_height;
+
+		int m_steps; // the scale in RESOLUTION_STEPS
+		double m_ms; // gpu frame time, averaged
+		bool m_have_ms;
+		int m_settle;
+		GLuint m_queries[RESOLUTION_QUERIES];
+		int m_query_steps[RESOLUTION_QUERIES]; // the scale each one timed
+		unsigned int m_frame;
+
+		static void storage(GLuint renderbuffer, int samples, GLenum format, int width, int height) {
+			glBindRenderbuffer(GL_RENDERBUFFER, renderbuffer);
+			if (samples > 0) glRenderbufferStorageMultisample(GL_RENDERBUFFER, samples, format, width, height);
+			else glRenderbufferStorage(GL_RENDERBUFFER, format, width, height);
+		}
+
+		void measured(double ms) {
+			m_ms = m_have_ms ? m_ms + (ms - m_ms) * RESOLUTION_SMOOTHING : ms;
+			m_have_ms = true;
+			if (m_settle > 0) {
+				m_settle--;
+				return;
+			}
+
+			int steps = m_steps;
+			if (m_ms > m_target_ms) {
+				steps = (int) floor(m_steps * sqrt(m_target_ms / m_ms));
+				steps = steps >= m_steps ? m_steps - 1 : (steps < m_steps - RESOLUTION_MAX_DROP ? m_steps - RESOLUTION_MAX_DROP : steps);
+			} else if (m_ms < m_target_ms * RESOLUTION_HEADROOM) steps = m_steps + 1;
+			steps = steps < RESOLUTION_MIN_STEPS ? RESOLUTION_MIN_STEPS : (steps > RESOLUTION_STEPS ? RESOLUTION_STEPS : steps);
+			if (steps == m_steps) return;
+			m_steps = steps;
+			m_have_ms = false;
+			m_settle = RESOLUTION_SETTLE;
+		}
+
+	public:
+		RenderTarget() : m_enabled(false), m_samples(0), m_target_ms(0), m_fbo(0), m_color(0), m_depth(0), m_resolve_fbo(0), m_resolve(0),
+			m_window_width(1), m_window_height(1), m_steps(RESOLUTION_STEPS), m_ms(0), m_have_ms(false), m_settle(0), m_frame(0) {}
+
+		// samples per pixel (0 for none) and the gpu frame time to hold (0 to always draw the whole window).
+		// false if the driver can't render to it, then everything goes straight to the window
+		bool setup(int samples, double target_ms, int width, int height) {
+			GLint max_samples = 0;
+			glGetIntegerv(GL_MAX_SAMPLES, &max_samples);
+			m_samples = samples < max_samples ? samples : max_samples;
+			m_target_ms = target_ms;
+			m_enabled = m_samples > 0 || m_target_ms > 0;
+			if (!m_enabled) {
+				m_window_width = width;
+				m_window_height = height;
+				return true;
+			}
+
+			glGenFramebuffers(1, &m_fbo);
+			glGenRenderbuffers(1, &m_color);
+			glGenRenderbuffers(1, &m_depth);
+			if (m_samples > 0) {
+				glGenFramebuffers(1, &m_resolve_fbo);
+				glGenRenderbuffers(1, &m_resolve);
+			}
+			if (m_target_ms > 0) glGenQueries(RESOLUTION_QUERIES, m_queries);
+			return resize(width, height);
+		}
+
+		// the window's size, the framebuffers always match it
+		bool resize(int width, int height) {
+			m_window_width = width;
+			m_window_height = height;
+			if (!m_enabled) return true;
+
+			storage(m_color, m_samples, GL_RGBA8, width, height);
+			storage(m_depth, m_samples, GL_DEPTH_COMPONENT24, width, height);
+			glBindFramebuffer(GL_FRAMEBUFFER, m_fbo);
+			glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, m_color);
+			glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, m_depth);
+			bool complete = glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+			if (m_samples > 0) {
+				storage(m_resolve, 0, GL_RGBA8, width, height);
+				glBindFramebuffer(GL_FRAMEBUFFER, m_resolve_fbo);
+				glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, m_resolve);
+				complete = complete && glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+			}
+			glBindFramebuffer(GL_FRAMEBUFFER, 0);
+			glBindRenderbuffer(GL_RENDERBUFFER, 0);
+			if (!complete) {
+				m_enabled = false;
+				m_steps = RESOLUTION_STEPS;
+			}
+			return complete;
+		}
+
+		// binds the target at this frame's scale and clears it
+		void begin() {
+			if (m_enabled && m_target_ms > 0) {
+				// the query in this slot is RESOLUTION_QUERIES frames old and long done
+				unsigned int slot = m_frame % RESOLUTION_QUERIES;
+				if (m_frame >= RESOLUTION_QUERIES) {
+					GLuint64 ns = 0;
+					glGetQueryObjectui64v(m_queries[slot], GL_QUERY_RESULT, &ns);
+					if (m_query_steps[slot] == m_steps) measured(ns / 1e6);
+				}
+				m_query_steps[slot] = m_steps;
+				glBeginQuery(GL_TIME_ELAPSED, m_queries[slot]);
+			}
+			glBindFramebuffer(GL_FRAMEBUFFER, framebuffer());
+			glViewport(0, 0, width(), height());
+			glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+		}
+
+		// resolves and stretches the frame over the window, and leaves the window bound
+		void end() {
+			if (!m_enabled) return;
+			int w = width(), h = height();
+			bool scaled = w != m_window_width || h != m_window_height;
+			glBindFramebuffer(GL_READ_FRAMEBUFFER, m_fbo);
+			if (m_samples > 0) {
+				// a multisampled blit can't change the size or the format, resolve as is first
+				glBindFramebuffer(GL_DRAW_FRAMEBUFFER, m_resolve_fbo);
+				glBlitFramebuffer(0, 0, w, h, 0, 0, w, h, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+				glBindFramebuffer(GL_READ_FRAMEBUFFER, m_resolve_fbo);
+			}
+			glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+			glBlitFramebuffer(0, 0, w, h, 0, 0, m_window_width, m_window_height, GL_COLOR_BUFFER_BIT, scaled ? GL_LINEAR : GL_NEAREST);
+			glBindFramebuffer(GL_FRAMEBUFFER, 0);
+			glViewport(0, 0, m_window_width, m_window_height);
+
+			if (m_target_ms > 0) glEndQuery(GL_TIME_ELAPSED);
+			m_frame++;
+		}
+
+		// what the scene draws into, 0 is the window
+		GLuint framebuffer() {
+			return m_enabled ? m_fbo : 0;
+		}
+
+		// the size the scene is drawn at
+		int width() {
+			int w = m_window_width * m_steps / RESOLUTION_STEPS;
+			return w > 0 ? w : 1;
+		}
+
+		int height() {
+			int h = m_window_height * m_steps / RESOLUTION_STEPS;
+			return h > 0 ? h : 1;
+		}
+
+		float scale() {
+			return (float) m_steps / RESOLUTION_STEPS;
+		}
+
+		int samples() {
+			return m_samples;
+		}
+};
+
+#endif
@@ -0,0 +1,192 @@
+// replay.h - records the input that drives a run so the run can be played back
+//
+// Everything that changes what a frame looks like is either the seed (city layout
+// and traffic, see sim_rand() in sim.h) or an input event, so the file is just the
+// seed and start state followed by the events in the order display_handler() saw
+// them:
+//
+//   "TTRP" version seed cars width height    little endian uint32s
+//   REPLAY_KEY key                           keyboard_handler() key
+//   REPLAY_SPECIAL key                       keyboard_special_handler() key
+//   REPLAY_RESHAPE width height              window resized
+//   REPLAY_FRAME ms                          end of a frame, one sim tick, ms since the last one
+//
+// Numbers after the event byte are LEB128 varints, so a frame with no input is two
+// bytes. No GL in here, sim_bench reads the same files.
+
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include <vector>
+
+#include <stdio.h>
+#include <limits.h>
+#include <stdint.h>
+#include <string.h>
+
+#define REPLAY_VERSION 1
+
+enum { REPLAY_KEY = 1, REPLAY_SPECIAL, REPLAY_RESHAPE, REPLAY_FRAME };
+
+typedef struct ReplayHeader_struct {
+	uint32_t version;
+	uint32_t seed;
+	uint32_t cars;
+	uint32_t width, height; // window at the start
+} ReplayHeader_t;
+
+typedef struct ReplayEvent_struct {
+	int type;
+	uint32_t a, b; // key, or width and height, or ms
+} ReplayEvent_t;
+
+class ReplayWriter {
+	private:
+		FILE *m_file;
+
+		void put_u32(uint32_t value) {
+			uint8_t bytes[4] = { (uint8_t) value, (uint8_t) (value >> 8), (uint8_t) (value >> 16), (uint8_t) (value >> 24) };
+			fwrite(bytes, 1, 4, m_file);
+		}
+
+		void put_varint(uint32_t value) {
+			while (value >= 0x80) {
+				fputc((value & 0x7F) | 0x80, m_file);
+				value >>= 7;
+			}
+			fputc(value, m_file);
+		}
+
+	public:
+		ReplayWriter() : m_file(NULL) {}
+		~ReplayWriter() { close(); }
+
+		bool open(const char *filename, const ReplayHeader_t &header) {
+			m_file = fopen(filename, "wb");
+			if (m_file == NULL) return false;
+			fwrite("TTRP", 1, 4, m_file);
+			put_u32(REPLAY_VERSION);
+			put_u32(header.seed);
+			put_u32(header.cars);
+			put_u32(header.width);
+			put_u32(header.height);
+			return true;
+		}
+
+		void key(unsigned char key) {
+			if (m_file == NULL) return;
+			fputc(REPLAY_KEY, m_file);
+			put_varint(key);
+		}
+
+		void special(int key) {
+			if (m_file == NULL) return;
+			fputc(REPLAY_SPECIAL, m_file);
+			put_varint(key);
+		}
+
+		void reshape(int width, int height) {
+			if (m_file == NULL) return;
+			fputc(REPLAY_RESHAPE, m_file);
+			put_varint(width);
+			put_varint(height);
+		}
+
+		void frame(uint32_t ms) {
+			if (m_file == NULL) return;
+			fputc(REPLAY_FRAME, m_file);
+			put_varint(ms);
+		}
+
+		void close() {
+			if (m_file != NULL) fclose(m_file);
+			m_file = NULL;
+		}
+
+		bool active() {
+			return m_file != NULL;
+		}
+};
+
+class ReplayReader {
+	private:
+		std::vector<uint8_t> m_data; // the whole file, they're small
+		size_t m_pos;
+		ReplayHeader_t m_header;
+
+		uint32_t get_u32(size_t at) {
+			return m_data[at] | (m_data[at + 1] << 8) | (m_data[at + 2] << 16) | ((uint32_t) m_data[at + 3] << 24);
+		}
+
+		bool get_varint(uint32_t &value) {
+			value = 0;
+			for (int shift = 0; shift < 35 && m_pos < m_data.size(); shift += 7) {
+				uint8_t byte = m_data[m_pos++];
+				value |= (uint32_t) (byte & 0x7F) << shift;
+				if ((byte & 0x80) == 0) return true;
+			}
+			return false;
+		}
+
+	public:
+		ReplayReader() : m_pos(0) {
+			memset(&m_header, 0, sizeof(m_header));
+		}
+
+		// false if it can't be read, isn't a replay this version understands, or starts from
+		// something a run can't (no cars, more than -cars takes, or an empty window)
+		bool open(const char *filename) {
+			FILE *file = fopen(filename, "rb");
+			if (file == NULL) return false;
+			uint8_t buffer[4096];
+			size_t got;
+			m_data.clear();
+			while ((got = fread(buffer, 1, sizeof(buffer), file)) > 0) m_data.insert(m_data.end(), buffer, buffer + got);
+			fclose(file);
+
+			if (m_data.size() < 24 || memcmp(&m_data[0], "TTRP", 4) != 0) return false;
+			m_header.version = get_u32(4);
+			m_header.seed = get_u32(8);
+			m_header.cars = get_u32(12);
+			m_header.width = get_u32(16);
+			m_header.height = get_u32(20);
+			m_pos = 24;
+			if (m_header.cars == 0 || m_header.cars > INT_MAX) return false;
+			if (m_header.width == 0 || m_header.height == 0 || m_header.width > INT_MAX || m_header.height > INT_MAX) return false;
+			return m_header.version == REPLAY_VERSION;
+		}
+
+		const ReplayHeader_t &header() {
+			return m_header;
+		}
+
+		// false at the end of the file (or a truncated event)
+		bool next(ReplayEvent_t &event) {
+			if (m_pos >= m_data.size()) return false;
+			event.type = m_data[m_pos++];
+			event.a = event.b = 0;
+			switch (event.type) {
+				case REPLAY_KEY:
+				case REPLAY_SPECIAL:
+				case REPLAY_FRAME:
+					return get_varint(event.a);
+				case REPLAY_RESHAPE:
+					return get_varint(event.a) && get_varint(event.b);
+				default:
+					return false;
+			}
+		}
+
+		// frame count, for sim_bench and progress reports. doesn't move the read position
+		unsigned int frames() {
+			size_t saved = m_pos;
+			m_pos = 24;
+			unsigned int count = 0;
+			ReplayEvent_t event;
+			while (next(event)) if (event.type == REPLAY_FRAME) count++;
+			m_pos = saved;
+			return count;
+		}
+};
+
+#endif
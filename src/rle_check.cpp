@@ -0,0 +1,249 @@
+// rle_check.cpp - checks the RLE8 / RLE4 decoders against the old ifstream loop
+//
+// usage: rle_check [files] [seed]
+//
+// Writes a seeded corpus of well formed RLE8 and RLE4 bitmaps (encoded runs, absolute
+// runs of odd and even lengths, deltas, early end of bitmap markers, and some large
+// enough to take the streaming reader through several window refills), decodes each
+// with CBitmap::Load and with CBitmapReader::ReadRows in random sized blocks, and
+// compares both against reference_rle_decode below. Returns non-zero on any mismatch.
+
+#include <vector>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bitmap.h"
+
+using namespace std;
+
+#define CHECK_FILE "rle_check.bmp"
+
+static uint32_t rng_state;
+
+// xorshift32, so the corpus is the same on every platform
+static uint32_t rng() {
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 17;
+	rng_state ^= rng_state << 5;
+	return rng_state;
+}
+
+static unsigned int rng(unsigned int lo, unsigned int hi) {
+	return lo + rng() % (hi - lo + 1);
+}
+
+/* the RLE 8 loop CBitmap::Load used before it decoded from memory, reading the file opcode by opcode.
+ * it never did RLE 4, that part follows the nibble order of the old CBitmapReader::SetPixel */
+static void reference_rle_decode(istream &file, bool rle4, const BGRA *color_table, RGBA *data, unsigned int width) {
+	uint8_t count = 0;
+	uint8_t color_index = 0;
+	int x = 0, y = 0;
+
+	while (file.eof() == false) {
+		file.read((char*) &count, sizeof(uint8_t));
+		file.read((char*) &color_index, sizeof(uint8_t));
+
+		if (count > 0) {
+			int index = x + y * width;
+			for (int k = 0; k < count; k++) {
+				unsigned int c = rle4 ? ((k & 1) ? color_index & 0x0f : color_index >> 4) : color_index;
+				data[index + k].Red = color_table[c].Red;
+				data[index + k].Green = color_table[c].Green;
+				data[index + k].Blue = color_table[c].Blue;
+				data[index + k].Alpha = color_table[c].Alpha;
+			}
+			x += count;
+		} else if (count == 0) {
+			int flag = color_index;
+			if (flag == 0) {
+				x = 0;
+				y++;
+			} else if (flag == 1) {
+				break;
+			} else if (flag == 2) {
+				char rx = 0;
+				char ry = 0;
+				file.read((char*) &rx, sizeof(char));
+				file.read((char*) &ry, sizeof(char));
+				x += rx;
+				y += ry;
+			} else {
+				count = flag;
+				int index = x + y * width;
+				uint8_t pair = 0;
+				for (int k = 0; k < count; k++) {
+					unsigned int c;
+					if (rle4) {
+						if ((k & 1) == 0) file.read((char*) &pair, sizeof(uint8_t));
+						c = (k & 1) ? pair & 0x0f : pair >> 4;
+					} else {
+						file.read((char*) &color_index, sizeof(uint8_t));
+						c = color_index;
+					}
+					data[index + k].Red = color_table[c].Red;
+					data[index + k].Green = color_table[c].Green;
+					data[index + k].Blue = color_table[c].Blue;
+					data[index + k].Alpha = color_table[c].Alpha;
+				}
+				x += count;
+				if (file.tellg() & 1) {
+					file.seekg(1, std::ios::cur);
+				}
+			}
+		}
+	}
+}
+
+/* one row's opcodes, staying inside the row. returns false when it ended the bitmap early */
+static bool encode_row(vector<uint8_t> &data, bool rle4, unsigned int width, unsigned int colors, unsigned int &x, unsigned int &rows_left) {
+	while (x < width) {
+		unsigned int left = width - x;
+		unsigned int op = rng(0, 99);
+		if (op < 55) {
+			// encoded run, in RLE 4 often of two alternating colors
+			unsigned int run = rng(1, left < 255 ? left : 255);
+			unsigned int value = rng(0, colors - 1);
+			if (rle4) value = (value << 4) | (rng(0, 2) ? value : rng(0, colors - 1));
+			data.push_back(run);
+			data.push_back(value);
+			x += run;
+		} else if (op < 92 && left >= 3) {
+			// absolute run, padded to 16 bit
+			unsigned int run = rng(3, left < 255 ? left : 255);
+			data.push_back(0);
+			data.push_back(run);
+			unsigned int bytes = rle4 ? (run + 1) / 2 : run;
+			for (unsigned int b = 0; b < bytes; b++) {
+				data.push_back(rle4 ? (rng(0, colors - 1) << 4) | rng(0, colors - 1) : rng(0, colors - 1));
+			}
+			if (bytes & 1) data.push_back(0);
+			x += run;
+		} else if (op < 97) {
+			// delta, right and maybe down
+			unsigned int dx = rng(0, left < 20 ? left : 20);
+			unsigned int dy = rows_left > 0 ? rng(0, rows_left < 3 ? rows_left : 3) : 0;
+			data.push_back(0);
+			data.push_back(2);
+			data.push_back(dx);
+			data.push_back(dy);
+			x += dx;
+			rows_left -= dy;
+		} else if (op == 99 && rng(0, 19) == 0) {
+			return false;
+		} else {
+			// leave the rest of the row
+			break;
+		}
+	}
+	return true;
+}
+
+static bool write_rle(const char *filename, bool rle4, unsigned int width, unsigned int height, vector<BGRA> &palette) {
+	unsigned int colors = rle4 ? 16 : 256;
+	palette.resize(colors);
+	for (unsigned int i = 0; i < colors; i++) {
+		uint32_t c = rng();
+		memcpy(&palette[i], &c, sizeof(BGRA));
+	}
+
+	vector<uint8_t> data;
+	unsigned int rows_left = height - 1;
+	for (unsigned int y = 0; y < height; ) {
+		unsigned int x = 0, before = rows_left;
+		if (!encode_row(data, rle4, width, colors, x, rows_left)) break;
+		y += before - rows_left; // rows a delta skipped
+		if (y >= height - 1) break;
+		data.push_back(0); // end of line
+		data.push_back(0);
+		rows_left--;
+		y++;
+	}
+	data.push_back(0); // end of bitmap
+	data.push_back(1);
+
+	BITMAP_FILEHEADER bfh;
+	BITMAP_HEADER bh;
+	memset(&bfh, 0, sizeof(bfh));
+	memset(&bh, 0, sizeof(bh));
+	bfh.Signature = BITMAP_SIGNATURE;
+	bfh.BitsOffset = BITMAP_FILEHEADER_SIZE + sizeof(BITMAP_HEADER) + colors * sizeof(BGRA);
+	bfh.Size = bfh.BitsOffset + data.size();
+	bh.HeaderSize = sizeof(BITMAP_HEADER);
+	bh.Width = width;
+	bh.Height = height;
+	bh.Planes = 1;
+	bh.BitCount = rle4 ? 4 : 8;
+	bh.Compression = rle4 ? 2 : 1;
+	bh.SizeImage = data.size();
+	bh.ClrUsed = colors;
+
+	ofstream out(filename, ios::binary);
+	out.write((const char*) &bfh, BITMAP_FILEHEADER_SIZE);
+	out.write((const char*) &bh, sizeof(BITMAP_HEADER));
+	out.write((const char*) &palette[0], colors * sizeof(BGRA));
+	out.write((const char*) &data[0], data.size());
+	return out.good();
+}
+
+int main(int argc, char **argv) {
+	unsigned int files = argc >= 2 ? atoi(argv[1]) : 2000;
+	rng_state = argc >= 3 ? atoi(argv[2]) : 1;
+	if (files == 0 || rng_state == 0) {
+		cout << "usage: rle_check [files] [seed]" << endl;
+		return 1;
+	}
+
+	unsigned int failed = 0;
+	for (unsigned int n = 0; n < files; n++) {
+		bool rle4 = n & 1;
+		// every 50th big enough to go through several of the reader's 64k windows
+		bool big = n % 50 < 2;
+		unsigned int width = big ? rng(1500, 2500) : rng(1, 300);
+		unsigned int height = big ? rng(100, 200) : rng(1, 64);
+
+		vector<BGRA> palette;
+		if (!write_rle(CHECK_FILE, rle4, width, height, palette)) {
+			cout << "Could not write " << CHECK_FILE << endl;
+			return 1;
+		}
+
+		vector<RGBA> expected(width * height);
+		memset(&expected[0], 0, expected.size() * sizeof(RGBA));
+		ifstream file(CHECK_FILE, ios::binary);
+		BITMAP_FILEHEADER bfh;
+		file.read((char*) &bfh, BITMAP_FILEHEADER_SIZE);
+		file.seekg(bfh.BitsOffset, ios::beg);
+		reference_rle_decode(file, rle4, &palette[0], &expected[0], width);
+
+		CBitmap image;
+		if (!image.Load(CHECK_FILE) || image.GetWidth() != width || image.GetHeight() != height ||
+			memcmp(image.GetBits(), &expected[0], expected.size() * sizeof(RGBA)) != 0) {
+			cout << "file " << n << " (" << (rle4 ? "RLE4 " : "RLE8 ") << width << "x" << height << "): CBitmap::Load doesn't match the reference" << endl;
+			failed++;
+			continue;
+		}
+
+		CBitmapReader reader;
+		vector<RGBA> rows(width * height);
+		bool ok = reader.Open(CHECK_FILE);
+		for (unsigned int row = 0; ok && row < height; ) {
+			unsigned int got = reader.ReadRows(&rows[row * width], rng(1, 7));
+			ok = got > 0;
+			row += got;
+		}
+		if (!ok || memcmp(&rows[0], &expected[0], expected.size() * sizeof(RGBA)) != 0) {
+			cout << "file " << n << " (" << (rle4 ? "RLE4 " : "RLE8 ") << width << "x" << height << "): CBitmapReader::ReadRows doesn't match the reference" << endl;
+			failed++;
+		}
+	}
+	remove(CHECK_FILE);
+
+	cout << files << " RLE files, " << failed << " mismatches" << endl;
+	return failed == 0 ? 0 : 1;
+}
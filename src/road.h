@@ -0,0 +1,91 @@
+// road.h - the ground, the lots and the road markings for the whole block grid at once
+//
+// None of it depends on what's built on a block, only on the grid (blocks_x by blocks_y
+// blocks, block_size apart, the corner of block (0, 0) at the origin and the city off
+// towards -z), so it's made in one go instead of a block at a time.
+//
+// The dashed center lines are one quad per grid line, not six vertices a dash. frag.glsl's
+// ROAD_MARKINGS variant paints the dashes: u counts dash periods along the line and v is
+// how much of a period is painted, everything past it is discarded. The dashes start
+// ROAD_DASH_OFFSET into every block, which holds along a whole line as long as block_size
+// is a whole number of ROAD_DASH_PERIODs.
+//
+// No GL in here.
+
+#ifndef ROAD_H
+#define ROAD_H
+
+#include <math.h>
+#include <stdint.h>
+
+#include "mesh.h"
+
+#define ROAD_DASH 2.0 // painted, out of every
+#define ROAD_DASH_PERIOD 6.0
+#define ROAD_DASH_OFFSET 2.0 // from a corner to the first dash
+#define ROAD_LINE_WIDTH 0.5 // both sides of the center, half of it on each block
+#define ROAD_HEIGHT 0.1 // the lots and the markings over the ground
+#define GROUND_MARGIN 5.0 // ground past the city's edge
+#define LOT_INSET 5.0 // from a block's edge to its lot
+
+// a flat quad over x0..x1, z0..z1 at height y, a dash starting at x0 (u_along_x) or z0 (otherwise)
+inline void road_line(MeshBuilder &mesh, float x0, float x1, float z0, float z1, float y, bool u_along_x) {
+	float v = ROAD_DASH / ROAD_DASH_PERIOD;
+	float u0 = 0, u1 = (u_along_x ? x1 - x0 : z0 - z1) / ROAD_DASH_PERIOD;
+	uint32_t a, b, c, d;
+	mesh.texcoord(u0, v); a = mesh.vertex(x0, y, z0);
+	mesh.texcoord(u_along_x ? u1 : u0, v); b = mesh.vertex(x1, y, z0);
+	mesh.texcoord(u1, v); c = mesh.vertex(x1, y, z1);
+	mesh.texcoord(u_along_x ? u0 : u1, v); d = mesh.vertex(x0, y, z1);
+	mesh.quad(a, b, c, d);
+}
+
+// the center line down every street, the city's edges included, as TEX_ROAD
+inline void road_markings(MeshBuilder &mesh, int blocks_x, int blocks_y, float block_size) {
+	float width = blocks_x * block_size, depth = blocks_y * block_size, half = ROAD_LINE_WIDTH / 2;
+	mesh.tex(TEX_ROAD);
+	mesh.normal(0.0, 1.0, 0.0);
+	mesh.color(0.9, 0.9, 0.0);
+	// along x, one per row of corners. the edge lines only get the half inside the city
+	for (int y = 0; y <= blocks_y; y++) {
+		float z = -y * block_size;
+		road_line(mesh, ROAD_DASH_OFFSET, width - ROAD_DASH_OFFSET, fmin(z + half, 0.0f), fmax(z - half, -depth), ROAD_HEIGHT, true);
+	}
+	// along z, one per column
+	for (int x = 0; x <= blocks_x; x++) {
+		float left = x * block_size;
+		road_line(mesh, fmax(left - half, 0.0f), fmin(left + half, width), -ROAD_DASH_OFFSET, -(depth - ROAD_DASH_OFFSET), ROAD_HEIGHT, false);
+	}
+	mesh.texcoord(0, 0);
+	mesh.tex(TEX_NONE);
+}
+
+// a lot in the middle of every block, and when ground is true the plain ground under the whole city, as TEX_NONE
+inline void road_lots(MeshBuilder &mesh, int blocks_x, int blocks_y, float block_size, bool ground) {
+	mesh.tex(TEX_NONE);
+	mesh.normal(0.0, 1.0, 0.0);
+	if (ground) {
+		float width = blocks_x * block_size, depth = blocks_y * block_size;
+		mesh.color(0.2, 0.2, 0.2);
+		uint32_t a = mesh.vertex(-GROUND_MARGIN, 0.0, -depth - GROUND_MARGIN);
+		uint32_t b = mesh.vertex(-GROUND_MARGIN, 0.0, GROUND_MARGIN);
+		uint32_t c = mesh.vertex(width + GROUND_MARGIN, 0.0, GROUND_MARGIN);
+		uint32_t d = mesh.vertex(width + GROUND_MARGIN, 0.0, -depth - GROUND_MARGIN);
+		mesh.quad(a, b, c, d);
+	}
+
+	mesh.color(0.5, 0.5, 0.5);
+	for (int y = 0; y < blocks_y; y++) {
+		for (int x = 0; x < blocks_x; x++) {
+			float x0 = x * block_size + LOT_INSET, x1 = (x + 1) * block_size - LOT_INSET;
+			float z0 = -y * block_size - LOT_INSET, z1 = -(y + 1) * block_size + LOT_INSET;
+			uint32_t a = mesh.vertex(x0, ROAD_HEIGHT, z1);
+			uint32_t b = mesh.vertex(x0, ROAD_HEIGHT, z0);
+			uint32_t c = mesh.vertex(x1, ROAD_HEIGHT, z1);
+			uint32_t d = mesh.vertex(x1, ROAD_HEIGHT, z0);
+			mesh.quad(a, b, d, c);
+		}
+	}
+}
+
+#endif
@@ -0,0 +1,332 @@
+// shaders.h - builds the GLSL programs, caches their binaries and reloads them on edits
+//
+// load() reads each stage's file, pastes in its #include "file"s, and hashes the
+// result together with the driver's vendor, renderer and version strings. With
+// ARB_get_program_binary the linked program is saved as SHADER_CACHE_DIR/<hash>.bin,
+// and the next start with the same sources on the same driver loads that instead of
+// compiling. A binary the driver turns down is compiled again and replaced.
+//
+// The same files can make several programs, each with its own #defines (a permutation),
+// which go in right after the #version line of every stage.
+//
+// On Linux the working directory is watched with inotify. poll() once a frame picks
+// up saved files and rebuilds every program that read one, includes too, and swaps
+// it in. A program that doesn't build any more prints its log and the old one keeps
+// running. Whatever was set on the old program (uniforms, block bindings) is gone
+// from the new one, so poll() returning true means set it all up again.
+
+#ifndef SHADERS_H
+#define SHADERS_H
+
+#ifdef __APPLE__
+#include <OpenGL/gl3.h>
+#else
+#include <GL/glew.h>
+#include <GL/gl.h>
+#endif
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/inotify.h>
+#endif
+
+#define SHADER_CACHE_DIR "shader_cache"
+#define SHADER_STAGES 2 // most stages in one program
+
+typedef struct ShaderStage_struct {
+	const char *file;
+	GLenum kind; // GL_VERTEX_SHADER, ...
+} ShaderStage_t;
+
+class ShaderLibrary {
+	private:
+		typedef struct Program_struct {
+			ShaderStage_t stages[SHADER_STAGES];
+			int stage_count;
+			std::string defines; // the define lines after #version
+			GLuint program;
+			std::vector<std::string> files; // every file it read, includes too
+			bool dirty; // one of them changed
+		} Program_t;
+
+		std::vector<Program_t> m_programs;
+		std::string m_driver;
+		bool m_binaries; // save and load program binaries
+		int m_notify; // inotify descriptor, -1 without
+		unsigned int m_cached, m_compiled; // programs so far that came from the cache / the compiler
+
+		static bool read_file(const std::string &name, std::string &out) {
+			std::ifstream fh(name.c_str(), std::ios::binary);
+			if (!fh) return false;
+			out.assign((std::istreambuf_iterator<char>(fh)), std::istreambuf_iterator<char>());
+			return true;
+		}
+
+		// the file with its includes pasted in and the defines after its first line, noting every file read
+		static bool resolve(const char *file, const std::string &defines, std::string &source, std::vector<std::string> &files) {
+			files.push_back(file);
+			if (!read_file(file, source)) {
+				std::cerr << "Could not read " << file << std::endl;
+				return false;
+			}
+			size_t include;
+			while ((include = source.find("#include \"")) != std::string::npos) {
+				size_t start = include + strlen("#include \"");
+				size_t end = source.find('"', start);
+				std::string name = source.substr(start, end - start), pasted;
+				files.push_back(name);
+				if (!read_file(name, pasted)) {
+					std::cerr << "Could not read " << name << ", included from " << file << std::endl;
+					return false;
+				}
+				source.replace(include, end + 1 - include, pasted);
+			}
+			size_t version = source.find('\n');
+			source.insert(version == std::string::npos ? source.size() : version + 1, defines);
+			return true;
+		}
+
+		static uint64_t hash(uint64_t h, const void *data, size_t size) {
+			// FNV-1a, 64 bit
+			const uint8_t *bytes = (const uint8_t*) data;
+			for (size_t i = 0; i < size; i++) {
+				h ^= bytes[i];
+				h *= 1099511628211ull;
+			}
+			return h;
+		}
+
+		static std::string cache_file(uint64_t key) {
+			char name[64];
+			snprintf(name, sizeof(name), SHADER_CACHE_DIR "/%016llx.bin", (unsigned long long) key);
+			return name;
+		}
+
+		static GLuint compile(const std::string &source, GLenum kind, const char *file) {
+			GLuint shader = glCreateShader(kind);
+			const char *text = source.c_str();
+			glShaderSource(shader, 1, &text, NULL);
+			glCompileShader(shader);
+
+			GLint status;
+			glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
+			if (status != GL_TRUE) {
+				GLchar error_log[1024];
+				GLsizei length;
+				glGetShaderInfoLog(shader, 1024, &length, error_log);
+				std::cerr << file << " did not compile correctly." << std::endl;
+				std::cerr << error_log << std::endl;
+				glDeleteShader(shader);
+				return 0;
+			}
+			return shader;
+		}
+
+		static bool linked(GLuint program, bool quiet) {
+			GLint status;
+			glGetProgramiv(program, GL_LINK_STATUS, &status);
+			if (status == GL_FALSE && !quiet) {
+				GLchar error_log[1024];
+				GLsizei length;
+				glGetProgramInfoLog(program, 1024, &length, error_log);
+				std::cerr << "Link error." << std::endl;
+				std::cerr << error_log << std::endl;
+			}
+			return status != GL_FALSE;
+		}
+
+		// the cached binary for key, 0 if there isn't one the driver takes
+		GLuint load_binary(uint64_t key) {
+			std::string data;
+			if (!m_binaries || !read_file(cache_file(key), data) || data.size() <= sizeof(GLenum)) return 0;
+			GLenum format;
+			memcpy(&format, data.data(), sizeof(GLenum));
+
+			GLuint program = glCreateProgram();
+			glProgramBinary(program, format, data.data() + sizeof(GLenum), data.size() - sizeof(GLenum));
+			if (!linked(program, true)) {
+				glDeleteProgram(program);
+				return 0;
+			}
+			return program;
+		}
+
+		void save_binary(uint64_t key, GLuint program) {
+			GLint length = 0;
+			glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+			if (length <= 0) return;
+			std::vector<char> data(sizeof(GLenum) + length);
+			GLenum format;
+			glGetProgramBinary(program, length, NULL, &format, &data[sizeof(GLenum)]);
+			memcpy(&data[0], &format, sizeof(GLenum));
+
+			mkdir(SHADER_CACHE_DIR, 0755);
+			std::ofstream out(cache_file(key).c_str(), std::ios::binary);
+			out.write(&data[0], data.size());
+		}
+
+		static std::string name(const Program_t &p) {
+			std::string stages = p.stages[0].file;
+			for (int s = 1; s < p.stage_count; s++) stages += std::string(" + ") + p.stages[s].file;
+			if (!p.defines.empty()) stages += " with " + p.defines.substr(0, p.defines.size() - 1);
+			return stages;
+		}
+
+		// a new program from p's stages, 0 if it doesn't build
+		GLuint build(Program_t &p) {
+			std::string sources[SHADER_STAGES];
+			p.files.clear();
+			uint64_t key = hash(14695981039346656037ull, m_driver.data(), m_driver.size());
+			for (int s = 0; s < p.stage_count; s++) {
+				if (!resolve(p.stages[s].file, p.defines, sources[s], p.files)) return 0;
+				key = hash(key, &p.stages[s].kind, sizeof(GLenum));
+				key = hash(key, sources[s].data(), sources[s].size());
+			}
+
+			GLuint program = load_binary(key);
+			if (program != 0) {
+				m_cached++;
+				return program;
+			}
+
+			program = glCreateProgram();
+			GLuint shaders[SHADER_STAGES];
+			for (int s = 0; s < p.stage_count; s++) {
+				shaders[s] = compile(sources[s], p.stages[s].kind, p.stages[s].file);
+				if (shaders[s] == 0) {
+					for (int d = 0; d < s; d++) glDeleteShader(shaders[d]);
+					glDeleteProgram(program);
+					return 0;
+				}
+				glAttachShader(program, shaders[s]);
+			}
+			#ifndef __APPLE__
+			if (m_binaries) glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+			#endif
+			glLinkProgram(program);
+			for (int s = 0; s < p.stage_count; s++) {
+				glDetachShader(program, shaders[s]);
+				glDeleteShader(shaders[s]);
+			}
+			if (!linked(program, false)) {
+				glDeleteProgram(program);
+				return 0;
+			}
+			m_compiled++;
+			if (m_binaries) save_binary(key, program);
+			return program;
+		}
+
+	public:
+		ShaderLibrary() : m_binaries(false), m_notify(-1), m_cached(0), m_compiled(0) {}
+
+		~ShaderLibrary() {
+			#ifdef __linux__
+			if (m_notify >= 0) close(m_notify);
+			#endif
+		}
+
+		// once there's a context. cache saves and loads binaries, watch reloads edited files
+		void setup(bool cache, bool watch) {
+			const char *strings[3] = { (const char*) glGetString(GL_VENDOR), (const char*) glGetString(GL_RENDERER), (const char*) glGetString(GL_VERSION) };
+			for (int i = 0; i < 3; i++) {
+				m_driver += strings[i] ? strings[i] : "";
+				m_driver += '\n';
+			}
+
+			GLint formats = 0;
+			#ifdef __APPLE__
+			glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+			#else
+			if (GLEW_VERSION_4_1 || GLEW_ARB_get_program_binary) glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+			#endif
+			m_binaries = cache && formats > 0;
+
+			#ifdef __linux__
+			if (watch) {
+				m_notify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+				if (m_notify >= 0 && inotify_add_watch(m_notify, ".", IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+					close(m_notify);
+					m_notify = -1;
+				}
+			}
+			#endif
+		}
+
+		// builds a program out of up to SHADER_STAGES files, -1 if it doesn't build.
+		// defines is "#define NAME\n" lines, or empty
+		int load(const ShaderStage_t *stages, int count, const std::string &defines = "") {
+			Program_t p;
+			p.defines = defines;
+			for (int s = 0; s < count && s < SHADER_STAGES; s++) p.stages[s] = stages[s];
+			p.stage_count = count < SHADER_STAGES ? count : SHADER_STAGES;
+			p.dirty = false;
+			p.program = build(p);
+			if (p.program == 0) return -1;
+			m_programs.push_back(p);
+			return m_programs.size() - 1;
+		}
+
+		GLuint program(int handle) {
+			return handle >= 0 ? m_programs[handle].program : 0;
+		}
+
+		// rebuilds whatever's been edited since the last call, true if any program changed
+		bool poll() {
+			#ifdef __linux__
+			if (m_notify < 0) return false;
+			char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+			bool changed = false;
+			ssize_t length;
+			while ((length = read(m_notify, events, sizeof(events))) > 0) {
+				for (char *e = events; e < events + length; e += sizeof(struct inotify_event) + ((struct inotify_event*) e)->len) {
+					struct inotify_event *event = (struct inotify_event*) e;
+					if (event->len == 0) continue;
+					for (size_t i = 0; i < m_programs.size(); i++) {
+						for (size_t f = 0; f < m_programs[i].files.size(); f++) {
+							if (m_programs[i].files[f] == event->name) m_programs[i].dirty = changed = true;
+						}
+					}
+				}
+			}
+			if (!changed) return false;
+
+			bool swapped = false;
+			for (size_t i = 0; i < m_programs.size(); i++) {
+				Program_t &p = m_programs[i];
+				if (!p.dirty) continue;
+				p.dirty = false;
+				std::vector<std::string> files = p.files;
+				GLuint program = build(p);
+				if (program == 0) {
+					// keep watching what it read last time it built
+					p.files = files;
+					std::cerr << "Keeping the last " << name(p) << " that built." << std::endl;
+					continue;
+				}
+				glDeleteProgram(p.program);
+				p.program = program;
+				swapped = true;
+				std::cerr << "Reloaded " << name(p) << "." << std::endl;
+			}
+			return swapped;
+			#else
+			return false;
+			#endif
+		}
+
+		unsigned int cached() { return m_cached; }
+		unsigned int compiled() { return m_compiled; }
+};
+
+#endif
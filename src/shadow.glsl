@@ -0,0 +1,19 @@
+#version 330 core
+
+// depth only, for the shadow cascades (shadows.h). the static city goes in with
+// instanced off, the cars with it on, the same way vert.glsl places them.
+uniform mat4 light_matrix; // world to the cascade's clip space
+uniform bool instanced;
+
+layout(location = 0) in vec3 position;
+layout(location = 5) in vec4 instance; // xyz offset, w degrees about y
+
+void main() {
+	vec3 world = position;
+	if (instanced) {
+		float a = radians(instance.w);
+		mat3 rotate = mat3(cos(a), 0.0, -sin(a),  0.0, 1.0, 0.0,  sin(a), 0.0, cos(a));
+		world = rotate * position + instance.xyz;
+	}
+	gl_Position = light_matrix * vec4(world, 1.0);
+}
@@ -0,0 +1,227 @@
+// shadows.h - cascaded shadow maps for the sun, with the city's depth cached
+//
+// The view out to SHADOW_DISTANCE is split into SHADOW_CASCADES slices, each with
+// its own ortho box in light space and layer in a depth texture array. The city
+// doesn't move, so each cascade keeps a second copy of its layer with just the city
+// in it. That copy is only drawn again when it goes stale, and every frame the cars
+// go on top of a blit of it.
+//
+// A cascade goes stale when the sun moves, or when the camera's slice leaves the box
+// it was drawn for. The box is SHADOW_MARGIN bigger than the sphere around the slice
+// and only moves when it has to, so walking around re-draws the near cascade now and
+// then and the far one (which covers the whole city) never.
+//
+// Per frame: set_sun(), fit(), then for each cascade begin_static() and draw the city if
+// stale(), begin_live() and draw the cars, then end().
+
+#ifndef SHADOWS_H
+#define SHADOWS_H
+
+#ifdef __APPLE__
+#include <OpenGL/gl3.h>
+#else
+#include <GL/glew.h>
+#include <GL/gl.h>
+#endif
+
+#include <math.h>
+
+#include "mat.h"
+
+#define SHADOW_CASCADES 3 // also the shadow_matrix array in frame.glsl
+#define SHADOW_SIZE 1024 // texels a side, every cascade
+#define SHADOW_DISTANCE 400.0 // no shadows past this far from the eye
+#define SHADOW_SPLIT_LAMBDA 0.75 // 0 spaces the splits evenly, 1 logarithmically
+#define SHADOW_MARGIN 0.25 // of a slice's radius, how far it moves before its box does
+
+class ShadowCascades {
+	private:
+		GLuint m_live, m_cache; // depth texture arrays, m_live is what the shaders sample
+		GLuint m_live_fbo[SHADOW_CASCADES], m_cache_fbo[SHADOW_CASCADES];
+
+		Vec3_t m_scene_min, m_scene_max, m_scene_center;
+		float m_scene_radius;
+
+		Vec3_t m_sun;
+		Mat4_t m_light_view; // rotation only, looking the way the light goes
+		float m_depth_near, m_depth_far; // the scene in light space
+
+		float m_splits[SHADOW_CASCADES + 1]; // view depths
+		float m_slice_center[SHADOW_CASCADES], m_slice_radius[SHADOW_CASCADES]; // sphere along the view axis
+		bool m_whole_scene[SHADOW_CASCADES]; // the slice is bigger than the city, the box never moves
+		float m_box_x[SHADOW_CASCADES], m_box_y[SHADOW_CASCADES], m_box_half[SHADOW_CASCADES];
+		bool m_placed[SHADOW_CASCADES];
+		bool m_stale[SHADOW_CASCADES];
+		Mat4_t m_matrices[SHADOW_CASCADES];
+		unsigned int m_static_passes;
+
+		void all_stale() {
+			for (int c = 0; c < SHADOW_CASCADES; c++) m_placed[c] = m_stale[c] = false;
+		}
+
+		GLuint depth_array(bool compare) {
+			GLuint texture;
+			glGenTextures(1, &texture);
+			glBindTexture(GL_TEXTURE_2D_ARRAY, texture);
+			glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_DEPTH_COMPONENT24, SHADOW_SIZE, SHADOW_SIZE, SHADOW_CASCADES, 0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
+			glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, compare ? GL_LINEAR : GL_NEAREST);
+			glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, compare ? GL_LINEAR : GL_NEAREST);
+			glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+			glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+			if (compare) {
+				// hardware 2x2 pcf
+				glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE);
+				glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+			}
+			return texture;
+		}
+
+		bool layer_fbo(GLuint &fbo, GLuint texture, int layer) {
+			glGenFramebuffers(1, &fbo);
+			glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+			glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, texture, 0, layer);
+			glDrawBuffer(GL_NONE);
+			glReadBuffer(GL_NONE);
+			return glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+		}
+
+	public:
+		ShadowCascades() : m_live(0), m_cache(0), m_scene_radius(0), m_sun(0, 0, 0), m_depth_near(0), m_depth_far(1), m_static_passes(0) {
+			for (int c = 0; c <= SHADOW_CASCADES; c++) m_splits[c] = 0;
+			all_stale();
+		}
+
+		// scene_min / scene_max bound everything that casts a shadow. false if the driver can't render to the layers.
+		bool setup(const Vec3_t &scene_min, const Vec3_t &scene_max) {
+			m_scene_min = scene_min;
+			m_scene_max = scene_max;
+			m_scene_center = (scene_min + scene_max) * 0.5;
+			m_scene_radius = vec3_length(scene_max - scene_min) * 0.5;
+
+			m_live = depth_array(true);
+			m_cache = depth_array(false);
+			bool complete = true;
+			for (int c = 0; c < SHADOW_CASCADES; c++) {
+				complete = layer_fbo(m_live_fbo[c], m_live, c) && complete;
+				complete = layer_fbo(m_cache_fbo[c], m_cache, c) && complete;
+			}
+			glBindFramebuffer(GL_FRAMEBUFFER, 0);
+			glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+			all_stale();
+			return complete;
+		}
+
+		// the camera's projection, the slices only change with it
+		void set_projection(float fovy, float aspect, float near) {
+			float ty = tan(fovy * M_PI / 360.0), tx = ty * aspect;
+			float k2 = tx * tx + ty * ty; // corners per unit of depth, squared
+			for (int c = 0; c <= SHADOW_CASCADES; c++) {
+				float f = (float) c / SHADOW_CASCADES;
+				float split_log = near * pow(SHADOW_DISTANCE / near, f);
+				float split_even = near + (SHADOW_DISTANCE - near) * f;
+				m_splits[c] = SHADOW_SPLIT_LAMBDA * split_log + (1 - SHADOW_SPLIT_LAMBDA) * split_even;
+			}
+			for (int c = 0; c < SHADOW_CASCADES; c++) {
+				// smallest sphere around the slice's corners, its center is on the view axis
+				float n = m_splits[c], f = m_splits[c + 1];
+				float center = (f + n) * (1 + k2) * 0.5;
+				if (center > f) center = f;
+				m_slice_center[c] = center;
+				m_slice_radius[c] = sqrt((f - center) * (f - center) + k2 * f * f);
+				m_whole_scene[c] = m_slice_radius[c] >= m_scene_radius;
+			}
+			all_stale();
+		}
+
+		// towards_sun is world space and unit length
+		void set_sun(const Vec3_t &towards_sun) {
+			if (vec3_length(towards_sun - m_sun) < 1e-6) return;
+			m_sun = towards_sun;
+			Vec3_t up = fabs(m_sun.y) > 0.99 ? Vec3_t(0, 0, -1) : Vec3_t(0, 1, 0);
+			m_light_view = mat4_look_at(Vec3_t(0, 0, 0), m_sun * -1, up);
+
+			// depth range that takes in the whole scene
+			m_depth_near = 1e30;
+			m_depth_far = -1e30;
+			for (int i = 0; i < 8; i++) {
+				Vec3_t corner((i & 1) ? m_scene_max.x : m_scene_min.x, (i & 2) ? m_scene_max.y : m_scene_min.y, (i & 4) ? m_scene_max.z : m_scene_min.z);
+				float depth = -mat4_transform_point(m_light_view, corner).z;
+				m_depth_near = fmin(m_depth_near, depth - 1);
+				m_depth_far = fmax(m_depth_far, depth + 1);
+			}
+			all_stale();
+		}
+
+		// moves the boxes the camera's slices have left and marks them stale
+		void fit(const Vec3_t &eye, const Vec3_t &forward) {
+			for (int c = 0; c < SHADOW_CASCADES; c++) {
+				float radius = m_whole_scene[c] ? m_scene_radius : m_slice_radius[c];
+				Vec3_t center = m_whole_scene[c] ? m_scene_center : eye + forward * m_slice_center[c];
+				Vec3_t light = mat4_transform_point(m_light_view, center);
+				float margin = radius * SHADOW_MARGIN;
+				if (m_placed[c] && fabs(light.x - m_box_x[c]) <= margin && fabs(light.y - m_box_y[c]) <= margin) continue;
+
+				// snapped to whole texels, so the city's edges land on the same texels wherever the box is
+				m_box_half[c] = radius + margin;
+				float texel = 2 * m_box_half[c] / SHADOW_SIZE;
+				m_box_x[c] = floor(light.x / texel) * texel;
+				m_box_y[c] = floor(light.y / texel) * texel;
+				m_matrices[c] = mat4_ortho(m_box_x[c] - m_box_half[c], m_box_x[c] + m_box_half[c], m_box_y[c] - m_box_half[c], m_box_y[c] + m_box_half[c], m_depth_near, m_depth_far) * m_light_view;
+				m_placed[c] = true;
+				m_stale[c] = true;
+			}
+		}
+
+		// renders into cascade c's cached layer, which needs the static geometry drawn if stale()
+		void begin_static(int c) {
+			glBindFramebuffer(GL_FRAMEBUFFER, m_cache_fbo[c]);
+			glViewport(0, 0, SHADOW_SIZE, SHADOW_SIZE);
+			glClear(GL_DEPTH_BUFFER_BIT);
+		}
+
+		bool stale(int c) {
+			return m_stale[c];
+		}
+
+		// after the static draw
+		void cached(int c) {
+			m_stale[c] = false;
+			m_static_passes++;
+		}
+
+		// copies the cached layer into the sampled one and renders there, for the moving geometry
+		void begin_live(int c) {
+			glBindFramebuffer(GL_READ_FRAMEBUFFER, m_cache_fbo[c]);
+			glBindFramebuffer(GL_DRAW_FRAMEBUFFER, m_live_fbo[c]);
+			glBlitFramebuffer(0, 0, SHADOW_SIZE, SHADOW_SIZE, 0, 0, SHADOW_SIZE, SHADOW_SIZE, GL_DEPTH_BUFFER_BIT, GL_NEAREST);
+			glBindFramebuffer(GL_FRAMEBUFFER, m_live_fbo[c]);
+			glViewport(0, 0, SHADOW_SIZE, SHADOW_SIZE);
+		}
+
+		// back to framebuffer (0 for the window), drawing width by height of it
+		void end(GLuint framebuffer, int width, int height) {
+			glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+			glViewport(0, 0, width, height);
+		}
+
+		// world to cascade c's clip space
+		const Mat4_t &matrix(int c) {
+			return m_matrices[c];
+		}
+
+		// view depth where cascade c ends
+		float split(int c) {
+			return m_splits[c + 1];
+		}
+
+		GLuint texture() {
+			return m_live;
+		}
+
+		// times a cascade's city depth has been drawn, for the benchmark
+		unsigned int static_passes() {
+			return m_static_passes;
+		}
+};
+
+#endif
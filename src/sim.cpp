@@ -0,0 +1,222 @@
+// sim.cpp - city layout and traffic, see sim.h
+
+#include <stdlib.h>
+
+#include "sim.h"
+
+using namespace std;
+
+////////////////////////////////////////////// random numbers
+
+static uint64_t sim_state = 1;
+
+void sim_seed(uint32_t seed) {
+	sim_state = seed;
+}
+
+// 64 bit LCG (Knuth's MMIX constants), the high bits are the good ones
+uint32_t sim_rand() {
+	sim_state = sim_state * 6364136223846793005ULL + 1442695040888963407ULL;
+	return (uint32_t) (sim_state >> 33);
+}
+
+////////////////////////////////////////////// BlockIterator
+
+BlockIterator::BlockIterator(int width, int height, int block_size) : m_state(0), m_width(width), m_height(height) {
+	// rounds down and throws out the extra space
+	m_num_x_blocks = m_width / block_size;
+	m_num_y_blocks = m_height / block_size;
+}
+
+Point2D_t BlockIterator::next() {
+	int x_offset = (m_width / m_num_x_blocks) * (m_state % m_num_x_blocks); // yes that's recreating block_size, but it's the trimmed one now
+	int y_offset = (m_state / m_num_x_blocks) * (m_height / m_num_y_blocks); // integer division
+
+	Point2D_t output = Point2D_t(x_offset, y_offset);
+	m_state++;
+	return output;
+}
+
+bool BlockIterator::has_next() {
+	return (m_state < m_num_x_blocks * m_num_y_blocks) ? true : false;
+}
+
+void BlockIterator::reset() {
+	m_state = 0;
+}
+
+////////////////////////////////////////////// RandomIterator
+
+RandomIterator::RandomIterator(int size, int range) : m_state(0), m_size(size), m_range(range) {
+	m_values = new double[m_size];
+	for (int i = 0; i < m_size; i++){
+		m_values[i] = sim_rand() % m_range;
+	}
+}
+
+RandomIterator::~RandomIterator() {
+	delete[] m_values;
+}
+
+double RandomIterator::next() {
+	return m_values[m_state++];
+}
+
+bool RandomIterator::has_next() {
+	return (m_state < m_size) ? true : false;
+}
+
+void RandomIterator::reset() {
+	m_state = 0;
+}
+
+////////////////////////////////////////////// Car
+
+Car::Car(int x_start, int y_start, int block_size, int extent) : m_heading(STOP), m_speed(0), m_ticks(0), m_block_size(block_size), m_extent(extent), m_x_pos(x_start), m_y_pos(y_start) {
+	m_color = sim_rand() % 6;
+	switch (m_color) {
+		case 0: // Red
+		color_r = 0.8; color_g = 0; color_b = 0; break;
+
+		case 1: // Green
+		color_r = 0; color_g = 0.8; color_b = 0; break;
+
+		case 2: // Blue
+		color_r = 0; color_g = 0; color_b = 0.8; break;
+
+		case 3: // Dark Grey
+		color_r = 0.4; color_g = 0.4; color_b = 0.4; break;
+
+		case 4: // White
+		color_r = 0.9; color_g = 0.9; color_b = 0.9; break;
+
+		case 5: // Yellow
+		color_r = 0.8; color_g = 0.8; color_b = 0; break;
+	}
+}
+
+bool Car::can_move() {
+	switch(m_heading) {
+		case RIGHT:
+			if(m_x_pos < m_extent - 10 - 1)
+				return true;
+			break;
+		case LEFT:
+			if(m_x_pos > 0 + 10 + 1)
+				return true;
+			break;
+		case UP:
+			if (m_y_pos < m_extent - 10 - 1)
+				return true;
+			break;
+		case DOWN:
+			if(m_y_pos > 0 + 10 + 1)
+				return true;
+			break;
+		case STOP:
+			return true;
+			break;
+	}
+	return false;
+}
+
+void Car::start_movement(int heading, double speed) {
+	m_speed = speed;
+	m_ticks = 0;
+	// Don't do U turns
+	if (heading == LEFT && m_heading == RIGHT) {
+	} else if (heading == RIGHT && m_heading == LEFT) {
+	} else if (heading == UP && m_heading == DOWN) {
+	} else if (heading == DOWN && m_heading == UP) {
+	} else { m_heading = heading;
+	}
+}
+
+void Car::tick() {
+	if (m_ticks == 1.0 / m_speed) {
+		do {
+			start_movement((sim_rand() % 9) % 5, .01);
+		} while(!can_move());
+	}
+
+	m_ticks++;
+
+	// negate the correct terms for different directions
+	// we can move to true ipo easily if need be
+	switch(m_heading) {
+		case RIGHT:
+			m_x_pos += m_block_size * m_speed;
+			break;
+		case LEFT:
+			m_x_pos -= m_block_size * m_speed;
+			break;
+		case UP:
+			m_y_pos += m_block_size * m_speed;
+			break;
+		case DOWN:
+			m_y_pos -= m_block_size * m_speed;
+			break;
+		case STOP:
+			break;
+	}
+}
+
+void Car::instance(CarInstance_t &out) {
+	out.x = m_x_pos;
+	out.y = 0.0;
+	out.z = -1 * m_y_pos;
+	out.angle = (m_heading == RIGHT || m_heading == LEFT) ? 90 : 0;
+	out.r = color_r;
+	out.g = color_g;
+	out.b = color_b;
+	out.a = 1.0;
+}
+
+////////////////////////////////////////////// TrafficConductor
+
+TrafficConductor::TrafficConductor(int car_number, int grid, int block_size) : m_car_number(car_number), m_grid(grid), m_block_size(block_size) {
+	cars.reserve(m_car_number);
+	for (int i = 0; i < m_car_number; i++) {
+		cars.push_back(new Car((sim_rand() % m_grid) * m_block_size, (sim_rand() % m_grid) * m_block_size, m_block_size, m_grid * m_block_size));
+	}
+}
+
+TrafficConductor::~TrafficConductor() {
+	for (size_t i = 0; i < cars.size(); i++) delete cars[i];
+}
+
+void TrafficConductor::start_cars() {
+	for(vector<Car*>::iterator car = cars.begin(); car != cars.end(); ++car) {
+		(*car)->start_movement(UP, .01);
+	}
+}
+
+void TrafficConductor::tick_cars() {
+	for(vector<Car*>::iterator car = cars.begin(); car != cars.end(); ++car) {
+		(*car)->tick();
+	}
+}
+
+void TrafficConductor::instances(CarInstance_t *out, size_t begin, size_t end) {
+	for (size_t i = begin; i < end; i++) {
+		cars[i]->instance(out[i]);
+	}
+}
+
+size_t TrafficConductor::memory_bytes() {
+	return cars.capacity() * sizeof(Car*) + cars.size() * sizeof(Car);
+}
+
+uint32_t TrafficConductor::checksum() {
+	// FNV-1a over each car's state
+	uint32_t hash = 2166136261u;
+	for (size_t i = 0; i < cars.size(); i++) {
+		double state[3] = { cars[i]->m_x_pos, cars[i]->m_y_pos, (double) cars[i]->get_heading() };
+		const uint8_t *bytes = (const uint8_t*) state;
+		for (size_t b = 0; b < sizeof(state); b++) {
+			hash ^= bytes[b];
+			hash *= 16777619u;
+		}
+	}
+	return hash;
+}
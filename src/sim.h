@@ -0,0 +1,127 @@
+// sim.h - the city layout and the traffic simulation, no GL in here
+//
+// Built into libsim.a (see the Makefile) so sim_bench can run the traffic
+// without a window. main.cpp draws what's in here: BlockIterator and
+// RandomIterator lay out the city, TrafficConductor moves the cars and hands
+// out a CarInstance_t per car for the instanced draw.
+
+#ifndef SIM_H
+#define SIM_H
+
+#include <vector>
+
+#include <stddef.h>
+#include <stdint.h>
+
+// the simulation's own random numbers instead of rand(), so a seed gives the same city
+// and traffic on every platform (replay.h depends on it). 1 is the default seed.
+#define SIM_RAND_MAX 0x7FFFFFFF
+void sim_seed(uint32_t seed);
+uint32_t sim_rand(); // 0 to SIM_RAND_MAX
+
+// headings
+#define RIGHT 0
+#define LEFT 1
+#define UP 2
+#define DOWN 3
+#define STOP 4
+
+typedef struct Point2D_struct {
+	float x;
+	float y;
+	Point2D_struct(float xx, float yy) : x(xx), y(yy) {};
+	Point2D_struct() {};
+} Point2D_t;
+
+// per car attributes for the instanced car draw (locations 5 and 6 in vert.glsl)
+typedef struct CarInstance_struct {
+	float x, y, z, angle; // angle is degrees about y
+	float r, g, b, a;
+} CarInstance_t;
+
+class BlockIterator {
+	// Faux iterator.
+	// This is supposed to give us the smallest (x, y) point in each block
+	private:
+		int m_state;
+		int m_width, m_height;
+		int m_num_x_blocks, m_num_y_blocks;
+
+	public:
+		BlockIterator(int width, int height, int block_size);
+		Point2D_t next();
+		bool has_next();
+		void reset();
+};
+
+class RandomIterator {
+	private:
+		int m_state;
+		int m_size;
+		int m_range;
+		double *m_values;
+
+	public:
+		RandomIterator(int size, int range);
+		~RandomIterator();
+		double next();
+		bool has_next();
+		void reset();
+};
+
+class Car {
+	private:
+		int m_color; // the color is 4. deal with it.
+		int m_heading; // RIGHT, LEFT, UP, or DOWN
+		float color_r, color_g, color_b;
+		double m_speed; // inverse of the number of frames to traverse one block
+		int m_ticks; // how many frames we are into the current movement
+		int m_block_size, m_extent; // the grid the car drives on, m_extent is its width
+
+		bool can_move();
+
+	public:
+		double m_x_pos, m_y_pos; // center of the car
+
+		Car(int x_start, int y_start, int block_size = 30, int extent = 300);
+
+		int get_heading() {
+			return m_heading;
+		}
+
+		void start_movement(int heading, double speed);
+		void tick(); // advance animation one frame
+
+		bool is_stopped() {
+			return m_heading == STOP;
+		}
+
+		// where the car mesh goes this frame, the four blocks themselves are in the car mesh
+		void instance(CarInstance_t &out);
+};
+
+class TrafficConductor {
+	private:
+		int m_car_number;
+		int m_grid, m_block_size;
+	public:
+		std::vector<Car*> cars;
+
+		// cars start on random intersections of a grid by grid block city
+		TrafficConductor(int car_number, int grid = 10, int block_size = 30);
+		~TrafficConductor();
+
+		void start_cars();
+		void tick_cars();
+
+		// cars [begin, end) into out[begin, end), safe to split across threads
+		void instances(CarInstance_t *out, size_t begin, size_t end);
+
+		// what the cars take up on the heap
+		size_t memory_bytes();
+
+		// hash of every car's position and heading, equal runs give equal checksums
+		uint32_t checksum();
+};
+
+#endif
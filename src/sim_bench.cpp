@@ -0,0 +1,119 @@
+// sim_bench.cpp - runs the traffic simulation without a window and times it
+//
+// usage: sim_bench [-cars 100,1000,...] [-grid 10,50,...] [-ticks n]
+//        sim_bench -replay file
+//
+// Every car count runs on every grid size (grid by grid blocks of 30 units).
+// Reports ticks per second, car updates per second, the heap the cars take up
+// and the peak resident size of the process so far.
+//
+// -replay runs the traffic of a recording made with ./a.out -record (see replay.h),
+// one tick a frame, and prints the checksum the replay in the window prints.
+
+#include <vector>
+#include <string>
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <algorithm>
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+
+#include "sim.h"
+#include "replay.h"
+
+using namespace std;
+
+// "100,1000" -> { 100, 1000 }
+static vector<int> parse_list(const char *list) {
+	vector<int> values;
+	for (const char *p = list; *p != '\0'; ) {
+		values.push_back(atoi(p));
+		p = strchr(p, ',');
+		if (p == NULL) break;
+		p++;
+	}
+	return values;
+}
+
+static double peak_rss_mb() {
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+	return usage.ru_maxrss / (1024.0 * 1024.0); // bytes
+#else
+	return usage.ru_maxrss / 1024.0; // kilobytes
+#endif
+}
+
+static int run_replay(const char *filename) {
+	ReplayReader player;
+	if (!player.open(filename)) {
+		cout << "Could not read replay " << filename << endl;
+		return 1;
+	}
+	const ReplayHeader_t &header = player.header();
+	unsigned int ticks = player.frames();
+
+	// same random numbers in the same order as main(), the heights come first
+	sim_seed(header.seed);
+	RandomIterator heights(100, 5);
+	TrafficConductor traffic(header.cars);
+	traffic.start_cars();
+
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	for (unsigned int t = 0; t < ticks; t++) traffic.tick_cars();
+	double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+	cout << "seed " << header.seed << ", " << header.cars << " cars, " << ticks << " ticks, "
+		<< fixed << setprecision(0) << ticks / max(seconds, 1e-9) << " ticks/s" << endl;
+	cout << "traffic checksum " << hex << traffic.checksum() << dec << endl;
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	vector<int> car_counts = parse_list("100,1000,10000,100000");
+	vector<int> grids = parse_list("10,100");
+	int ticks = 1000;
+
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-cars") == 0 && i + 1 < argc) car_counts = parse_list(argv[++i]);
+		else if (strcmp(argv[i], "-grid") == 0 && i + 1 < argc) grids = parse_list(argv[++i]);
+		else if (strcmp(argv[i], "-ticks") == 0 && i + 1 < argc) ticks = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-replay") == 0 && i + 1 < argc) return run_replay(argv[++i]);
+		else {
+			cout << "usage: sim_bench [-cars 100,1000,...] [-grid 10,50,...] [-ticks n] | -replay file" << endl;
+			return 1;
+		}
+	}
+	if (ticks <= 0) {
+		cout << "-ticks has to be positive" << endl;
+		return 1;
+	}
+
+	cout << ticks << " ticks per run" << endl;
+	cout << right << setw(8) << "grid" << setw(10) << "cars" << setw(14) << "ticks/s" << setw(16) << "cars/s" << setw(12) << "heap MB" << setw(12) << "peak MB" << endl;
+
+	for (size_t g = 0; g < grids.size(); g++) {
+		for (size_t c = 0; c < car_counts.size(); c++) {
+			if (grids[g] < 1 || car_counts[c] < 1) continue;
+
+			// same cars every run of the same size
+			sim_seed(1);
+			TrafficConductor traffic(car_counts[c], grids[g]);
+			traffic.start_cars();
+
+			chrono::steady_clock::time_point start = chrono::steady_clock::now();
+			for (int t = 0; t < ticks; t++) traffic.tick_cars();
+			double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+			cout << fixed << setprecision(0) << setw(8) << grids[g] << setw(10) << car_counts[c]
+				<< setw(14) << ticks / seconds << setw(16) << (double) ticks * car_counts[c] / seconds
+				<< setprecision(2) << setw(12) << traffic.memory_bytes() / (1024.0 * 1024.0) << setw(12) << peak_rss_mb() << endl;
+		}
+	}
+
+	return 0;
+}
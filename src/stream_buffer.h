@@ -0,0 +1,116 @@
+// stream_buffer.h - per frame vertex data written by the cpu every frame
+//
+// With ARB_buffer_storage the buffer is allocated once at STREAM_FRAMES times the
+// per frame capacity and mapped persistently, so a frame costs no GL calls at all
+// until the draw: begin() hands out the next region after waiting on the fence of
+// the frame that last read it, which is STREAM_FRAMES frames back and long done.
+// Without it, begin() orphans the buffer and maps it again, same as before.
+//
+// begin(count), write count elements, end(), draw with the elements starting at
+// base(), then fence() once the draws reading them are issued.
+
+#ifndef STREAM_BUFFER_H
+#define STREAM_BUFFER_H
+
+#ifdef __APPLE__
+#include <OpenGL/gl3.h>
+#else
+#include <GL/glew.h>
+#include <GL/gl.h>
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define STREAM_FRAMES 3 // regions in flight in the persistent buffer
+
+class StreamBuffer {
+	private:
+		GLenum m_target;
+		GLuint m_buffer;
+		size_t m_element_size, m_capacity; // capacity is elements per frame
+		bool m_persistent;
+		uint8_t *m_mapped; // the whole buffer, persistent only
+		GLsync m_fences[STREAM_FRAMES];
+		unsigned int m_region;
+
+		void wait(unsigned int region) {
+			if (m_fences[region] == 0) return;
+			GLenum result = GL_TIMEOUT_EXPIRED;
+			while (result == GL_TIMEOUT_EXPIRED) result = glClientWaitSync(m_fences[region], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+			glDeleteSync(m_fences[region]);
+			m_fences[region] = 0;
+		}
+
+	public:
+		StreamBuffer() : m_target(GL_ARRAY_BUFFER), m_buffer(0), m_element_size(0), m_capacity(0), m_persistent(false), m_mapped(NULL), m_region(0) {
+			for (int i = 0; i < STREAM_FRAMES; i++) m_fences[i] = 0;
+		}
+
+		// room for capacity elements a frame. persistent falls back to orphaning when the driver can't.
+		void setup(GLenum target, size_t element_size, size_t capacity, bool persistent) {
+			m_target = target;
+			m_element_size = element_size;
+			m_capacity = capacity;
+			glGenBuffers(1, &m_buffer);
+			glBindBuffer(m_target, m_buffer);
+
+			#ifndef __APPLE__
+			if (persistent) {
+				GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+				glBufferStorage(m_target, STREAM_FRAMES * m_capacity * m_element_size, NULL, flags);
+				m_mapped = (uint8_t*) glMapBufferRange(m_target, 0, STREAM_FRAMES * m_capacity * m_element_size, flags);
+				m_persistent = (m_mapped != NULL);
+				if (m_persistent) return;
+
+				// storage is immutable, start over with a buffer that can be orphaned
+				glDeleteBuffers(1, &m_buffer);
+				glGenBuffers(1, &m_buffer);
+				glBindBuffer(m_target, m_buffer);
+			}
+			#endif
+			glBufferData(m_target, m_capacity * m_element_size, NULL, GL_STREAM_DRAW);
+		}
+
+		// where this frame's count elements go, NULL if they don't fit or the map fails
+		void *begin(size_t count) {
+			if (count > m_capacity) return NULL;
+			if (m_persistent) {
+				m_region = (m_region + 1) % STREAM_FRAMES;
+				wait(m_region);
+				return m_mapped + m_region * m_capacity * m_element_size;
+			}
+
+			// orphan last frame's storage rather than wait for the gpu to be done with it
+			glBindBuffer(m_target, m_buffer);
+			glBufferData(m_target, m_capacity * m_element_size, NULL, GL_STREAM_DRAW);
+			return glMapBufferRange(m_target, 0, count * m_element_size, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+		}
+
+		// false if the data was lost (the mapping got trashed)
+		bool end() {
+			if (m_persistent) return true;
+			glBindBuffer(m_target, m_buffer);
+			return glUnmapBuffer(m_target) == GL_TRUE;
+		}
+
+		// call after the draws using this frame's region
+		void fence() {
+			if (m_persistent) m_fences[m_region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		}
+
+		// first element of this frame's data, for base instance / base vertex / attribute offsets
+		size_t base() {
+			return m_persistent ? m_region * m_capacity : 0;
+		}
+
+		GLuint buffer() {
+			return m_buffer;
+		}
+
+		bool persistent() {
+			return m_persistent;
+		}
+};
+
+#endif
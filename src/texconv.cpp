@@ -0,0 +1,52 @@
+// texconv.cpp - offline texture converter
+// Turns a BMP into a mipmapped KTX that load_texture() can upload without decoding.
+//
+// usage: texconv [-bc1 | -bc3 | -rgba] input.bmp [output.ktx]
+//   -bc1   opaque block compression, 4 bits per texel (default)
+//   -bc3   block compression with alpha, 8 bits per texel
+//   -rgba  no compression, just the premade mip chain
+
+#include <string>
+#include <vector>
+#include <iostream>
+
+#include <string.h>
+
+#include "bitmap.h"
+#include "texture_cache.h"
+
+using namespace std;
+
+int main(int argc, char **argv) {
+	uint32_t format = KTX_COMPRESSED_RGB_S3TC_DXT1;
+	vector<const char*> files;
+
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-bc1") == 0) format = KTX_COMPRESSED_RGB_S3TC_DXT1;
+		else if (strcmp(argv[i], "-bc3") == 0) format = KTX_COMPRESSED_RGBA_S3TC_DXT5;
+		else if (strcmp(argv[i], "-rgba") == 0) format = KTX_RGBA8;
+		else files.push_back(argv[i]);
+	}
+
+	if (files.size() < 1 || files.size() > 2) {
+		cout << "usage: texconv [-bc1 | -bc3 | -rgba] input.bmp [output.ktx]" << endl;
+		return 1;
+	}
+
+	CBitmap image;
+	if (!image.Load(files[0]) || image.GetWidth() == 0 || image.GetHeight() == 0) {
+		cout << "Could not load " << files[0] << endl;
+		return 1;
+	}
+
+	string output = files.size() == 2 ? string(files[1]) : ktx_name(files[0]);
+	vector<MipImage_t> chain = build_mip_chain(image);
+
+	if (!write_ktx(output.c_str(), chain, format)) {
+		cout << "Could not write " << output << endl;
+		return 1;
+	}
+
+	cout << files[0] << " -> " << output << " (" << chain.size() << " levels)" << endl;
+	return 0;
+}
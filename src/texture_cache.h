@@ -0,0 +1,394 @@
+// texture_cache.h - precompressed texture cache (KTX 1.1 container)
+//
+// texconv uses this to turn our BMPs into block compressed textures with a full
+// mip chain, and load_texture() uses it to read them back. Reading is one
+// file read; every level is then handed to the driver as-is.
+//
+// No GL in here on purpose, the converter doesn't link against it. The format
+// enums below are the GL ones, so they can go straight into glCompressedTexImage2D.
+
+#ifndef TEXTURE_CACHE_H
+#define TEXTURE_CACHE_H
+
+#include <string>
+#include <vector>
+#include <fstream>
+
+#include <string.h>
+#include <stdlib.h>
+
+#include "bitmap.h"
+
+// GL enums we write into / read out of the KTX header
+#define KTX_UNSIGNED_BYTE            0x1401
+#define KTX_RGB                      0x1907
+#define KTX_RGBA                     0x1908
+#define KTX_RGBA8                    0x8058
+#define KTX_COMPRESSED_RGB_S3TC_DXT1 0x83F0 // BC1
+#define KTX_COMPRESSED_RGBA_S3TC_DXT5 0x83F3 // BC3
+
+#define KTX_ENDIAN_REF 0x04030201
+#define KTX_MAX_SIZE 65536 // widest / tallest texture we'll read, keeps the level sizes from overflowing
+
+static const uint8_t ktx_identifier[12] = { 0xAB, 0x4B, 0x54, 0x58, 0x20, 0x31, 0x31, 0xBB, 0x0D, 0x0A, 0x1A, 0x0A };
+
+typedef struct KtxHeader_struct {
+	uint8_t identifier[12];
+	uint32_t endianness;
+	uint32_t gl_type;
+	uint32_t gl_type_size;
+	uint32_t gl_format;
+	uint32_t gl_internal_format;
+	uint32_t gl_base_internal_format;
+	uint32_t pixel_width;
+	uint32_t pixel_height;
+	uint32_t pixel_depth;
+	uint32_t array_elements;
+	uint32_t faces;
+	uint32_t mip_levels;
+	uint32_t key_value_bytes;
+} KtxHeader_t;
+
+typedef struct KtxLevel_struct {
+	unsigned int width;
+	unsigned int height;
+	unsigned int size;
+	const uint8_t *data; // points into KtxImage::m_file
+} KtxLevel_t;
+
+// bytes in a w x h level of format, as write_ktx() writes it (0 for a format it doesn't write)
+inline uint64_t ktx_level_size(uint32_t format, unsigned int w, unsigned int h) {
+	uint64_t blocks = (uint64_t) ((w + 3) / 4) * ((h + 3) / 4);
+	if (format == KTX_COMPRESSED_RGB_S3TC_DXT1) return blocks * 8;
+	if (format == KTX_COMPRESSED_RGBA_S3TC_DXT5) return blocks * 16;
+	if (format == KTX_RGBA8) return (uint64_t) w * h * 4;
+	return 0;
+}
+
+class KtxImage {
+	private:
+		std::vector<uint8_t> m_file;
+
+	public:
+		KtxHeader_t header;
+		std::vector<KtxLevel_t> levels;
+
+		bool is_compressed() {
+			return header.gl_type == 0;
+		}
+
+		bool load(const char *filename) {
+			std::ifstream file(filename, std::ios::binary | std::ios::in | std::ios::ate);
+			if (!file.is_open()) return false;
+
+			std::streamsize size = file.tellg();
+			if (size < (std::streamsize) sizeof(KtxHeader_t)) return false;
+
+			m_file.resize(size);
+			file.seekg(0, std::ios::beg);
+			if (!file.read((char*) &m_file[0], size)) return false;
+
+			memcpy(&header, &m_file[0], sizeof(KtxHeader_t));
+			if (memcmp(header.identifier, ktx_identifier, sizeof(ktx_identifier)) != 0) return false;
+			if (header.endianness != KTX_ENDIAN_REF) return false; // we only ever write native order
+			if (header.faces != 1 || header.array_elements != 0 || header.pixel_depth != 0) return false;
+			if (header.pixel_width == 0 || header.pixel_height == 0 || header.pixel_width > KTX_MAX_SIZE || header.pixel_height > KTX_MAX_SIZE) return false;
+
+			// only what write_ktx() makes, the driver reads the levels by these and not by their sizes
+			if (header.gl_internal_format == KTX_RGBA8) {
+				if (header.gl_format != KTX_RGBA || header.gl_type != KTX_UNSIGNED_BYTE) return false;
+			} else if (header.gl_internal_format == KTX_COMPRESSED_RGB_S3TC_DXT1 || header.gl_internal_format == KTX_COMPRESSED_RGBA_S3TC_DXT5) {
+				if (header.gl_format != 0 || header.gl_type != 0) return false;
+			} else return false;
+
+			size_t offset = sizeof(KtxHeader_t) + header.key_value_bytes;
+			unsigned int w = header.pixel_width;
+			unsigned int h = header.pixel_height;
+			unsigned int count = header.mip_levels ? header.mip_levels : 1;
+			unsigned int full_chain = 1;
+			for (unsigned int m = w > h ? w : h; m > 1; m /= 2) full_chain++;
+			if (count > full_chain) return false; // levels past 1x1
+
+			levels.clear();
+			for (unsigned int i = 0; i < count; i++) {
+				if (offset + 4 > m_file.size()) return false;
+				KtxLevel_t level;
+				memcpy(&level.size, &m_file[offset], 4);
+				offset += 4;
+				if (offset + level.size > m_file.size()) return false;
+				// a truncated or stale file, the driver would read past the end of it
+				if (level.size != ktx_level_size(header.gl_internal_format, w, h)) return false;
+
+				level.width = w;
+				level.height = h;
+				level.data = &m_file[offset];
+				levels.push_back(level);
+
+				offset += (level.size + 3) & ~3;
+				w = w > 1 ? w / 2 : 1;
+				h = h > 1 ? h / 2 : 1;
+			}
+			return true;
+		}
+};
+
+////////////////////////////////////////////// mip generation
+
+// one RGBA8 image, tightly packed, rows in bitmap order (bottom up)
+typedef struct MipImage_struct {
+	unsigned int width;
+	unsigned int height;
+	std::vector<RGBA> texels;
+} MipImage_t;
+
+// 2x2 box filter. odd sizes clamp the last row/column instead of reading past it.
+inline MipImage_t downsample(const MipImage_t &src) {
+	MipImage_t dst;
+	dst.width = src.width > 1 ? src.width / 2 : 1;
+	dst.height = src.height > 1 ? src.height / 2 : 1;
+	dst.texels.resize(dst.width * dst.height);
+
+	for (unsigned int y = 0; y < dst.height; y++) {
+		unsigned int y0 = y * 2 < src.height ? y * 2 : src.height - 1;
+		unsigned int y1 = y0 + 1 < src.height ? y0 + 1 : y0;
+		for (unsigned int x = 0; x < dst.width; x++) {
+			unsigned int x0 = x * 2 < src.width ? x * 2 : src.width - 1;
+			unsigned int x1 = x0 + 1 < src.width ? x0 + 1 : x0;
+
+			const RGBA &a = src.texels[y0 * src.width + x0];
+			const RGBA &b = src.texels[y0 * src.width + x1];
+			const RGBA &c = src.texels[y1 * src.width + x0];
+			const RGBA &d = src.texels[y1 * src.width + x1];
+
+			RGBA &out = dst.texels[y * dst.width + x];
+			out.Red   = (a.Red   + b.Red   + c.Red   + d.Red   + 2) / 4;
+			out.Green = (a.Green + b.Green + c.Green + d.Green + 2) / 4;
+			out.Blue  = (a.Blue  + b.Blue  + c.Blue  + d.Blue  + 2) / 4;
+			out.Alpha = (a.Alpha + b.Alpha + c.Alpha + d.Alpha + 2) / 4;
+		}
+	}
+	return dst;
+}
+
+inline std::vector<MipImage_t> build_mip_chain(CBitmap &image) {
+	std::vector<MipImage_t> chain(1);
+	chain[0].width = image.GetWidth();
+	chain[0].height = image.GetHeight();
+	chain[0].texels.resize(chain[0].width * chain[0].height);
+	memcpy(&chain[0].texels[0], image.GetBits(), chain[0].texels.size() * sizeof(RGBA));
+
+	while (chain.back().width > 1 || chain.back().height > 1) {
+		chain.push_back(downsample(chain.back()));
+	}
+	return chain;
+}
+
+////////////////////////////////////////////// block compression
+
+// Bounding box BC1/BC3 encoder (inset the RGB box a little, then snap every texel
+// to the nearest of the 4 palette entries). Not the best quality out there but it
+// runs at load-time speeds and facades don't need more.
+
+inline uint16_t pack_565(int r, int g, int b) {
+	return (uint16_t) (((r >> 3) << 11) | ((g >> 2) << 5) | (b >> 3));
+}
+
+inline void unpack_565(uint16_t c, int *rgb) {
+	rgb[0] = ((c >> 11) & 0x1f) * 255 / 31;
+	rgb[1] = ((c >> 5) & 0x3f) * 255 / 63;
+	rgb[2] = (c & 0x1f) * 255 / 31;
+}
+
+// gathers the 4x4 block at (bx, by), clamping at the image edges
+inline void fetch_block(const MipImage_t &img, unsigned int bx, unsigned int by, RGBA block[16]) {
+	for (unsigned int y = 0; y < 4; y++) {
+		unsigned int sy = by * 4 + y < img.height ? by * 4 + y : img.height - 1;
+		for (unsigned int x = 0; x < 4; x++) {
+			unsigned int sx = bx * 4 + x < img.width ? bx * 4 + x : img.width - 1;
+			block[y * 4 + x] = img.texels[sy * img.width + sx];
+		}
+	}
+}
+
+inline void encode_bc1_block(const RGBA block[16], uint8_t out[8]) {
+	int lo[3] = { 255, 255, 255 };
+	int hi[3] = { 0, 0, 0 };
+	for (int i = 0; i < 16; i++) {
+		int c[3] = { block[i].Red, block[i].Green, block[i].Blue };
+		for (int k = 0; k < 3; k++) {
+			if (c[k] < lo[k]) lo[k] = c[k];
+			if (c[k] > hi[k]) hi[k] = c[k];
+		}
+	}
+
+	// pull the endpoints in by 1/16 of the range, cuts down on outliers dominating
+	for (int k = 0; k < 3; k++) {
+		int inset = (hi[k] - lo[k]) >> 4;
+		lo[k] += inset;
+		hi[k] -= inset;
+	}
+
+	uint16_t c0 = pack_565(hi[0], hi[1], hi[2]);
+	uint16_t c1 = pack_565(lo[0], lo[1], lo[2]);
+	uint32_t indices = 0;
+
+	if (c0 < c1) {
+		uint16_t t = c0; c0 = c1; c1 = t;
+	}
+
+	if (c0 != c1) {
+		// c0 > c1 selects the opaque 4 colour mode
+		int palette[4][3];
+		unpack_565(c0, palette[0]);
+		unpack_565(c1, palette[1]);
+		for (int k = 0; k < 3; k++) {
+			palette[2][k] = (2 * palette[0][k] + palette[1][k]) / 3;
+			palette[3][k] = (palette[0][k] + 2 * palette[1][k]) / 3;
+		}
+
+		for (int i = 0; i < 16; i++) {
+			int best = 0;
+			int best_dist = 0x7fffffff;
+			for (int p = 0; p < 4; p++) {
+				int dr = block[i].Red - palette[p][0];
+				int dg = block[i].Green - palette[p][1];
+				int db = block[i].Blue - palette[p][2];
+				int dist = dr * dr + dg * dg + db * db;
+				if (dist < best_dist) {
+					best_dist = dist;
+					best = p;
+				}
+			}
+			indices |= best << (i * 2);
+		}
+	}
+
+	out[0] = c0 & 0xff; out[1] = c0 >> 8;
+	out[2] = c1 & 0xff; out[3] = c1 >> 8;
+	out[4] = indices & 0xff;
+	out[5] = (indices >> 8) & 0xff;
+	out[6] = (indices >> 16) & 0xff;
+	out[7] = indices >> 24;
+}
+
+inline void encode_bc3_alpha_block(const RGBA block[16], uint8_t out[8]) {
+	int a0 = 0, a1 = 255;
+	for (int i = 0; i < 16; i++) {
+		if (block[i].Alpha > a0) a0 = block[i].Alpha;
+		if (block[i].Alpha < a1) a1 = block[i].Alpha;
+	}
+
+	uint64_t indices = 0;
+	if (a0 != a1) {
+		// a0 > a1 selects the 8 value interpolated mode
+		int palette[8];
+		palette[0] = a0;
+		palette[1] = a1;
+		for (int p = 1; p < 7; p++) {
+			palette[p + 1] = ((7 - p) * a0 + p * a1) / 7;
+		}
+
+		for (int i = 0; i < 16; i++) {
+			int best = 0;
+			int best_dist = 256;
+			for (int p = 0; p < 8; p++) {
+				int dist = abs(block[i].Alpha - palette[p]);
+				if (dist < best_dist) {
+					best_dist = dist;
+					best = p;
+				}
+			}
+			indices |= (uint64_t) best << (i * 3);
+		}
+	}
+
+	out[0] = a0;
+	out[1] = a1;
+	for (int i = 0; i < 6; i++) {
+		out[2 + i] = (indices >> (i * 8)) & 0xff;
+	}
+}
+
+// compresses one mip level. format is KTX_COMPRESSED_RGB_S3TC_DXT1 or KTX_COMPRESSED_RGBA_S3TC_DXT5
+inline std::vector<uint8_t> compress_level(const MipImage_t &img, uint32_t format) {
+	unsigned int blocks_x = (img.width + 3) / 4;
+	unsigned int blocks_y = (img.height + 3) / 4;
+	unsigned int block_bytes = (format == KTX_COMPRESSED_RGB_S3TC_DXT1) ? 8 : 16;
+
+	std::vector<uint8_t> out(blocks_x * blocks_y * block_bytes);
+	uint8_t *dst = &out[0];
+	RGBA block[16];
+
+	for (unsigned int by = 0; by < blocks_y; by++) {
+		for (unsigned int bx = 0; bx < blocks_x; bx++) {
+			fetch_block(img, bx, by, block);
+			if (block_bytes == 16) {
+				encode_bc3_alpha_block(block, dst);
+				dst += 8;
+			}
+			encode_bc1_block(block, dst);
+			dst += 8;
+		}
+	}
+	return out;
+}
+
+////////////////////////////////////////////// writing
+
+// format is one of the KTX_COMPRESSED_* enums, or KTX_RGBA8 for an uncompressed (but still premipped) cache
+inline bool write_ktx(const char *filename, const std::vector<MipImage_t> &chain, uint32_t format) {
+	std::ofstream file(filename, std::ios::out | std::ios::binary);
+	if (!file.is_open()) return false;
+
+	KtxHeader_t header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.identifier, ktx_identifier, sizeof(ktx_identifier));
+	header.endianness = KTX_ENDIAN_REF;
+	header.pixel_width = chain[0].width;
+	header.pixel_height = chain[0].height;
+	header.faces = 1;
+	header.mip_levels = chain.size();
+	header.gl_internal_format = format;
+
+	if (format == KTX_RGBA8) {
+		header.gl_type = KTX_UNSIGNED_BYTE;
+		header.gl_type_size = 1;
+		header.gl_format = KTX_RGBA;
+		header.gl_base_internal_format = KTX_RGBA;
+	} else {
+		header.gl_type_size = 1;
+		header.gl_base_internal_format = (format == KTX_COMPRESSED_RGB_S3TC_DXT1) ? KTX_RGB : KTX_RGBA;
+	}
+
+	file.write((char*) &header, sizeof(header));
+
+	for (size_t i = 0; i < chain.size(); i++) {
+		std::vector<uint8_t> data;
+		if (format == KTX_RGBA8) {
+			data.resize(chain[i].texels.size() * sizeof(RGBA));
+			memcpy(&data[0], &chain[i].texels[0], data.size());
+		} else {
+			data = compress_level(chain[i], format);
+		}
+
+		uint32_t size = data.size();
+		file.write((char*) &size, 4);
+		file.write((char*) &data[0], size);
+
+		// mip padding, only ever hit by RGBA8 levels that aren't 4 byte multiples (they always are)
+		uint32_t pad = 0;
+		file.write((char*) &pad, ((size + 3) & ~3) - size);
+	}
+
+	return file.good();
+}
+
+// tex0.bmp -> tex0.ktx
+inline std::string ktx_name(const char *filename) {
+	std::string name(filename);
+	size_t dot = name.rfind('.');
+	if (dot != std::string::npos) name.erase(dot);
+	return name + ".ktx";
+}
+
+#endif
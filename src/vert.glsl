@@ -1,12 +1,30 @@
-uniform vec3 sun_pos;
+#version 330 core
 
-varying vec2 texCoord;
-varying float diffVal;
+#include "frame.glsl"
+#include "lighting.glsl"
+
+layout(location = 0) in vec3 position; // world space, or car space for the instanced cars
+layout(location = 1) in vec3 normal;
+layout(location = 2) in vec2 uv;
+layout(location = 3) in vec4 color;
+layout(location = 5) in vec4 instance; // xyz offset, w degrees about y. zero outside the car draw
+layout(location = 6) in vec4 instance_color; // white outside the car draw
+
+out vec2 texCoord;
+out vec4 vertColor;
+out vec3 worldNormal; // lit per fragment
+out vec3 worldPos;
+out float viewDepth;
 
 void main() {
-	gl_FrontColor = gl_Color;
-	gl_Position = gl_ModelViewProjectionMatrix * gl_Vertex;
-	texCoord = gl_MultiTexCoord0.xy;
-	
-	diffVal = max(dot(normalize(gl_NormalMatrix*gl_Normal), normalize(sun_pos)), 0.0);
+	float a = radians(instance.w);
+	mat3 rotate = mat3(cos(a), 0.0, -sin(a),  0.0, 1.0, 0.0,  sin(a), 0.0, cos(a));
+
+	worldPos = rotate * position + instance.xyz;
+	gl_Position = view_projection * vec4(worldPos, 1.0);
+	viewDepth = -(view * vec4(worldPos, 1.0)).z;
+	texCoord = uv;
+	vertColor = color * instance_color;
+
+	worldNormal = rotate * normal;
 }